@@ -0,0 +1,430 @@
+// Micro-benchmarks of the hot paths of the core: opcode dispatch on each
+// engine, memory accesses by region, operand addressing, the stack, and
+// cartridge loading. The results are printed as JSON, to compare builds.
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "cartridge.hpp"
+#include "cpu.hpp"
+#include "mmu.hpp"
+
+static volatile u64 sink;  // Results go here, so the work isn't optimized away.
+
+static const char *mode_names[] = {"IMM", "ZPG", "ZPX", "ZPY", "ABS", "ABX", "ABY",
+                                   "INX", "INY", "ACCUM", "IMPL", "REL", "IND"};
+
+struct bench_options {
+  std::string filter;      // Only run the benchmarks whose name contains it.
+  double min_time = 0.01;  // Seconds per repetition.
+  int repeats = 5;         // The median is reported.
+  std::vector<std::string> roms;
+};
+
+struct bench_result {
+  std::string name;
+  std::string group;
+  u64 ops;           // Per repetition.
+  double ns_per_op;  // Median of the repetitions.
+  double spread;     // (slowest - fastest) / median.
+};
+
+// Runs the benchmarks and collects their results. A benchmark is a function
+// doing a given number of rounds of work, and returning the operations done.
+class bench_runner {
+  const bench_options &options;
+  std::vector<bench_result> results;
+
+ public:
+  explicit bench_runner(const bench_options &_options) : options(_options) {}
+
+  void run(const std::string &group, const std::string &name,
+           const std::function<u64(u64 rounds)> &body) {
+    std::string full_name = group + "/" + name;
+    if (full_name.find(options.filter) == std::string::npos) return;
+
+    // Double the rounds until a repetition takes long enough to time.
+    u64 rounds = 1, ops = 0;
+    for (;;) {
+      auto start = std::chrono::steady_clock::now();
+      ops = body(rounds);
+      double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start)
+                           .count();
+      if (seconds >= options.min_time || rounds >= (u64(1) << 40)) break;
+      rounds *= seconds > options.min_time / 8 ? 2 : 8;
+    }
+
+    std::vector<double> times;
+    for (int ii = 0; ii < options.repeats; ii++) {
+      auto start = std::chrono::steady_clock::now();
+      ops = body(rounds);
+      times.push_back(std::chrono::duration<double, std::nano>(
+                          std::chrono::steady_clock::now() - start)
+                          .count() /
+                      (ops ? ops : 1));
+    }
+    std::sort(times.begin(), times.end());
+    double median = times[times.size() / 2];
+    results.push_back({full_name, group, ops, median, (times.back() - times.front()) / median});
+  }
+
+  bool write_json(std::FILE *out) const;
+};
+
+bool bench_runner::write_json(std::FILE *out) const {
+#ifdef NESCPP_LAZY_FLAGS
+  const char *lazy_flags = "true";
+#else
+  const char *lazy_flags = "false";
+#endif
+  std::fprintf(out, "{\n  \"context\": {\n");
+  std::fprintf(out, "    \"compiler\": \"%s\",\n", __VERSION__);
+  std::fprintf(out, "    \"lazy_flags\": %s,\n", lazy_flags);
+  std::fprintf(out, "    \"min_time_s\": %g,\n", options.min_time);
+  std::fprintf(out, "    \"repeats\": %d\n  },\n", options.repeats);
+  std::fprintf(out, "  \"benchmarks\": [");
+  for (std::size_t ii = 0; ii < results.size(); ii++) {
+    const bench_result &result = results[ii];
+    std::fprintf(out, "%s\n    {\"name\": \"%s\", \"group\": \"%s\", \"ops\": %llu, ",
+                 ii ? "," : "", result.name.c_str(), result.group.c_str(),
+                 (unsigned long long)result.ops);
+    double per_second = result.ns_per_op > 0 ? 1e9 / result.ns_per_op : 0;
+    std::fprintf(out, "\"ns_per_op\": %.3f, \"ops_per_sec\": %.0f, ", result.ns_per_op,
+                 per_second);
+    // An operation of the dispatch benchmarks is an instruction.
+    if (result.group == "dispatch")
+      std::fprintf(out, "\"instructions_per_sec\": %.0f, ", per_second);
+    std::fprintf(out, "\"spread\": %.3f}", result.spread);
+  }
+  std::fprintf(out, "\n  ]\n}\n");
+  return !std::ferror(out);
+}
+
+// ------------------- Opcode dispatch ----------------------- //
+// A program repeating one instruction, then jumping back to the start. Its
+// operands point into RAM, so every instruction can run forever: zero page at
+// 0x10, absolute at 0x0300, and the zero page pointers all hold 0x0303.
+// Branches skip 0 bytes, so go on to the next copy taken or not, and jumps go
+// to it. JSR calls an RTS, and BRK goes to an RTI, which are timed that way.
+static const u16 code_start = 0x8000;
+static const u16 subroutine = 0xF000;  // RTS, and then RTI for BRK.
+static const u16 pointers = 0x0400;    // JMP (ind) pointers, one per copy.
+static const int copies = 256;
+
+static void load_program(cpu &machine, u8 opcode) {
+  cpu_memory &mem = machine.get_memory();
+  for (u16 address = 0x00; address < 0x100; address++) mem.write_address(address, 0x03);
+
+  const opcode_info &info = opcode_infos[opcode];
+  u16 pc = code_start;
+  for (int ii = 0; ii < copies; ii++) {
+    u16 next = pc + mode_length(info.mode) + (info.op == o_BRK);  // BRK skips a byte.
+    u16 operand = 0;
+    switch (info.mode) {
+      case m_ZPG:
+      case m_ZPX:
+      case m_ZPY:
+        operand = 0x10;
+        break;
+      case m_ABS:
+        operand = info.op == o_JMP ? next : info.op == o_JSR ? subroutine : 0x0300;
+        break;
+      case m_ABX:
+      case m_ABY:
+        operand = 0x0300;
+        break;
+      case m_INX:
+      case m_INY:
+        operand = 0x80;
+        break;
+      case m_IND:
+        operand = pointers + 2 * ii;
+        mem.write_address(operand, get_low_byte(next));
+        mem.write_address(operand + 1, get_high_byte(next));
+        break;
+      default:  // Immediate operands, and branch offsets, are 0.
+        break;
+    }
+    mem.write_address(pc, opcode);
+    if (mode_length(info.mode) > 1) mem.write_address(pc + 1, get_low_byte(operand));
+    if (mode_length(info.mode) > 2) mem.write_address(pc + 2, get_high_byte(operand));
+    pc = next;
+  }
+  mem.write_address(pc, 0x4C);  // JMP code_start
+  mem.write_address(pc + 1, get_low_byte(code_start));
+  mem.write_address(pc + 2, get_high_byte(code_start));
+
+  mem.write_address(subroutine, 0x60);      // RTS
+  mem.write_address(subroutine + 1, 0x40);  // RTI
+  const u16 vectors[] = {0xFFFC, code_start, 0xFFFE, subroutine + 1};
+  for (int ii = 0; ii < 4; ii += 2) {
+    mem.write_address(vectors[ii], get_low_byte(vectors[ii + 1]));
+    mem.write_address(vectors[ii] + 1, get_high_byte(vectors[ii + 1]));
+  }
+  machine.reset();
+}
+
+static void bench_dispatch(bench_runner &runner) {
+  const std::pair<cpu_engine, const char *> engines[] = {
+      {cpu_engine::table, "table"},
+      {cpu_engine::switch_case, "switch"},
+      {cpu_engine::decoded, "decoded"},
+  };
+
+  for (int opcode = 0; opcode < 256; opcode++) {
+    const opcode_info &info = opcode_infos[opcode];
+    // RTS and RTI only run paired with JSR and BRK.
+    if (info.op == o_XXX || info.op == o_RTS || info.op == o_RTI) continue;
+
+    std::string name = mnemonic_names[info.op];
+    if (info.op == o_JSR) name += "+RTS";
+    if (info.op == o_BRK) name += "+RTI";
+    name += std::string("/") + mode_names[info.mode];
+
+    for (const auto &engine : engines) {
+      std::unique_ptr<cpu> machine(new cpu);
+      machine->set_engine(engine.first);
+      load_program(*machine, opcode);
+      runner.run("dispatch", name + "/" + engine.second, [&machine](u64 rounds) {
+        u64 instructions = machine->get_instructions();
+        machine->run_for_cycles(rounds * 1000);
+        return machine->get_instructions() - instructions;
+      });
+    }
+  }
+}
+
+// ------------------- Memory ------------------------------- //
+// Stands for a device, as the console or a mapper.
+class null_device : public mem_handler {
+  u8 latch = 0;
+
+ public:
+  u8 read(u16 address) override { return latch ^ get_low_byte(address); }
+  void write(u16, u8 data) override { latch = data; }
+};
+
+static void bench_memory(bench_runner &runner) {
+  // Mapped like a cartridge and a console would: the PPU registers and their
+  // mirrors through the built in slow path, I/O to a device, and ROM read
+  // directly with its writes going to the mapper.
+  static std::vector<u8> rom(0x8000, 0xEA);
+  static null_device device;
+  std::unique_ptr<cpu_memory> mem(new cpu_memory);
+  mem->zeros();
+  mem->map_handler(0x40, 1, &device);
+  mem->map_handler(0x80, 0x80, &device);
+  mem->map_read(0x80, 0x80, rom.data());
+
+  struct region {
+    const char *name;
+    u16 base;
+    u16 size;  // A power of two.
+  };
+  const region regions[] = {
+      {"ram", 0x0000, 0x0800},     {"ram_mirror", 0x1000, 0x0800},
+      {"ppu_regs", 0x2000, 0x2000}, {"io_device", 0x4000, 0x0100},
+      {"prg_ram", 0x6000, 0x2000},  {"prg_rom", 0x8000, 0x8000},
+  };
+  const u64 accesses = 4096;
+
+  cpu_memory &m = *mem;
+  for (const region &area : regions) {
+    const u16 base = area.base, mask = area.size - 1;
+    // A stride of 97 walks the whole region, not in order.
+    runner.run("memory", std::string("read/") + area.name, [&m, base, mask](u64 rounds) {
+      u8 sum = 0;
+      for (u64 round = 0; round < rounds; round++)
+        for (u64 ii = 0; ii < accesses; ii++) sum += m.read_address(base + ((ii * 97) & mask));
+      sink = sink + sum;
+      return rounds * accesses;
+    });
+    runner.run("memory", std::string("write/") + area.name, [&m, base, mask](u64 rounds) {
+      for (u64 round = 0; round < rounds; round++)
+        for (u64 ii = 0; ii < accesses; ii++) m.write_address(base + ((ii * 97) & mask), u8(ii));
+      return rounds * accesses;
+    });
+  }
+}
+
+// ------------------- CPU helpers --------------------------- //
+// The addressing modes are known at compile time in the opcode handlers, so
+// they are here too. Immediate operands have no address to work out.
+class cpu_bench {
+  static const u64 operations = 4096;
+
+ public:
+  template <mem_mode mode>
+  static void get_address(bench_runner &runner, cpu &machine) {
+    runner.run("get_address", mode_names[mode], [&machine](u64 rounds) {
+      cpu_registers r = machine.regs;
+      u16 sum = 0;
+      for (u64 round = 0; round < rounds; round++) {
+        for (u64 ii = 0; ii < operations; ii++) {
+          r.operand = u16(ii * 0x0101 + round);
+          r.X = r.Y = u8(ii);
+          sum += machine.get_address(r, mode);
+        }
+      }
+      sink = sink + sum + machine.page_crossed;
+      return rounds * operations;
+    });
+  }
+
+  // A push or a pop is an operation.
+  static void stack(bench_runner &runner, cpu &machine) {
+    runner.run("stack", "push_pop", [&machine](u64 rounds) {
+      cpu_registers r = machine.regs;
+      u8 sum = 0;
+      for (u64 round = 0; round < rounds; round++) {
+        for (u64 ii = 0; ii < operations / 2; ii++) machine.push_stack(r, u8(ii));
+        for (u64 ii = 0; ii < operations / 2; ii++) sum += machine.pop_stack(r);
+      }
+      sink = sink + sum;
+      return rounds * operations;
+    });
+  }
+};
+
+static void bench_cpu_helpers(bench_runner &runner) {
+  std::unique_ptr<cpu> machine(new cpu);
+  cpu_bench::get_address<m_ZPG>(runner, *machine);
+  cpu_bench::get_address<m_ZPX>(runner, *machine);
+  cpu_bench::get_address<m_ZPY>(runner, *machine);
+  cpu_bench::get_address<m_ABS>(runner, *machine);
+  cpu_bench::get_address<m_ABX>(runner, *machine);
+  cpu_bench::get_address<m_ABY>(runner, *machine);
+  cpu_bench::get_address<m_INX>(runner, *machine);
+  cpu_bench::get_address<m_INY>(runner, *machine);
+  cpu_bench::stack(runner, *machine);
+}
+
+// ------------------- Cartridges ---------------------------- //
+// Write an iNES file of the given shape, with random contents. Return its name,
+// or an empty string.
+static std::string write_rom(u8 mapper_number, u8 prg_banks, u8 chr_banks) {
+  const char *dir = std::getenv("TMPDIR");
+  std::string name = std::string(dir ? dir : "/tmp") + "/nesemu_bench_XXXXXX";
+  int fd = mkstemp(&name[0]);
+  if (fd < 0) return "";
+
+  std::vector<u8> data(16 + prg_banks * 0x4000 + chr_banks * 0x2000);
+  const u8 header[16] = {'N', 'E', 'S', 0x1A, prg_banks, chr_banks, u8(mapper_number << 4),
+                         u8(mapper_number & 0xF0)};
+  std::memcpy(data.data(), header, sizeof(header));
+  u32 seed = 1;
+  for (std::size_t ii = 16; ii < data.size(); ii++) {
+    seed = seed * 1664525 + 1013904223;
+    data[ii] = seed >> 24;
+  }
+
+  bool written = ::write(fd, data.data(), data.size()) == ssize_t(data.size());
+  ::close(fd);
+  if (!written) {
+    unlink(name.c_str());
+    return "";
+  }
+  return name;
+}
+
+// Load a cartridge, check it, and map it, as when a ROM is opened.
+static void bench_cartridge(bench_runner &runner, const std::string &name,
+                            const std::string &file) {
+  std::unique_ptr<cpu_memory> mem(new cpu_memory);
+  interrupt_lines lines;
+  {
+    cartridge cart(file);
+    if (!cart.check_rom()) {
+      std::fprintf(stderr, "Cannot load %s: %s.\n", file.c_str(), cart.get_error().c_str());
+      return;
+    }
+  }
+  runner.run("cartridge", name, [&](u64 rounds) {
+    for (u64 round = 0; round < rounds; round++) {
+      cartridge cart(file);
+      if (cart.check_rom()) cart.attach(*mem, lines);
+      mem->map_default(0x00, 0x100);
+    }
+    return rounds;
+  });
+}
+
+static void bench_cartridges(bench_runner &runner, const std::vector<std::string> &roms) {
+  struct shape {
+    const char *name;
+    u8 mapper_number, prg_banks, chr_banks;
+  };
+  const shape shapes[] = {
+      {"nrom_32k", 0, 2, 1},
+      {"mmc1_256k", 1, 16, 0},
+      {"mmc3_512k", 4, 32, 32},
+  };
+  for (const shape &rom : shapes) {
+    std::string file = write_rom(rom.mapper_number, rom.prg_banks, rom.chr_banks);
+    if (file.empty()) {
+      std::fprintf(stderr, "Cannot write a ROM for %s.\n", rom.name);
+      continue;
+    }
+    bench_cartridge(runner, rom.name, file);
+    unlink(file.c_str());
+  }
+  for (const std::string &file : roms) {
+    std::size_t slash = file.find_last_of('/');
+    bench_cartridge(runner, slash == std::string::npos ? file : file.substr(slash + 1), file);
+  }
+}
+
+static void usage(const char *name) {
+  std::printf("%s [--filter text] [--min-time ms] [--repeats n] [--output file.json]\n", name);
+  std::printf("    [rom.nes...]\n");
+  std::printf("Times opcode dispatch, memory accesses, addressing, the stack, and cartridge\n");
+  std::printf("loading, the given ROMs included, and prints the results as JSON.\n");
+  std::printf("Only the benchmarks whose group/name contains the --filter text are run.\n");
+}
+
+int main(int argc, char **argv) {
+  bench_options options;
+  std::string output;
+  for (int ii = 1; ii < argc; ii++) {
+    std::string arg = argv[ii];
+    bool has_value = ii + 1 < argc;
+    if (arg == "--filter" && has_value) {
+      options.filter = argv[++ii];
+    } else if (arg == "--min-time" && has_value) {
+      options.min_time = std::strtod(argv[++ii], nullptr) / 1000;
+    } else if (arg == "--repeats" && has_value) {
+      options.repeats = std::max(1, std::atoi(argv[++ii]));
+    } else if (arg == "--output" && has_value) {
+      output = argv[++ii];
+    } else if (arg.empty() || arg[0] == '-') {
+      usage(argv[0]);
+      return 1;
+    } else {
+      options.roms.push_back(arg);
+    }
+  }
+
+  bench_runner runner(options);
+  bench_dispatch(runner);
+  bench_memory(runner);
+  bench_cpu_helpers(runner);
+  bench_cartridges(runner, options.roms);
+
+  std::FILE *out = output.empty() ? stdout : std::fopen(output.c_str(), "w");
+  if (!out) {
+    std::fprintf(stderr, "Cannot write %s.\n", output.c_str());
+    return 1;
+  }
+  bool written = runner.write_json(out);
+  if (out != stdout) written = std::fclose(out) == 0 && written;
+  return written ? 0 : 1;
+}
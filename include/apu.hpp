@@ -0,0 +1,246 @@
+#ifndef APU_HPP
+#define APU_HPP
+
+// The audio processing unit of the 2A03: two pulse channels, a triangle, noise,
+// the delta modulation channel and the frame counter, on 0x4000-0x4017.
+//
+// The APU is not stepped with the CPU. It is run lazily, up to a CPU cycle,
+// when one of its registers is accessed, when it may raise an IRQ and at the
+// end of every frame. Running it jumps each channel from one timer expiry to
+// the next, and records the times at which its output level changes. At the
+// end of a frame, these events are turned into a block of samples at once.
+// Muted, the pulse, triangle and noise timers are not run at all, as nothing
+// but their output depends on them.
+#include <vector>
+
+#include "interrupt.hpp"
+#include "mmu.hpp"
+#include "savestate.hpp"
+#include "util.hpp"
+
+// A change of a channel's output level, at a CPU cycle.
+struct level_event {
+  u64 cycle;
+  u8 level;
+};
+
+// The output of a channel: its level before the pending events, and their
+// changes since.
+struct channel_output {
+  u8 start = 0;
+  u8 current = 0;
+  std::vector<level_event> events;
+
+  void change(u64 cycle, u8 level) {
+    if (level == current) return;
+    current = level;
+    events.push_back({cycle, level});
+  }
+};
+
+// Volume, or a decaying level, for pulse and noise.
+struct envelope_unit {
+  bool start = false;
+  bool loop = false;  // Also halts the length counter.
+  bool constant = false;
+  u8 volume = 0;  // The constant volume, or the decay period.
+  u8 divider = 0;
+  u8 decay = 0;
+
+  void clock();  // Quarter frame.
+  u8 output() const { return constant ? volume : decay; }
+  void save(state_buffer &state) const;
+  void load(state_buffer &state);
+};
+
+struct pulse_channel {
+  bool second = false;  // Pulse 2 negates its sweep in two's complement.
+  bool enabled = false;
+  u8 duty = 0;
+  u8 step = 0;  // Position in the duty cycle.
+  u16 period = 0;
+  u8 length = 0;
+  envelope_unit envelope;
+
+  bool sweep_enabled = false;
+  bool sweep_negate = false;
+  bool sweep_reload = false;
+  u8 sweep_period = 0;
+  u8 sweep_shift = 0;
+  u8 sweep_divider = 0;
+
+  u64 next_tick = 0;  // CPU cycle of the next timer expiry.
+
+  u16 sweep_target() const;
+  bool muted() const { return period < 8 || sweep_target() > 0x7FF; }
+  u8 output() const;
+  u64 timer_cycles() const { return (u64(period) + 1) * 2; }
+  void clock_sweep();  // Half frame.
+  void write(u8 reg, u8 data);
+  void save(state_buffer &state) const;
+  void load(state_buffer &state);
+};
+
+struct triangle_channel {
+  bool enabled = false;
+  bool control = false;  // Halts the length counter, and reloads the linear counter.
+  u8 linear_reload_value = 0;
+  u8 linear = 0;
+  bool linear_reload = false;
+  u8 step = 0;  // Of the 32 step sequence.
+  u16 period = 0;
+  u8 length = 0;
+
+  u64 next_tick = 0;
+
+  u8 output() const;
+  u64 timer_cycles() const { return u64(period) + 1; }
+  void clock_linear();  // Quarter frame.
+  void write(u8 reg, u8 data);
+  void save(state_buffer &state) const;
+  void load(state_buffer &state);
+};
+
+struct noise_channel {
+  bool enabled = false;
+  bool short_mode = false;  // Taps bit 6 instead of bit 1, for a metallic tone.
+  u8 period_index = 0;
+  u16 shift = 1;  // 15 bit feedback shift register.
+  u8 length = 0;
+  envelope_unit envelope;
+
+  u64 next_tick = 0;
+
+  u8 output() const { return (shift & 1) || !length ? 0 : envelope.output(); }
+  u64 timer_cycles() const;
+  void write(u8 reg, u8 data);
+  void save(state_buffer &state) const;
+  void load(state_buffer &state);
+};
+
+struct dmc_channel {
+  bool irq_enabled = false;
+  bool loop = false;
+  u8 rate_index = 0;
+  u8 level = 0;  // 7 bit output.
+  u16 sample_address = 0xC000;
+  u16 sample_length = 1;
+
+  u16 address = 0;    // Of the next byte to fetch.
+  u16 remaining = 0;  // Bytes left to fetch.
+  u8 buffer = 0;
+  bool buffer_full = false;
+  u8 shift = 0;
+  u8 bits = 8;  // Left in shift.
+  bool silence = true;
+  bool irq = false;
+
+  u64 next_tick = 0;
+
+  u64 timer_cycles() const;
+  bool active() const { return remaining || buffer_full || !silence; }
+  void restart() {
+    address = sample_address;
+    remaining = sample_length;
+  }
+  void save(state_buffer &state) const;
+  void load(state_buffer &state);
+};
+
+class apu {
+ public:
+  static const u32 cpu_hz = 1789773;  // NTSC.
+
+ private:
+  cpu_memory &mem;         // For DMC sample fetches.
+  interrupt_lines &lines;  // Frame counter and DMC IRQs.
+
+  pulse_channel pulse[2];
+  triangle_channel triangle;
+  noise_channel noise;
+  dmc_channel dmc;
+
+  // Frame counter. http://wiki.nesdev.com/w/index.php/APU_Frame_Counter
+  bool five_step = false;
+  bool irq_inhibit = false;
+  bool frame_irq = false;
+  u64 sequence_start = 0;  // Cycle the step sequence started on.
+  u8 sequence_step = 0;    // Next step of it.
+
+  u64 clock = 0;  // The APU has run up to this CPU cycle.
+
+  // Sound output. The level of every channel over time, and the samples they
+  // were last turned into. Nothing is recorded at a sample rate of 0, nor
+  // while silent.
+  u32 sample_rate = 0;
+  bool silent = false;
+  channel_output outputs[5];  // Pulse 1 and 2, triangle, noise, DMC.
+  u64 samples_done = 0;       // Samples generated since the rate was set.
+  u64 rate_start = 0;         // Cycle sample 0 starts on.
+  double high_pass = 0;       // State of the DC blocking filter.
+  double last_mix = 0;
+  std::vector<i16> samples;
+  std::vector<i16> *sample_target = nullptr;  // Where they go instead, if set.
+
+  u64 sequence_cycle(u8 step) const;  // When a step of the sequence is due.
+  void clock_sequence();              // Run the step that is due.
+  void quarter_frame();
+  void half_frame();
+  void update_irq() {
+    lines.set_irq(irq_frame_counter, frame_irq);
+    lines.set_irq(irq_dmc, dmc.irq);
+  }
+
+  void run_channels(u64 end);  // Timers, from clock to end.
+  void run_dmc(u64 end);
+  void fetch_sample();     // Refill the DMC buffer from memory.
+  bool sounding() const { return sample_rate && !silent; }
+  void record(u64 cycle);  // The output of every channel, if it changed.
+  u64 sample_cycle(u64 sample) const {  // Where a sample starts.
+    return rate_start + sample * cpu_hz / sample_rate;
+  }
+
+ public:
+  apu(cpu_memory &_mem, interrupt_lines &_lines) : mem(_mem), lines(_lines) {}
+  void reset(u64 cycle);
+
+  void run_until(u64 cycle);  // Catch up to a CPU cycle.
+  u64 next_irq() const;       // Run it by this cycle, so that its IRQs are on time.
+  // Likewise for the next DMC fetch, which reads whatever bank is then mapped.
+  u64 next_fetch() const;
+
+  // The registers. The caller runs the APU up to the access first.
+  u8 read_status();  // 0x4015
+  // Until when read_status gives the same again: the next step of the frame
+  // sequence, which clocks the length counters and the frame IRQ. 0 while the
+  // DMC plays, as its fetches change it too.
+  u64 status_stable_until() const {
+    return dmc.remaining ? 0 : sequence_cycle(sequence_step);
+  }
+  void write(u16 address, u8 data);
+
+  // Run up to the end of a frame, and turn its output into samples, 16 bit
+  // mono at the sample rate. A rate of 0 mutes, and skips all of the work.
+  void end_frame(u64 cycle);
+  void set_sample_rate(u32 rate);
+  const std::vector<i16> &get_samples() const {  // Of the last frame.
+    return sample_target ? *sample_target : samples;
+  }
+  // Put the samples of the following frames into target, such as a ring slot,
+  // or back into the APU's own buffer for null. Its capacity is kept.
+  void set_sample_target(std::vector<i16> *target) { sample_target = target; }
+
+  // Run frames that will be rolled back, as run_ahead does: while silent, no
+  // samples are made, and the output is left alone, the last frame's samples
+  // included. A state saved before going silent must be loaded before going
+  // back, and the output then carries on as if those frames never ran.
+  void set_silent(bool _silent) { silent = _silent; }
+
+  // Save states, see savestate.hpp. The pending output is not saved, only
+  // the channel state, so loading starts the sample stream afresh, unless
+  // silent.
+  void save_state(state_buffer &state) const;
+  void load_state(state_buffer &state);
+};
+
+#endif /* APU_HPP */
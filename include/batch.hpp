@@ -0,0 +1,33 @@
+#ifndef BATCH_HPP
+#define BATCH_HPP
+
+// Headless runs of many ROMs at once, for regression suites, training rollouts
+// and ROM validation.
+#include <string>
+
+#include "cpu.hpp"
+#include "util.hpp"
+
+struct batch_options {
+  std::string manifest;                   // The runs, see run_batch.
+  std::string output;                     // Results file. Empty for stdout.
+  unsigned threads = 0;                   // 0 is one per core.
+  cpu_engine engine = cpu_engine::table;  // Engine of every run.
+};
+
+// Run every line of the manifest as its own cartridge and cpu, spread over a
+// work stealing pool. A line is a ROM path, optionally followed by limits:
+//
+//   roms/smb.nes frames=600 cycles=1000000
+//
+// A run stops at whichever limit comes first, 600 frames if none is given. The
+// cycle limit is checked between frames.
+// Blank lines and lines starting with # are skipped. Paths can't hold spaces.
+//
+// The output has a line per run, in manifest order, with tab separated fields:
+// ROM path, frames and cycles run, state hash (see cpu::state_hash) and wall
+// time in ns. A run that fails has "error" and the reason instead. Return the
+// number of failed runs, or -1 if the manifest can't be read.
+int run_batch(const batch_options &options);
+
+#endif /* BATCH_HPP */
@@ -3,16 +3,27 @@
 // Here, we implement the ROM loading functions.
 
 #include <memory>
+#include <string>
 #include <vector>
 
+#include "interrupt.hpp"
+#include "mapped_file.hpp"
+#include "mapper.hpp"
+#include "mmu.hpp"
 #include "rom_bank.hpp"
+#include "savestate.hpp"
 #include "util.hpp"
 
 class cartridge {
-  u8 trainer[512];
-  u8 header[16];
+  mapped_file file;  // The whole ROM file. The banks below point into it.
+  const u8 *trainer = nullptr;
+  u8 header[16] = {};
   rom_bank<16> prg_rom;
   rom_bank<8> chr_rom;
+  std::vector<u8> chr_ram;  // Used instead of CHR ROM, if there is none.
+  std::vector<u8> prg_ram;  // 8 KB at 0x6000-0x7FFF. Every board gets it.
+
+  std::unique_ptr<mapper> board;  // The bank switching logic.
 
   enum mirror_type : bool { horiz = false, vert = true };
   mirror_type mirroring_type;
@@ -26,11 +37,33 @@ class cartridge {
   u8 num_prg_ram;  // In units of 8 KiB
   u8 mapper_number;
 
+  std::string error;  // Why the ROM is not valid, if it is not.
+
  public:
   cartridge() = delete;
-  cartridge(std::string file);  // Load the file into RAM.
-  void print_debug_info();      // Print the header.
-  bool check_rom();             // Checks if the ROM has correct header.
+  cartridge(std::string file_name);  // Map the file into memory.
+  void print_debug_info();           // Print the header.
+  bool check_rom();                  // Checks if the ROM has correct header and size.
+  const std::string &get_error() const { return error; }
+
+  // Hand the CPU address space over to the mapper. Must be a valid ROM.
+  void attach(cpu_memory &mem, interrupt_lines &lines) { board->attach(mem, lines); }
+  mapper &get_mapper() { return *board; }
+  u8 get_mapper_number() const { return mapper_number; }
+
+  // Save states, see savestate.hpp. The RAM on the board and the mapper.
+  void save_state(state_buffer &state) const;
+  void load_state(state_buffer &state);
+
+  // The raw banks, for the mapper.
+  const u8 *prg_data() const { return prg_rom.bank(0); }
+  std::size_t prg_size() const { return prg_rom.get_num_banks() * prg_rom.bank_size; }
+  const u8 *chr_data() const { return chr_rom.bank(0); }
+  std::size_t chr_size() const { return chr_rom.get_num_banks() * chr_rom.bank_size; }
+  bool has_chr_ram() const { return !chr_ram.empty(); }
+  u8 *prg_ram_data() { return prg_ram.data(); }
+  bool has_vertical_mirroring() const { return mirroring_type == vert; }
+  bool has_four_screen_vram() const { return four_screen_vram; }
 };
 
 #endif /* CARTRIDGE_HPP */
@@ -0,0 +1,37 @@
+#ifndef COMPOSE_HPP
+#define COMPOSE_HPP
+
+// Pixel work of the PPU that runs over whole lines: merging the background and
+// sprite layers, and turning NES colour indices into RGBA. Each has a scalar
+// version, the reference, and x86 vector versions working on 16 (SSSE3) or 32
+// (AVX2) pixels at a time. The fastest one the CPU supports is picked at
+// startup from CPUID, and all of them must give the same pixels.
+#include <cstddef>
+
+#include "util.hpp"
+
+// Per pixel flags of the sprite layer.
+enum sprite_flags : u8 { sprite_behind = 1, sprite_zero = 2 };
+
+enum class simd_path : u8 { scalar, ssse3, avx2 };
+
+const char *simd_path_name(simd_path path);
+bool simd_path_supported(simd_path path);  // Built in, and the CPU has it.
+simd_path get_simd_path();                 // What compose_line and to_rgba use.
+bool set_simd_path(simd_path path);        // False if not supported. Not thread safe.
+
+// Merge the layers of a line of 256 pixels into NES colour indices, by sprite
+// priority. Layers hold palette indices 0-31, 0 being transparent. Return true
+// if an opaque pixel of sprite 0 is over an opaque background one, which is a
+// sprite 0 hit. It is never detected at x = 255.
+bool compose_line(const u8 *background, const u8 *sprites, const u8 *flags, const u8 *palette,
+                  u8 colour_mask, u8 *out);
+bool compose_line(simd_path path, const u8 *background, const u8 *sprites, const u8 *flags,
+                  const u8 *palette, u8 colour_mask, u8 *out);
+
+// Convert count colour indices 0-63 to 4 bytes each, R, G, B, A, in that
+// order in memory. Colour emphasis is not applied.
+void to_rgba(const u8 *indices, std::size_t count, u8 *out);
+void to_rgba(simd_path path, const u8 *indices, std::size_t count, u8 *out);
+
+#endif /* COMPOSE_HPP */
@@ -0,0 +1,95 @@
+#ifndef CONSOLE_HPP
+#define CONSOLE_HPP
+
+// The whole machine: a cartridge plugged into the CPU, PPU and APU, and the
+// I/O registers at 0x4000.
+#include "apu.hpp"
+#include "cartridge.hpp"
+#include "cpu.hpp"
+#include "mmu.hpp"
+#include "ppu.hpp"
+#include "savestate.hpp"
+#include "util.hpp"
+
+// How the devices keep time with the CPU.
+enum class console_timing : u8 {
+  // The CPU runs ahead until the next event that the CPU itself must see on
+  // time: NMI, an APU or mapper IRQ, a DMC fetch, or the end of the frame.
+  // The PPU, and the mapper counter it clocks, and the APU are caught up to
+  // the CPU when it accesses them, or at those events.
+  scheduled,
+  // Every device is caught up to the CPU before each instruction. Slow, and
+  // the reference the scheduled timing must match exactly.
+  lockstep,
+};
+
+class console : public mem_handler {
+  cartridge &cart;
+  cpu processor;
+  ppu video;
+  apu audio;
+  u64 frame_count;  // Frames run since power on.
+  console_timing timing;
+
+  // Standard controllers, in both ports. While the strobe is high, the
+  // buttons are latched into the shift registers, which reads then shift out.
+  u8 buttons[2];
+  u8 shifts[2];
+  bool strobe;
+  u8 read_controller(int port);
+
+  // The PPU's work in a frame is a list of events, the start and the hblank of
+  // every line, in order. Event 2 * line starts it, and event 2 * line + 1 is
+  // its hblank, at the dot that clocks the MMC3 counter. An event happens
+  // before any instruction that starts on or after its cycle.
+  static const int events_per_frame = 2 * ppu::lines_per_frame;
+  int next_event;  // The PPU has been run up to this event of the frame.
+  u64 slice_end;   // The CPU is running up to this cycle.
+
+  u64 event_cycle(int event) const;
+  void catch_up(u64 cycle);  // Run the PPU events due by cycle.
+  u64 next_due();            // The first event the CPU must stop at.
+  void reschedule();         // After a write that may have moved it.
+
+ public:
+  // PPU dots in a frame. The CPU runs one cycle every three dots.
+  static const u64 dots_per_frame = u64(ppu::dots_per_line) * ppu::lines_per_frame;
+
+  explicit console(cartridge &_cart);  // The cartridge must be valid, see check_rom.
+  void reset();
+
+  // Run a frame. The CPU runs in slices, and the devices are kept up with it
+  // according to the timing. The APU makes the frame's samples at the end.
+  void run_frame();
+  // Run count frames, drawing only the last, see ppu::set_drawing, and return
+  // its picture. Leaves drawing as it was.
+  const u8 *run_frames(u64 count);
+  void set_timing(console_timing _timing) { timing = _timing; }
+
+  // The buttons held on the controller in port 0 or 1, a bit each, in the order
+  // they are read: A, B, Select, Start, Up, Down, Left, Right from bit 0. They
+  // are input, not state, so save states leave them alone.
+  void set_buttons(int port, u8 _buttons) { buttons[port & 1] = _buttons; }
+
+  cpu &get_cpu() { return processor; }
+  ppu &get_ppu() { return video; }
+  apu &get_apu() { return audio; }
+  cartridge &get_cartridge() { return cart; }
+  u64 get_frames() const { return frame_count; }
+  u64 state_hash();  // Of the CPU, PPU and APU, to compare runs.
+
+  // The registers of the devices, which catch them up first: the PPU at
+  // 0x2000-0x3FFF, the I/O registers at 0x4000-0x40FF, and writes to the
+  // mapper at 0x8000-0xFFFF.
+  u8 read(u16 address) override;
+  void write(u16 address, u8 data) override;
+  // PPUSTATUS and the APU status can be polled by idle loops.
+  u64 stable_until(u16 address) override;
+
+  // Save states, see savestate.hpp. They are taken between frames, when every
+  // device is caught up.
+  void save_state(state_buffer &state);
+  void load_state(state_buffer &state);
+};
+
+#endif /* CONSOLE_HPP */
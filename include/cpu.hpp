@@ -2,7 +2,15 @@
 #define CPU_HPP
 
 // Re-write the CPU class to make cycle counting easier.
+#include <array>
+#include <utility>
+#include <vector>
+
+#include "cartridge.hpp"
+#include "cpu_opcode_info.hpp"
+#include "interrupt.hpp"
 #include "mmu.hpp"
+#include "profiler.hpp"
 #include "util.hpp"
 
 // The status register. It is a 8 bit register, where each bit represents a
@@ -19,128 +27,375 @@ union statReg {
   u8 byte;
 };
 
+// The register file. It is kept apart from the memory and passed to every
+// opcode, so that an execution engine can hold a copy in locals (and hence in
+// machine registers) for a whole run.
+//
+// The C, Z, V and S flags are only accessed through the functions below. When
+// built with NESCPP_LAZY_FLAGS, they are kept outside of P: the last result is
+// stored as is, and the flags are worked out of it when they are observed. The
+// bits in P are then stale until status() is called.
+struct cpu_registers {
+  statReg P;  // Process status register.
+  u8 A;       // accumulator register.
+  u8 X;       // X
+  u8 Y;       // Y
+  u8 SP;      // Stack pointer.
+  u16 PC;     // Program counter.
+
+  u16 operand;  // Operand bytes of the current instruction, little endian. Internal.
+
+#ifdef NESCPP_LAZY_FLAGS
+  u16 nz;  // Z is set if the low byte is 0. S is set if bit 7 or bit 8 is set.
+  u8 c;    // Carry, 0 or 1.
+  u8 v;    // Overflow, 0 or non zero.
+
+  void set_nz(u8 result) { nz = result; }
+  void set_zs(bool zero, bool sign) { nz = (zero ? 0 : 1) | (sign ? 0x100 : 0); }
+  void set_carry(bool val) { c = val; }
+  void set_overflow(bool val) { v = val; }
+  bool zero() const { return (nz & 0xFF) == 0; }
+  bool sign() const { return nz & 0x180; }
+  bool carry() const { return c; }
+  bool overflow() const { return v; }
+
+  u8 status() {
+    P.C = carry();
+    P.Z = zero();
+    P.V = overflow();
+    P.S = sign();
+    return P.byte;
+  }
+  void set_status(u8 byte) {
+    P.byte = byte;
+    set_zs(P.Z.get(), P.S.get());
+    c = P.C.get();
+    v = P.V.get();
+  }
+#else
+  void set_nz(u8 result) {
+    P.Z = (result == 0);     // Zero flag
+    P.S = (result >= 0x80);  // Sign flag
+  }
+  void set_zs(bool zero, bool sign) {
+    P.Z = zero;
+    P.S = sign;
+  }
+  void set_carry(bool val) { P.C = val; }
+  void set_overflow(bool val) { P.V = val; }
+  bool zero() const { return P.Z.get(); }
+  bool sign() const { return P.S.get(); }
+  bool carry() const { return P.C.get(); }
+  bool overflow() const { return P.V.get(); }
+
+  u8 status() { return P.byte; }
+  void set_status(u8 byte) { P.byte = byte; }
+#endif
+};
+
+class trace_recorder;
+
+// The ways of dispatching opcodes. They must produce identical results.
+enum class cpu_engine {
+  table,        // Pointer to member function table. The reference implementation.
+  switch_case,  // One big switch, with registers held in locals.
+  decoded       // The switch, fed from a cache of decoded instructions.
+};
+
+// Counters of the decoded instruction cache.
+struct decode_cache_stats {
+  u64 hits;           // Instructions found decoded.
+  u64 misses;         // Instructions decoded, cached or not.
+  u64 invalidations;  // Times a memory page was remapped or had its code written.
+};
+
+// Counters of the idle loops skipped, see cpu::idle_loop.
+struct idle_loop_stats {
+  u64 skips;         // Times iterations were skipped.
+  u64 cycles;        // Skipped.
+  u64 instructions;  // Skipped.
+};
+
 class cpu {
   // Memory and registers.
-  statReg P;                       // Process status register.
-  u8 A;                            // accumulator register.
-  u8 X;                            // X
-  u8 Y;                            // Y
-  u8 SP;                           // Stack pointer.
-  u16 PC;                          // Program counter.
-  cpu_core_memory<64 * 1024> mem;  // The memory of the machine. 64 KB
+  cpu_registers regs;              // The register file.
+  cpu_memory mem;                  // The memory of the machine. 64 KB
+  interrupt_lines lines;           // IRQ and NMI inputs.
+
+  // Cycle count after opcode execution.
+  u16 cycle_count;
+  bool page_crossed;  // Set by get_address when indexing crossed a page.
+
+  u64 total_cycles;        // Cycles executed since power on.
+  u64 total_instructions;  // Instructions executed since power on.
+  cpu_engine engine;       // Engine used by run_for_cycles.
+
+  // An instruction as kept by the decoded engine. It is valid while its page
+  // has the same generation in the memory map.
+  struct decoded_op {
+    u32 generation;
+    u16 operand;  // Goes to cpu_registers::operand.
+    u8 opcode;    // Selects the handler.
+    u8 length;    // In bytes, operand included.
+  };
+  std::vector<decoded_op> decode_cache;  // Indexed by PC. Allocated on first use.
+  decoded_op uncached_op;                // For code that can't be cached.
+  u64 decode_hits;
+  u64 decode_misses;
+
+#ifdef NESCPP_PROFILE
+  cpu_profiler profiler;  // Fed by every engine.
+#endif
+  trace_recorder *tracer;  // Gets every instruction, if set.
+
+  // The loop last branched back to, see idle_loop. Control flow going anywhere
+  // else clears arrivals, so consecutive arrivals are whole iterations.
+  struct idle_tracker {
+    u16 head;           // Its first instruction.
+    u16 tail;           // The branch or jump back.
+    u8 arrivals;        // At head in a row, up to 3.
+    u8 a, x, y, p, sp;  // Registers at the last arrival.
+    u64 cycle;          // Of the last arrival.
+    u64 stable;         // Until when its reads give the same, as of then.
+
+    // What check_idle_body found: whether it can be skipped, the instructions
+    // in an iteration, and the device registers it reads.
+    bool checked, idle;
+    u8 instructions;
+    u8 reads;
+    u16 read_addresses[8];
+  } loop;
+  bool idle_skip;         // Skip idle loops.
+  u64 run_end;            // Of run_for_cycles, or 0 outside of it.
+  u64 idle_instructions;  // Skipped in this run, added at its end.
+  idle_loop_stats idle_stats;
+
+ public:
+  // NTSC CPU cycles per video frame (341 * 262 / 3 PPU dots, rounded up).
+  static const u64 cycles_per_frame = 29781;
 
   // CPU constructor function.
   cpu();
 
-  // Cycle count after opcode execution.
-  u8 cycle_count;
+  void insert_cartridge(cartridge &cart);  // Let the mapper take 0x6000-0xFFFF.
+  void reset();                            // Load PC from the reset vector.
+
+  u16 step();                      // Execute one instruction. Return cycles taken.
+  u64 run_for_cycles(u64 budget);  // Run until budget is spent. Return cycles run.
+  u64 run_frame();                 // Run until the next frame boundary.
+  // Inside run_for_cycles, handlers see the cycle the instruction started on.
+  u64 get_cycles() const { return total_cycles; }
+  u64 get_instructions() const { return total_instructions; }
+  void set_engine(cpu_engine _engine) { engine = _engine; }
+  decode_cache_stats get_decode_stats() const {
+    return {decode_hits, decode_misses, mem.get_invalidations()};
+  }
+  // Skip the iterations of idle loops, on by default. Runs end exactly the
+  // same either way. Never done while tracing or profiling.
+  void set_idle_skip(bool skip) { idle_skip = skip; }
+  idle_loop_stats get_idle_stats() const { return idle_stats; }
+  const cpu_registers &get_registers() {
+    regs.status();  // Bring P up to date for the observer.
+    return regs;
+  }
+  // Read memory, for debugging. Only pages read directly, with no side effects,
+  // are seen; device registers read as 0, rather than being acknowledged.
+  u8 peek(u16 address) const {
+    const u8 *page = mem.get_read_page(address >> 8);
+    return page ? page[address & 0xFF] : 0;
+  }
+
+  // For the devices around the CPU.
+  cpu_memory &get_memory() { return mem; }
+  interrupt_lines &get_interrupt_lines() { return lines; }
+  void stall(u16 cycles) { cycle_count += cycles; }  // From a handler only, e.g. for DMA.
+  void yield() { lines.yield = true; }  // End run_for_cycles after this instruction.
+  u64 state_hash();  // Hash of the registers and RAM, to compare runs.
+
+  // Where the time went, see cpu_profiler::report. False, printing nothing, if
+  // the profiler is compiled out (see NESCPP_PROFILE).
+  bool print_profile(std::FILE *out, std::size_t top);
+
+  // Record the instructions run from now on, with the registers before each,
+  // or stop with null. See trace.hpp.
+  void set_tracer(trace_recorder *_tracer) { tracer = _tracer; }
+  void jump(u16 address) {  // Start somewhere else than the reset vector.
+    regs.PC = address;
+    loop.arrivals = 0;
+  }
+
+  // Save states, see savestate.hpp. Loading drops the decoded instructions.
+  void save_state(state_buffer &state);
+  void load_state(state_buffer &state);
+
+ private:
+  friend class cpu_bench;  // Times the addressing and stack helpers, see bench/.
+
+  u64 run_table(u64 end);    // Dispatch through opcode_table until cycle end.
+  u64 run_switch(u64 end);   // Dispatch through a switch until cycle end.
+  u64 run_decoded(u64 end);  // Likewise, from decoded instructions.
+
+  const decoded_op &lookup(u16 pc);           // The decoded instruction at pc.
+  NOINLINE const decoded_op &decode(u16 pc);  // Decode on a cache miss.
 
-  // Memory operations.
-  u16 get_address(mem_mode mode);  // Return data address for given memory mode.
-  u8 operand(mem_mode mode);       // Return data stored at said address.
+  template <u8 code>
+  void execute(cpu_registers &r);  // Execute an opcode known at compile time.
+
+  NOINLINE void trace(cpu_registers &r);  // Hand the instruction at r.PC to tracer.
+
+  // Control flow. A jump back, to r.PC from the instruction at tail, may close
+  // an idle loop, and anything else leaves it. Loops found busy are passed
+  // over quickly.
+  void jumped(cpu_registers &r, u16 tail) {
+    if (r.PC > tail)
+      loop.arrivals = 0;
+    else if (!loop.checked || loop.idle || r.PC != loop.head || tail != loop.tail)
+      idle_loop(r, r.PC, tail);
+  }
+  void left_loop() { loop.arrivals = 0; }
+  NOINLINE void idle_loop(cpu_registers &r, u16 head, u16 tail);
+  bool check_idle_body();  // Can loop be skipped, and what does it read.
+
+  // Count an instruction that started at pc, once it has run, or an interrupt.
+  // They compile to nothing without NESCPP_PROFILE.
+  void profile(u16 pc, u8 opcode) {
+#ifdef NESCPP_PROFILE
+    profiler.record(pc, mem.get_read_page(pc >> 8), opcode, cycle_count);
+#else
+    (void)pc;
+    (void)opcode;
+#endif
+  }
+  void profile_interrupt(u16 cycles) {
+#ifdef NESCPP_PROFILE
+    profiler.record_interrupt(cycles);
+#else
+    (void)cycles;
+#endif
+  }
+
+  // Read the operand of an instruction into r.operand, moving PC past it.
+  void fetch_operand(cpu_registers &r, u8 length);
+
+  // Memory operations. Return data address for given memory mode.
+  u16 get_address(cpu_registers &r, mem_mode mode);
+  u8 operand(cpu_registers &r, mem_mode mode);  // Return data stored at said address.
+  u8 load(cpu_registers &r, mem_mode mode, u16 address);  // Read-modify-write source.
+  void store(cpu_registers &r, mem_mode mode, u16 address, u8 data);  // And target.
 
   // Stack operations.
-  void push_stack(u8 data);
-  u8 pop_stack();
+  void push_stack(cpu_registers &r, u8 data);
+  u8 pop_stack(cpu_registers &r);
 
   // Opcodes helper functions.
-  void set_flags(const u8 &result);  // Sets zero and sign flag depending on input.
-  void do_jump(const u8 &offset);    // Performs relative addressing computations.
-  u8 subtract(const u8 &a,
-              const u8 &b);          // Performs a-b and sets relevant flags.
-  u8 add(const u8 &a, const u8 &b);  // Performs a+b and sets the relevant flags.
+  void set_flags(cpu_registers &r, const u8 &result);  // Sets zero and sign flag.
+  void branch(cpu_registers &r, bool taken);  // Performs relative addressing computations.
+  u8 poll_interrupts(cpu_registers &r);       // Take a pending interrupt. Return cycles taken.
+  u8 subtract(cpu_registers &r, const u8 &a,
+              const u8 &b);  // Performs a-b and sets relevant flags.
+  u8 add(cpu_registers &r, const u8 &a,
+         const u8 &b);  // Performs a+b+C and sets the relevant flags.
 
-  // opcode table.
-  typedef void (cpu::*opcode_fn)();
-  opcode_fn opcode_table[256];
+  // opcode table. It is generated from opcode_infos at compile time, and is
+  // shared by every cpu.
+  typedef void (cpu::*opcode_fn)(cpu_registers &r);
+  static const std::array<opcode_fn, 256> opcode_table;
+
+  template <mnemonic op, mem_mode mode>
+  static constexpr opcode_fn handler();  // The handler for op in a given mode.
+  template <std::size_t... codes>
+  static constexpr std::array<opcode_fn, 256> make_opcode_table(std::index_sequence<codes...>);
 
   // Opcodes that require memory operations.
   template <mem_mode mode>
-  void ADC();  // Add memory to accumulator. Add with carry.
+  void ADC(cpu_registers &r);  // Add memory to accumulator. Add with carry.
+  template <mem_mode mode>
+  void AND(cpu_registers &r);  // AND memory with accumulator.
   template <mem_mode mode>
-  void AND();  // AND memory with accumulator.
+  void ASL(cpu_registers &r);  // Shift Left One Bit (Memory or Accumulator)
   template <mem_mode mode>
-  void ASL();  // Shift Left One Bit (Memory or Accumulator)
+  void CMP(cpu_registers &r);  // Compare Memory and Accumulator
   template <mem_mode mode>
-  void CMP();  // Compare Memory and Accumulator
+  void CPX(cpu_registers &r);  // Compare Memory and Index X
   template <mem_mode mode>
-  void CPX();  // Compare Memory and Index X
+  void CPY(cpu_registers &r);  // Compare Memory and Index Y
   template <mem_mode mode>
-  void CPY();  // Compare Memory and Index Y
+  void DEC(cpu_registers &r);  // Decrement Memory by One
   template <mem_mode mode>
-  void DEC();  // Decrement Memory by One
+  void EOR(cpu_registers &r);  // "Exclusive-Or" Memory with Accumulator
   template <mem_mode mode>
-  void EOR();  // "Exclusive-Or" Memory with Accumulator
+  void INC(cpu_registers &r);  // Increment Memory by One
   template <mem_mode mode>
-  void INC();  // Increment Memory by One
+  void LDA(cpu_registers &r);  // Load Accumulator with Memory
   template <mem_mode mode>
-  void LDA();  // Load Accumulator with Memory
+  void LDX(cpu_registers &r);  // Load Index X with Memory
   template <mem_mode mode>
-  void LDX();  // Load Index X with Memory
+  void LDY(cpu_registers &r);  // Load Index Y with Memory
   template <mem_mode mode>
-  void LDY();  // Load Index Y with Memory
+  void LSR(cpu_registers &r);  // Shift Right One Bit (Memory or Accumulator)
   template <mem_mode mode>
-  void LSR();  // Shift Right One Bit (Memory or Accumulator)
+  void ORA(cpu_registers &r);  // "OR" Memory with Accumulator
   template <mem_mode mode>
-  void ORA();  // "OR" Memory with Accumulator
+  void ROL(cpu_registers &r);  // Rotate One Bit Left (Memory or Accumulator)
   template <mem_mode mode>
-  void ROL();  // Rotate One Bit Left (Memory or Accumulator)
+  void ROR(cpu_registers &r);  // Rotate One Bit Right (Memory or Accumulator)
   template <mem_mode mode>
-  void ROR();  // Rotate One Bit Right (Memory or Accumulator)
+  void SBC(cpu_registers &r);  // Subtract Memory from Accumulator with Borrow
   template <mem_mode mode>
-  void SBC();  // Subtract Memory from Accumulator with Borrow
+  void STA(cpu_registers &r);  // Store Accumulator in Memory
   template <mem_mode mode>
-  void STA();  // Store Accumulator in Memory
+  void STX(cpu_registers &r);  // Store Index X in Memory
   template <mem_mode mode>
-  void STX();  // Store Index X in Memory
+  void STY(cpu_registers &r);  // Store Index Y in Memory
   template <mem_mode mode>
-  void STY();  // Store Index Y in Memory
+  void BIT(cpu_registers &r);  // Test Bits in Memory with Accumulator
   template <mem_mode mode>
-  void BIT();  // Test Bits in Memory with Accumulator
+  void XXX(cpu_registers &r);  // Unofficial opcode. Skip the operand, like a NOP.
 
   // No operand opcodes.
-  void BCC();  // Branch on Carry Clear
-  void BCS();  // Branch on Carry Set
-  void BEQ();  // Branch on Result Zero
-
-  void BMI();  // Branch on Result Minus
-  void BNE();  // Branch on Result not Zero
-  void BPL();  // Branch on Result Plus
-  void BRK();  // Force Break
-  void BVC();  // Branch on Overflow Clear
-  void BVS();  // Branch on Overflow Set
-  void CLC();  // Clear Carry Flag
-  void CLD();  // Clear Decimal Mode
-  void CLI();  // Clear interrupt Disable Bit
-  void CLV();  // Clear Overflow Flag
-  void DEX();  // Decrement Index X by One
-  void DEY();  // Decrement Index Y by One
-
-  void INX();      // Increment Index X by One
-  void INY();      // Increment Index Y by One
-  void JMP_IND();  // Jump to New Location, Indirect.
-  void JMP_ABS();  // Jump to New Location, Direct.
-  void JSR();      // Jump to New Location Saving Return Address
-  void NOP();      // No Operation
-  void PHA();      // Push Accumulator on Stack
-  void PHP();      // Push Processor Status on Stack
-  void PLA();      // Pull Accumulator from Stack
-  void PLP();      // Pull Processor Status from Stack
-  void RTI();      // Return from Interrupt
-  void RTS();      // Return from Subroutine
-  void SEC();      // Set Carry Flag
-  void SED();      // Set Decimal Mode
-  void SEI();      // Set Interrupt Disable Status
-
-  void TAX();  // Transfer Accumulator to Index X
-  void TAY();  // Transfer Accumulator to Index Y
-  void TSX();  // Transfer Stack Pointer to Index X
-  void TXA();  // Transfer Index X to Accumulator
-  void TXS();  // Transfer Index X to Stack Pointer
-  void TYA();  // Transfer Index Y to Accumulator
+  void BCC(cpu_registers &r);  // Branch on Carry Clear
+  void BCS(cpu_registers &r);  // Branch on Carry Set
+  void BEQ(cpu_registers &r);  // Branch on Result Zero
+
+  void BMI(cpu_registers &r);  // Branch on Result Minus
+  void BNE(cpu_registers &r);  // Branch on Result not Zero
+  void BPL(cpu_registers &r);  // Branch on Result Plus
+  void BRK(cpu_registers &r);  // Force Break
+  void BVC(cpu_registers &r);  // Branch on Overflow Clear
+  void BVS(cpu_registers &r);  // Branch on Overflow Set
+  void CLC(cpu_registers &r);  // Clear Carry Flag
+  void CLD(cpu_registers &r);  // Clear Decimal Mode
+  void CLI(cpu_registers &r);  // Clear interrupt Disable Bit
+  void CLV(cpu_registers &r);  // Clear Overflow Flag
+  void DEX(cpu_registers &r);  // Decrement Index X by One
+  void DEY(cpu_registers &r);  // Decrement Index Y by One
+
+  void INX(cpu_registers &r);      // Increment Index X by One
+  void INY(cpu_registers &r);      // Increment Index Y by One
+  void JMP_IND(cpu_registers &r);  // Jump to New Location, Indirect.
+  void JMP_ABS(cpu_registers &r);  // Jump to New Location, Direct.
+  void JSR(cpu_registers &r);      // Jump to New Location Saving Return Address
+  void NOP(cpu_registers &r);      // No Operation
+  void PHA(cpu_registers &r);      // Push Accumulator on Stack
+  void PHP(cpu_registers &r);      // Push Processor Status on Stack
+  void PLA(cpu_registers &r);      // Pull Accumulator from Stack
+  void PLP(cpu_registers &r);      // Pull Processor Status from Stack
+  void RTI(cpu_registers &r);      // Return from Interrupt
+  void RTS(cpu_registers &r);      // Return from Subroutine
+  void SEC(cpu_registers &r);      // Set Carry Flag
+  void SED(cpu_registers &r);      // Set Decimal Mode
+  void SEI(cpu_registers &r);      // Set Interrupt Disable Status
+
+  void TAX(cpu_registers &r);  // Transfer Accumulator to Index X
+  void TAY(cpu_registers &r);  // Transfer Accumulator to Index Y
+  void TSX(cpu_registers &r);  // Transfer Stack Pointer to Index X
+  void TXA(cpu_registers &r);  // Transfer Index X to Accumulator
+  void TXS(cpu_registers &r);  // Transfer Index X to Stack Pointer
+  void TYA(cpu_registers &r);  // Transfer Index Y to Accumulator
 };
 
-// Include the templated function implementation.
+// Include the templated and inline function implementation.
+#include "cpu_memory_ops_impl.hpp"
 #include "cpu_opcodes_impl.hpp"
 
 #endif /* CPU_HPP */
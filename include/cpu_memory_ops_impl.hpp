@@ -0,0 +1,125 @@
+#ifndef CPU_MEMORY_OPS_IMPL_HPP
+#define CPU_MEMORY_OPS_IMPL_HPP
+
+// Addressing and stack helpers. They are inline, so that the switch on the
+// memory mode folds away in the templated opcodes.
+#include "cpu.hpp"
+#include "util.hpp"
+
+// ------------- Data return ------------------------------------- //
+inline void cpu::fetch_operand(cpu_registers &r, u8 length) {
+  // The bytes are read in order, and only those of the instruction, as a read
+  // can have side effects.
+  if (length > 1) r.operand = mem[r.PC++];
+  if (length > 2) r.operand |= mem[r.PC++] << 8;
+}
+
+inline const cpu::decoded_op &cpu::lookup(u16 pc) {
+  // Hits are not counted here, see run_decoded.
+  const decoded_op &op = decode_cache[pc];
+  if (op.generation == mem.get_generation(pc >> 8)) return op;
+  return decode(pc);
+}
+
+inline u8 cpu::operand(cpu_registers &r, mem_mode mode) {
+  // An immediate operand is in the instruction itself.
+  if (mode == m_IMM) return get_low_byte(r.operand);
+  u16 address = get_address(r, mode);
+  return mem[address];
+}
+
+// ------------------ Address return --------------------------- ////
+inline u16 cpu::get_address(cpu_registers &r, mem_mode mode) {
+  // When control reaches here, the PC is past the instruction, and its operand
+  // bytes are in r.operand.
+  u16 address;
+  u8 low_byte = get_low_byte(r.operand), high_byte = get_high_byte(r.operand);
+  page_crossed = false;
+
+  switch (mode) {
+    case m_IMM:  // Immediate mode. The data is in r.operand, see cpu::operand.
+      return 0;
+
+    case m_ZPG:  // Zero page mode.
+      // The next byte is the address of first 256 bytes of memory. The address is
+      // 16 bits (for total of 64 KB memory, but we only use the 8 bits to address
+      // the zero'th page.
+      address = low_byte;
+      return address;
+
+    case m_ZPX:  // Zero Page X
+      // The adress is the 8 bits of the next byte, added to the 8 bits of X
+      // register. If the addition overflows, it wraps around the zero page.
+      address = (low_byte + r.X) & 0xFF;
+      return address;
+
+    case m_ZPY:  // Zero Page Y
+      // The adress is the 8 bits of the next byte, added to the 8 bits of Y
+      // register. If the addition overflows, it wraps around the zero page.
+      address = (low_byte + r.Y) & 0xFF;
+      return address;
+
+    case m_ABS:  // Absolute memory address.
+      // In which case, the next two bytes (little endian)
+      // are the memory address. Read the low byte first, then the high byte, and
+      // combine them together.
+      address = combine_bytes(low_byte, high_byte);
+      return address;
+
+    case m_ABX:  // Absolute memory address, indexed by X.
+      // Read the next two bytes, and add the value stored in X register. Return
+      // value in this location.
+      address = combine_bytes(low_byte, high_byte);
+      page_crossed = (low_byte + r.X) > 0xFF;
+      return address + r.X;
+
+    case m_ABY:  // Absolute memory address, indexed by Y.
+      address = combine_bytes(low_byte, high_byte);
+      page_crossed = (low_byte + r.Y) > 0xFF;
+      return address + r.Y;
+
+    case m_INX:  // Indirection X. Pre-Index Indirect.
+      // Read the next byte, add it to X register. Go to this memory location, and
+      // read the next two bytes. This gives an address. Return the value at this
+      // address.
+      // The pointer itself never leaves the zero page.
+      address = (low_byte + r.X) & 0xFF;
+      low_byte = mem[address];
+      high_byte = mem[(address + 1) & 0xFF];
+      address = combine_bytes(low_byte, high_byte);
+      return address;
+
+    case m_INY:  // Post-Indexed Indirect Addressing
+      // Read the next byte. Go to this memory location, and read the next two
+      // bytes. To this value, add Y. This gives an address. Return the value at
+      // this address.
+      address = low_byte;
+      low_byte = mem[address];
+      high_byte = mem[(address + 1) & 0xFF];
+      address = combine_bytes(low_byte, high_byte);
+      page_crossed = (low_byte + r.Y) > 0xFF;
+      return address + r.Y;
+
+    case m_ACCUM:  // Accumulator addressing. There is no address, see cpu::load.
+      return 0;
+
+    default:
+      return 0;  // Control should never reach here.
+  };
+}
+
+// ------------------- Stack functions ----------------------- //
+inline u8 cpu::pop_stack(cpu_registers &r) {
+  // The 6502 stack grows downwards. Thus, when items are popped, stack pointer
+  // increases. The location of stack is 0x0100 to 0x01FF, thus 256 bytes. SP
+  // points to the next free slot, so increment before reading.
+  r.SP++;
+  return mem[0x0100 + r.SP];
+}
+
+inline void cpu::push_stack(cpu_registers &r, u8 data) {
+  mem.write_address(0x0100 + r.SP, data);
+  r.SP--;
+}
+
+#endif /* CPU_MEMORY_OPS_IMPL_HPP */
@@ -0,0 +1,401 @@
+#ifndef CPU_OPCODE_INFO_HPP
+#define CPU_OPCODE_INFO_HPP
+
+// Compile time description of all 256 opcodes. The dispatch table, the cycle
+// accounting and the disassembler are generated from this one table, and the
+// checks at the bottom verify it against the 6502 opcode encoding.
+#include "util.hpp"
+
+enum mnemonic : u8 {
+  o_ADC, o_AND, o_ASL, o_BCC, o_BCS, o_BEQ, o_BIT, o_BMI, o_BNE, o_BPL, o_BRK, o_BVC, o_BVS, o_CLC,
+  o_CLD, o_CLI, o_CLV, o_CMP, o_CPX, o_CPY, o_DEC, o_DEX, o_DEY, o_EOR, o_INC, o_INX, o_INY, o_JMP,
+  o_JSR, o_LDA, o_LDX, o_LDY, o_LSR, o_NOP, o_ORA, o_PHA, o_PHP, o_PLA, o_PLP, o_ROL, o_ROR, o_RTI,
+  o_RTS, o_SBC, o_SEC, o_SED, o_SEI, o_STA, o_STX, o_STY, o_TAX, o_TAY, o_TSX, o_TXA, o_TXS, o_TYA,
+  o_XXX  // Unofficial opcode. Runs as a NOP of the same length.
+};
+
+// Printable names, indexed by mnemonic.
+inline constexpr const char *mnemonic_names[] = {
+    "ADC", "AND", "ASL", "BCC", "BCS", "BEQ", "BIT", "BMI", "BNE", "BPL", "BRK", "BVC", "BVS",
+    "CLC", "CLD", "CLI", "CLV", "CMP", "CPX", "CPY", "DEC", "DEX", "DEY", "EOR", "INC", "INX",
+    "INY", "JMP", "JSR", "LDA", "LDX", "LDY", "LSR", "NOP", "ORA", "PHA", "PHP", "PLA", "PLP",
+    "ROL", "ROR", "RTI", "RTS", "SBC", "SEC", "SED", "SEI", "STA", "STX", "STY", "TAX", "TAY",
+    "TSX", "TXA", "TXS", "TYA", "*NOP",
+};
+
+struct opcode_info {
+  mnemonic op;        // The instruction.
+  mem_mode mode;      // How its operand is addressed.
+  u8 cycles;          // Base cycle count.
+  bool page_penalty;  // Takes a cycle more when indexing crosses a page.
+};
+
+// Length of an instruction in bytes, opcode included.
+constexpr u8 mode_length(mem_mode mode) {
+  switch (mode) {
+    case m_IMPL:
+    case m_ACCUM:
+      return 1;
+    case m_ABS:
+    case m_ABX:
+    case m_ABY:
+    case m_IND:
+      return 3;
+    default:
+      return 2;
+  }
+}
+
+// Reference: http://nesdev.com/6502_cpu.txt
+inline constexpr opcode_info opcode_infos[256] = {
+    {o_BRK, m_IMPL, 7, false},   // 0x00
+    {o_ORA, m_INX, 6, false},    // 0x01
+    {o_XXX, m_IMPL, 2, false},   // 0x02
+    {o_XXX, m_INX, 8, false},    // 0x03
+    {o_XXX, m_ZPG, 3, false},    // 0x04
+    {o_ORA, m_ZPG, 3, false},    // 0x05
+    {o_ASL, m_ZPG, 5, false},    // 0x06
+    {o_XXX, m_ZPG, 5, false},    // 0x07
+    {o_PHP, m_IMPL, 3, false},   // 0x08
+    {o_ORA, m_IMM, 2, false},    // 0x09
+    {o_ASL, m_ACCUM, 2, false},  // 0x0A
+    {o_XXX, m_IMM, 2, false},    // 0x0B
+    {o_XXX, m_ABS, 4, false},    // 0x0C
+    {o_ORA, m_ABS, 4, false},    // 0x0D
+    {o_ASL, m_ABS, 6, false},    // 0x0E
+    {o_XXX, m_ABS, 6, false},    // 0x0F
+    {o_BPL, m_REL, 2, false},    // 0x10
+    {o_ORA, m_INY, 5, true},     // 0x11
+    {o_XXX, m_IMPL, 2, false},   // 0x12
+    {o_XXX, m_INY, 8, false},    // 0x13
+    {o_XXX, m_ZPX, 4, false},    // 0x14
+    {o_ORA, m_ZPX, 4, false},    // 0x15
+    {o_ASL, m_ZPX, 6, false},    // 0x16
+    {o_XXX, m_ZPX, 6, false},    // 0x17
+    {o_CLC, m_IMPL, 2, false},   // 0x18
+    {o_ORA, m_ABY, 4, true},     // 0x19
+    {o_XXX, m_IMPL, 2, false},   // 0x1A
+    {o_XXX, m_ABY, 7, false},    // 0x1B
+    {o_XXX, m_ABX, 4, true},     // 0x1C
+    {o_ORA, m_ABX, 4, true},     // 0x1D
+    {o_ASL, m_ABX, 7, false},    // 0x1E
+    {o_XXX, m_ABX, 7, false},    // 0x1F
+    {o_JSR, m_ABS, 6, false},    // 0x20
+    {o_AND, m_INX, 6, false},    // 0x21
+    {o_XXX, m_IMPL, 2, false},   // 0x22
+    {o_XXX, m_INX, 8, false},    // 0x23
+    {o_BIT, m_ZPG, 3, false},    // 0x24
+    {o_AND, m_ZPG, 3, false},    // 0x25
+    {o_ROL, m_ZPG, 5, false},    // 0x26
+    {o_XXX, m_ZPG, 5, false},    // 0x27
+    {o_PLP, m_IMPL, 4, false},   // 0x28
+    {o_AND, m_IMM, 2, false},    // 0x29
+    {o_ROL, m_ACCUM, 2, false},  // 0x2A
+    {o_XXX, m_IMM, 2, false},    // 0x2B
+    {o_BIT, m_ABS, 4, false},    // 0x2C
+    {o_AND, m_ABS, 4, false},    // 0x2D
+    {o_ROL, m_ABS, 6, false},    // 0x2E
+    {o_XXX, m_ABS, 6, false},    // 0x2F
+    {o_BMI, m_REL, 2, false},    // 0x30
+    {o_AND, m_INY, 5, true},     // 0x31
+    {o_XXX, m_IMPL, 2, false},   // 0x32
+    {o_XXX, m_INY, 8, false},    // 0x33
+    {o_XXX, m_ZPX, 4, false},    // 0x34
+    {o_AND, m_ZPX, 4, false},    // 0x35
+    {o_ROL, m_ZPX, 6, false},    // 0x36
+    {o_XXX, m_ZPX, 6, false},    // 0x37
+    {o_SEC, m_IMPL, 2, false},   // 0x38
+    {o_AND, m_ABY, 4, true},     // 0x39
+    {o_XXX, m_IMPL, 2, false},   // 0x3A
+    {o_XXX, m_ABY, 7, false},    // 0x3B
+    {o_XXX, m_ABX, 4, true},     // 0x3C
+    {o_AND, m_ABX, 4, true},     // 0x3D
+    {o_ROL, m_ABX, 7, false},    // 0x3E
+    {o_XXX, m_ABX, 7, false},    // 0x3F
+    {o_RTI, m_IMPL, 6, false},   // 0x40
+    {o_EOR, m_INX, 6, false},    // 0x41
+    {o_XXX, m_IMPL, 2, false},   // 0x42
+    {o_XXX, m_INX, 8, false},    // 0x43
+    {o_XXX, m_ZPG, 3, false},    // 0x44
+    {o_EOR, m_ZPG, 3, false},    // 0x45
+    {o_LSR, m_ZPG, 5, false},    // 0x46
+    {o_XXX, m_ZPG, 5, false},    // 0x47
+    {o_PHA, m_IMPL, 3, false},   // 0x48
+    {o_EOR, m_IMM, 2, false},    // 0x49
+    {o_LSR, m_ACCUM, 2, false},  // 0x4A
+    {o_XXX, m_IMM, 2, false},    // 0x4B
+    {o_JMP, m_ABS, 3, false},    // 0x4C
+    {o_EOR, m_ABS, 4, false},    // 0x4D
+    {o_LSR, m_ABS, 6, false},    // 0x4E
+    {o_XXX, m_ABS, 6, false},    // 0x4F
+    {o_BVC, m_REL, 2, false},    // 0x50
+    {o_EOR, m_INY, 5, true},     // 0x51
+    {o_XXX, m_IMPL, 2, false},   // 0x52
+    {o_XXX, m_INY, 8, false},    // 0x53
+    {o_XXX, m_ZPX, 4, false},    // 0x54
+    {o_EOR, m_ZPX, 4, false},    // 0x55
+    {o_LSR, m_ZPX, 6, false},    // 0x56
+    {o_XXX, m_ZPX, 6, false},    // 0x57
+    {o_CLI, m_IMPL, 2, false},   // 0x58
+    {o_EOR, m_ABY, 4, true},     // 0x59
+    {o_XXX, m_IMPL, 2, false},   // 0x5A
+    {o_XXX, m_ABY, 7, false},    // 0x5B
+    {o_XXX, m_ABX, 4, true},     // 0x5C
+    {o_EOR, m_ABX, 4, true},     // 0x5D
+    {o_LSR, m_ABX, 7, false},    // 0x5E
+    {o_XXX, m_ABX, 7, false},    // 0x5F
+    {o_RTS, m_IMPL, 6, false},   // 0x60
+    {o_ADC, m_INX, 6, false},    // 0x61
+    {o_XXX, m_IMPL, 2, false},   // 0x62
+    {o_XXX, m_INX, 8, false},    // 0x63
+    {o_XXX, m_ZPG, 3, false},    // 0x64
+    {o_ADC, m_ZPG, 3, false},    // 0x65
+    {o_ROR, m_ZPG, 5, false},    // 0x66
+    {o_XXX, m_ZPG, 5, false},    // 0x67
+    {o_PLA, m_IMPL, 4, false},   // 0x68
+    {o_ADC, m_IMM, 2, false},    // 0x69
+    {o_ROR, m_ACCUM, 2, false},  // 0x6A
+    {o_XXX, m_IMM, 2, false},    // 0x6B
+    {o_JMP, m_IND, 5, false},    // 0x6C
+    {o_ADC, m_ABS, 4, false},    // 0x6D
+    {o_ROR, m_ABS, 6, false},    // 0x6E
+    {o_XXX, m_ABS, 6, false},    // 0x6F
+    {o_BVS, m_REL, 2, false},    // 0x70
+    {o_ADC, m_INY, 5, true},     // 0x71
+    {o_XXX, m_IMPL, 2, false},   // 0x72
+    {o_XXX, m_INY, 8, false},    // 0x73
+    {o_XXX, m_ZPX, 4, false},    // 0x74
+    {o_ADC, m_ZPX, 4, false},    // 0x75
+    {o_ROR, m_ZPX, 6, false},    // 0x76
+    {o_XXX, m_ZPX, 6, false},    // 0x77
+    {o_SEI, m_IMPL, 2, false},   // 0x78
+    {o_ADC, m_ABY, 4, true},     // 0x79
+    {o_XXX, m_IMPL, 2, false},   // 0x7A
+    {o_XXX, m_ABY, 7, false},    // 0x7B
+    {o_XXX, m_ABX, 4, true},     // 0x7C
+    {o_ADC, m_ABX, 4, true},     // 0x7D
+    {o_ROR, m_ABX, 7, false},    // 0x7E
+    {o_XXX, m_ABX, 7, false},    // 0x7F
+    {o_XXX, m_IMM, 2, false},    // 0x80
+    {o_STA, m_INX, 6, false},    // 0x81
+    {o_XXX, m_IMM, 2, false},    // 0x82
+    {o_XXX, m_INX, 6, false},    // 0x83
+    {o_STY, m_ZPG, 3, false},    // 0x84
+    {o_STA, m_ZPG, 3, false},    // 0x85
+    {o_STX, m_ZPG, 3, false},    // 0x86
+    {o_XXX, m_ZPG, 3, false},    // 0x87
+    {o_DEY, m_IMPL, 2, false},   // 0x88
+    {o_XXX, m_IMM, 2, false},    // 0x89
+    {o_TXA, m_IMPL, 2, false},   // 0x8A
+    {o_XXX, m_IMM, 2, false},    // 0x8B
+    {o_STY, m_ABS, 4, false},    // 0x8C
+    {o_STA, m_ABS, 4, false},    // 0x8D
+    {o_STX, m_ABS, 4, false},    // 0x8E
+    {o_XXX, m_ABS, 4, false},    // 0x8F
+    {o_BCC, m_REL, 2, false},    // 0x90
+    {o_STA, m_INY, 6, false},    // 0x91
+    {o_XXX, m_IMPL, 2, false},   // 0x92
+    {o_XXX, m_INY, 6, false},    // 0x93
+    {o_STY, m_ZPX, 4, false},    // 0x94
+    {o_STA, m_ZPX, 4, false},    // 0x95
+    {o_STX, m_ZPY, 4, false},    // 0x96
+    {o_XXX, m_ZPY, 4, false},    // 0x97
+    {o_TYA, m_IMPL, 2, false},   // 0x98
+    {o_STA, m_ABY, 5, false},    // 0x99
+    {o_TXS, m_IMPL, 2, false},   // 0x9A
+    {o_XXX, m_ABY, 5, false},    // 0x9B
+    {o_XXX, m_ABX, 5, false},    // 0x9C
+    {o_STA, m_ABX, 5, false},    // 0x9D
+    {o_XXX, m_ABY, 5, false},    // 0x9E
+    {o_XXX, m_ABY, 5, false},    // 0x9F
+    {o_LDY, m_IMM, 2, false},    // 0xA0
+    {o_LDA, m_INX, 6, false},    // 0xA1
+    {o_LDX, m_IMM, 2, false},    // 0xA2
+    {o_XXX, m_INX, 6, false},    // 0xA3
+    {o_LDY, m_ZPG, 3, false},    // 0xA4
+    {o_LDA, m_ZPG, 3, false},    // 0xA5
+    {o_LDX, m_ZPG, 3, false},    // 0xA6
+    {o_XXX, m_ZPG, 3, false},    // 0xA7
+    {o_TAY, m_IMPL, 2, false},   // 0xA8
+    {o_LDA, m_IMM, 2, false},    // 0xA9
+    {o_TAX, m_IMPL, 2, false},   // 0xAA
+    {o_XXX, m_IMM, 2, false},    // 0xAB
+    {o_LDY, m_ABS, 4, false},    // 0xAC
+    {o_LDA, m_ABS, 4, false},    // 0xAD
+    {o_LDX, m_ABS, 4, false},    // 0xAE
+    {o_XXX, m_ABS, 4, false},    // 0xAF
+    {o_BCS, m_REL, 2, false},    // 0xB0
+    {o_LDA, m_INY, 5, true},     // 0xB1
+    {o_XXX, m_IMPL, 2, false},   // 0xB2
+    {o_XXX, m_INY, 5, true},     // 0xB3
+    {o_LDY, m_ZPX, 4, false},    // 0xB4
+    {o_LDA, m_ZPX, 4, false},    // 0xB5
+    {o_LDX, m_ZPY, 4, false},    // 0xB6
+    {o_XXX, m_ZPY, 4, false},    // 0xB7
+    {o_CLV, m_IMPL, 2, false},   // 0xB8
+    {o_LDA, m_ABY, 4, true},     // 0xB9
+    {o_TSX, m_IMPL, 2, false},   // 0xBA
+    {o_XXX, m_ABY, 4, true},     // 0xBB
+    {o_LDY, m_ABX, 4, true},     // 0xBC
+    {o_LDA, m_ABX, 4, true},     // 0xBD
+    {o_LDX, m_ABY, 4, true},     // 0xBE
+    {o_XXX, m_ABY, 4, true},     // 0xBF
+    {o_CPY, m_IMM, 2, false},    // 0xC0
+    {o_CMP, m_INX, 6, false},    // 0xC1
+    {o_XXX, m_IMM, 2, false},    // 0xC2
+    {o_XXX, m_INX, 8, false},    // 0xC3
+    {o_CPY, m_ZPG, 3, false},    // 0xC4
+    {o_CMP, m_ZPG, 3, false},    // 0xC5
+    {o_DEC, m_ZPG, 5, false},    // 0xC6
+    {o_XXX, m_ZPG, 5, false},    // 0xC7
+    {o_INY, m_IMPL, 2, false},   // 0xC8
+    {o_CMP, m_IMM, 2, false},    // 0xC9
+    {o_DEX, m_IMPL, 2, false},   // 0xCA
+    {o_XXX, m_IMM, 2, false},    // 0xCB
+    {o_CPY, m_ABS, 4, false},    // 0xCC
+    {o_CMP, m_ABS, 4, false},    // 0xCD
+    {o_DEC, m_ABS, 6, false},    // 0xCE
+    {o_XXX, m_ABS, 6, false},    // 0xCF
+    {o_BNE, m_REL, 2, false},    // 0xD0
+    {o_CMP, m_INY, 5, true},     // 0xD1
+    {o_XXX, m_IMPL, 2, false},   // 0xD2
+    {o_XXX, m_INY, 8, false},    // 0xD3
+    {o_XXX, m_ZPX, 4, false},    // 0xD4
+    {o_CMP, m_ZPX, 4, false},    // 0xD5
+    {o_DEC, m_ZPX, 6, false},    // 0xD6
+    {o_XXX, m_ZPX, 6, false},    // 0xD7
+    {o_CLD, m_IMPL, 2, false},   // 0xD8
+    {o_CMP, m_ABY, 4, true},     // 0xD9
+    {o_XXX, m_IMPL, 2, false},   // 0xDA
+    {o_XXX, m_ABY, 7, false},    // 0xDB
+    {o_XXX, m_ABX, 4, true},     // 0xDC
+    {o_CMP, m_ABX, 4, true},     // 0xDD
+    {o_DEC, m_ABX, 7, false},    // 0xDE
+    {o_XXX, m_ABX, 7, false},    // 0xDF
+    {o_CPX, m_IMM, 2, false},    // 0xE0
+    {o_SBC, m_INX, 6, false},    // 0xE1
+    {o_XXX, m_IMM, 2, false},    // 0xE2
+    {o_XXX, m_INX, 8, false},    // 0xE3
+    {o_CPX, m_ZPG, 3, false},    // 0xE4
+    {o_SBC, m_ZPG, 3, false},    // 0xE5
+    {o_INC, m_ZPG, 5, false},    // 0xE6
+    {o_XXX, m_ZPG, 5, false},    // 0xE7
+    {o_INX, m_IMPL, 2, false},   // 0xE8
+    {o_SBC, m_IMM, 2, false},    // 0xE9
+    {o_NOP, m_IMPL, 2, false},   // 0xEA
+    {o_XXX, m_IMM, 2, false},    // 0xEB
+    {o_CPX, m_ABS, 4, false},    // 0xEC
+    {o_SBC, m_ABS, 4, false},    // 0xED
+    {o_INC, m_ABS, 6, false},    // 0xEE
+    {o_XXX, m_ABS, 6, false},    // 0xEF
+    {o_BEQ, m_REL, 2, false},    // 0xF0
+    {o_SBC, m_INY, 5, true},     // 0xF1
+    {o_XXX, m_IMPL, 2, false},   // 0xF2
+    {o_XXX, m_INY, 8, false},    // 0xF3
+    {o_XXX, m_ZPX, 4, false},    // 0xF4
+    {o_SBC, m_ZPX, 4, false},    // 0xF5
+    {o_INC, m_ZPX, 6, false},    // 0xF6
+    {o_XXX, m_ZPX, 6, false},    // 0xF7
+    {o_SED, m_IMPL, 2, false},   // 0xF8
+    {o_SBC, m_ABY, 4, true},     // 0xF9
+    {o_XXX, m_IMPL, 2, false},   // 0xFA
+    {o_XXX, m_ABY, 7, false},    // 0xFB
+    {o_XXX, m_ABX, 4, true},     // 0xFC
+    {o_SBC, m_ABX, 4, true},     // 0xFD
+    {o_INC, m_ABX, 7, false},    // 0xFE
+    {o_XXX, m_ABX, 7, false},    // 0xFF
+};
+
+// ------------------- Compile time checks ------------------- //
+// The memory mode of an opcode follows from its bits aaabbbcc. Group cc = 01
+// (and the unofficial cc = 11) uses bbb directly. Groups cc = 00 and cc = 10
+// have a few irregular columns.
+constexpr mem_mode decode_mode(u8 code) {
+  const u8 aaa = code >> 5, bbb = (code >> 2) & 7, cc = code & 3;
+  const bool xy_swap = (aaa == 4 || aaa == 5);  // STX/LDX index with Y.
+  const mem_mode group_one[8] = {m_INX, m_ZPG, m_IMM, m_ABS, m_INY, m_ZPX, m_ABY, m_ABX};
+  const mem_mode group_zero[8] = {m_IMM, m_ZPG, m_IMPL, m_ABS, m_REL, m_ZPX, m_IMPL, m_ABX};
+
+  if (cc == 1) return group_one[bbb];
+  if (cc == 3) {
+    if (xy_swap && bbb == 5) return m_ZPY;
+    if (xy_swap && bbb == 7) return m_ABY;
+    return group_one[bbb];
+  }
+  if (cc == 0) {
+    if (bbb == 0) return aaa >= 4 ? m_IMM : (aaa == 1 ? m_ABS : m_IMPL);  // JSR is absolute.
+    if (bbb == 3 && aaa == 3) return m_IND;                              // JMP indirect.
+    return group_zero[bbb];
+  }
+  switch (bbb) {  // cc == 2
+    case 0:
+      return aaa >= 4 ? m_IMM : m_IMPL;
+    case 1:
+      return m_ZPG;
+    case 2:
+      return aaa >= 4 ? m_IMPL : m_ACCUM;
+    case 3:
+      return m_ABS;
+    case 5:
+      return xy_swap ? m_ZPY : m_ZPX;
+    case 7:
+      return xy_swap ? m_ABY : m_ABX;
+    default:
+      return m_IMPL;
+  }
+}
+
+constexpr bool modes_match_encoding() {
+  for (int code = 0; code < 256; code++)
+    if (opcode_infos[code].mode != decode_mode(code)) return false;
+  return true;
+}
+
+// In groups cc = 01 and cc = 10, aaa selects the instruction.
+constexpr bool mnemonics_match_encoding() {
+  const mnemonic group_one[8] = {o_ORA, o_AND, o_EOR, o_ADC, o_STA, o_LDA, o_CMP, o_SBC};
+  const mnemonic group_two[8] = {o_ASL, o_ROL, o_LSR, o_ROR, o_STX, o_LDX, o_DEC, o_INC};
+  for (int code = 0; code < 256; code++) {
+    const opcode_info &info = opcode_infos[code];
+    const u8 aaa = code >> 5, cc = code & 3;
+    if (info.op == o_XXX) continue;
+    if (cc == 1 && info.op != group_one[aaa]) return false;
+    if (cc == 2 && info.mode != m_IMPL && info.op != group_two[aaa]) return false;
+    if (cc == 3) return false;  // No official opcode there.
+  }
+  return true;
+}
+
+// Each instruction exists at most once in each memory mode.
+constexpr bool official_opcodes_unique() {
+  for (int a = 0; a < 256; a++)
+    for (int b = a + 1; b < 256; b++)
+      if (opcode_infos[a].op != o_XXX && opcode_infos[a].op == opcode_infos[b].op &&
+          opcode_infos[a].mode == opcode_infos[b].mode)
+        return false;
+  return true;
+}
+
+constexpr int count_official_opcodes() {
+  int count = 0;
+  for (const opcode_info &info : opcode_infos) count += (info.op != o_XXX);
+  return count;
+}
+
+// Only indexed modes can cross a page while computing the address.
+constexpr bool penalties_on_indexed_modes() {
+  for (const opcode_info &info : opcode_infos)
+    if (info.page_penalty && info.mode != m_ABX && info.mode != m_ABY && info.mode != m_INY)
+      return false;
+  return true;
+}
+
+static_assert(sizeof(mnemonic_names) / sizeof(mnemonic_names[0]) == o_XXX + 1,
+              "A mnemonic has no name.");
+static_assert(modes_match_encoding(), "An opcode's memory mode disagrees with its encoding.");
+static_assert(mnemonics_match_encoding(), "An opcode's mnemonic disagrees with its encoding.");
+static_assert(official_opcodes_unique(), "An instruction is mapped twice in the same mode.");
+static_assert(count_official_opcodes() == 151, "The 6502 has 151 official opcodes.");
+static_assert(penalties_on_indexed_modes(), "Page penalty on a mode without indexing.");
+
+#endif /* CPU_OPCODE_INFO_HPP */
@@ -5,234 +5,397 @@
 #include "util.hpp"
 
 // Implement each function.
-inline void cpu::do_jump(const u8 &offset) {
+inline void cpu::branch(cpu_registers &r, bool taken) {
+  // A taken branch costs one more cycle, and another one if the target is on a
+  // different page.
+  u8 offset = get_low_byte(r.operand);
+  if (!taken) return;
+
   i16 jump_value = offset < 128 ? offset : (i16(offset) - 256);
-  this->PC += jump_value;
+  u16 target = r.PC + jump_value;
+  this->cycle_count += 1 + (get_high_byte(target) != get_high_byte(r.PC));
+  u16 tail = r.PC - 2;
+  r.PC = target;
+  jumped(r, tail);
+}
+
+inline u8 cpu::poll_interrupts(cpu_registers &r) {
+  // NMI wins over IRQ, and IRQ waits while I is set. The sequence is BRK's,
+  // except that the pushed B flag is clear.
+  u16 vector;
+  if (lines.nmi) {
+    lines.nmi = false;
+    vector = 0xFFFA;
+  } else if (lines.irq && !r.P.I.get()) {
+    vector = 0xFFFE;
+  } else {
+    return 0;
+  }
+
+  this->push_stack(r, get_high_byte(r.PC));
+  this->push_stack(r, get_low_byte(r.PC));
+  this->push_stack(r, (r.status() & 0xEF) | 0x20);
+  r.P.I.set();
+  r.PC = combine_bytes(this->mem[vector], this->mem[vector + 1]);
+  left_loop();
+  return 7;
 }
 
-inline void cpu::set_flags(const u8 &result) {  // Set zero and sign flag.
-  this->P.Z = (result == 0);                    // Zero flag
-  this->P.S = (result >= 0x80);                 // Sign flag
+inline void cpu::set_flags(cpu_registers &r, const u8 &result) {  // Set zero and sign flag.
+  r.set_nz(result);
 }
 
-inline u8 cpu::add(const u8 &a, const u8 &b) {  // Add a with b
-  u8 result = a + b;
-  this->P.C = ((UINT8_MAX - a) < b);  // Detect overflow.
-  set_flags(result);
+inline u8 cpu::add(cpu_registers &r, const u8 &a, const u8 &b) {  // Add a with b and carry.
+  u16 sum = u16(a) + b + r.carry();
+  u8 result = u8(sum);
+  r.set_carry(sum > UINT8_MAX);  // Detect overflow.
+  // Detect signed overflow, and set V accordingly. http://archive.is/VAxtz
+  r.set_overflow((a ^ result) & (b ^ result) & 0x80);
+  set_flags(r, result);
   return result;
 }
 
-inline u8 cpu::subtract(const u8 &a, const u8 &b) {  // Subtract b from a
-  this->P.C = (a >= b);
+inline u8 cpu::subtract(cpu_registers &r, const u8 &a, const u8 &b) {  // Subtract b from a
+  r.set_carry(a >= b);
   u8 result = a - b;  // C++ standard ensure correct result.
-  set_flags(result);
+  set_flags(r, result);
   return result;
 }
 
-template <mem_mode mode>
-void cpu::ADC() {  // Add memory to accumulator. Add with carry.
-  u8 operand = this->operand(mode);
-  u8 op1 = this->A;
-  u8 op2 = operand;
-  if (this->P.C.get() == 1) op2++;
+// The accumulator mode operates on A instead of memory. As mode is a template
+// argument everywhere, the check is resolved at compile time.
+inline u8 cpu::load(cpu_registers &r, mem_mode mode, u16 address) {
+  return mode == m_ACCUM ? r.A : this->mem.read_address(address);
+}
 
-  u8 result = add(op1, op2);  // This set Z,S and C flags.
-  this->A = result;
-  // Detect signed overflow, and set V accordingly. http://archive.is/VAxtz
-  this->P.V = (op1 ^ result) & (op2 ^ result) & 0x80;
+inline void cpu::store(cpu_registers &r, mem_mode mode, u16 address, u8 data) {
+  if (mode == m_ACCUM)
+    r.A = data;
+  else
+    this->mem.write_address(address, data);
+}
+
+template <mem_mode mode>
+void cpu::ADC(cpu_registers &r) {  // Add memory to accumulator. Add with carry.
+  u8 operand = this->operand(r, mode);
+  r.A = add(r, r.A, operand);  // This set Z,S,C and V flags.
 }
 
 template <mem_mode mode>  // "AND" memory with accumulator
-void cpu::AND() {
-  u8 operand = this->operand(mode);  // This has side effect of incrementing the PC.
-  this->A = this->A & operand;
-  set_flags(this->A);
+void cpu::AND(cpu_registers &r) {
+  u8 operand = this->operand(r, mode);  // This has side effect of incrementing the PC.
+  r.A = r.A & operand;
+  set_flags(r, r.A);
 }
 
 template <mem_mode mode>  // Shift Left One Bit (Memory or Accumulator)
-void cpu::ASL() {
-  u16 address = this->get_address(mode);
-  u8 operand = this->mem.read_address(address);
+void cpu::ASL(cpu_registers &r) {
+  u16 address = this->get_address(r, mode);
+  u8 operand = this->load(r, mode, address);
 
   u8 high_bit = (operand & 0x80) >> 7;
-  this->P.C = high_bit;
+  r.set_carry(high_bit);
 
   operand = operand << 1;
-  set_flags(operand);
-  this->mem.write_address(address, operand);
+  set_flags(r, operand);
+  this->store(r, mode, address, operand);
 }
 
 template <mem_mode mode>
-void cpu::BIT() {  // Test bits in memory with accumulator
-  u8 operand = this->operand(mode);
+void cpu::BIT(cpu_registers &r) {  // Test bits in memory with accumulator
+  u8 operand = this->operand(r, mode);
 
-  this->P.Z = (this->A & operand);
-  this->P.S = (operand & 0b10000000);
-  this->P.V = (operand & 0b01000000);
+  r.set_zs((r.A & operand) == 0, operand & 0b10000000);
+  r.set_overflow(operand & 0b01000000);
 }
 
 template <mem_mode mode>
-void cpu::CMP() {  // Compare memory and accumulator.
-  u16 address = this->get_address(mode);
-  u8 operand = this->mem.read_address(address);
-  subtract(this->A, operand);
-  this->mem.write_address(address, operand);
+void cpu::CMP(cpu_registers &r) {  // Compare memory and accumulator.
+  u8 operand = this->operand(r, mode);
+  subtract(r, r.A, operand);
 }
 
 template <mem_mode mode>
-void cpu::CPX() {  // Compare memory and X.
-  u16 address = this->get_address(mode);
-  u8 operand = this->mem.read_address(address);
-
-  subtract(this->X, operand);
-  this->mem.write_address(address, operand);
+void cpu::CPX(cpu_registers &r) {  // Compare memory and X.
+  u8 operand = this->operand(r, mode);
+  subtract(r, r.X, operand);
 }
 
 template <mem_mode mode>
-void cpu::CPY() {  // Compare memory and Y.
-  u16 address = this->get_address(mode);
-  u8 operand = this->mem.read_address(address);
-
-  subtract(this->Y, operand);
-  this->mem.write_address(address, operand);
+void cpu::CPY(cpu_registers &r) {  // Compare memory and Y.
+  u8 operand = this->operand(r, mode);
+  subtract(r, r.Y, operand);
 }
 
 template <mem_mode mode>
-void cpu::DEC() {  // Decrement memory. Carry ignored.
-  u16 address = this->get_address(mode);
+void cpu::DEC(cpu_registers &r) {  // Decrement memory. Carry ignored.
+  u16 address = this->get_address(r, mode);
   u8 operand = this->mem.read_address(address);
 
-  set_flags(--operand);
+  set_flags(r, --operand);
   this->mem.write_address(address, operand);
 }
 
 template <mem_mode mode>
-void cpu::EOR() {  // XOR Accumulator with memory.
-  u8 operand = this->operand(mode);
-  set_flags(this->A ^ operand);
+void cpu::EOR(cpu_registers &r) {  // XOR Accumulator with memory.
+  u8 operand = this->operand(r, mode);
+  r.A = r.A ^ operand;
+  set_flags(r, r.A);
 }
 
 template <mem_mode mode>
-void cpu::INC() {  // Increment memory. Carry ignored.
-  u16 address = this->get_address(mode);
+void cpu::INC(cpu_registers &r) {  // Increment memory. Carry ignored.
+  u16 address = this->get_address(r, mode);
   u8 operand = this->mem.read_address(address);
 
-  set_flags(++operand);
+  set_flags(r, ++operand);
   this->mem.write_address(address, operand);
 }
 
 template <mem_mode mode>
-void cpu::LDA() {  // Load memory into accumulator.
-  u8 operand = this->operand(mode);
-  this->A = operand;
-  set_flags(this->A);
+void cpu::LDA(cpu_registers &r) {  // Load memory into accumulator.
+  u8 operand = this->operand(r, mode);
+  r.A = operand;
+  set_flags(r, r.A);
 }
 
 template <mem_mode mode>
-void cpu::LDX() {  // Load memory into X.
-  u8 operand = this->operand(mode);
-  this->X = operand;
-  set_flags(this->X);
+void cpu::LDX(cpu_registers &r) {  // Load memory into X.
+  u8 operand = this->operand(r, mode);
+  r.X = operand;
+  set_flags(r, r.X);
 }
 
 template <mem_mode mode>
-void cpu::LDY() {  // Load memory with Y.
-  u8 operand = this->operand(mode);
-  this->Y = operand;
-  set_flags(this->Y);
+void cpu::LDY(cpu_registers &r) {  // Load memory with Y.
+  u8 operand = this->operand(r, mode);
+  r.Y = operand;
+  set_flags(r, r.Y);
 }
 
 template <mem_mode mode>
-void cpu::LSR() {  // Logical shift right.
-  u16 address = this->get_address(mode);
-  u8 operand = this->mem.read_address(address);
+void cpu::LSR(cpu_registers &r) {  // Logical shift right.
+  u16 address = this->get_address(r, mode);
+  u8 operand = this->load(r, mode, address);
 
-  this->P.C = (operand % 2);
+  r.set_carry(operand % 2);
   operand = operand >> 1;
-  set_flags(operand);
-  this->mem.write_address(address, operand);
+  set_flags(r, operand);
+  this->store(r, mode, address, operand);
 }
 
 template <mem_mode mode>
-void cpu::ORA() {  // "OR" memory with accumulator.
-  u8 operand = this->operand(mode);
-  set_flags(this->A | operand);
+void cpu::ORA(cpu_registers &r) {  // "OR" memory with accumulator.
+  u8 operand = this->operand(r, mode);
+  r.A = r.A | operand;
+  set_flags(r, r.A);
 }
 
 template <mem_mode mode>
-void cpu::ROL() {  // Rotate one bit left.
+void cpu::ROL(cpu_registers &r) {  // Rotate one bit left.
   // Old carry bit becomes the LSB and the old MSB becomes the carry bit.
-  u16 address = this->get_address(mode);
-  u8 operand = this->mem.read_address(address);
+  u16 address = this->get_address(r, mode);
+  u8 operand = this->load(r, mode, address);
 
-  u8 old_carry = this->P.C.get();
+  u8 old_carry = r.carry();
   u8 new_carry = (operand & 0x80);
 
   operand = (operand << 1);       // Left shift.
   operand = operand | old_carry;  // Put old carry on LSB.
-  this->P.C = new_carry;          // old MSB becomes new carry bit.
+  r.set_carry(new_carry);     // old MSB becomes new carry bit.
 
-  set_flags(operand);
-  this->mem.write_address(address, operand);
+  set_flags(r, operand);
+  this->store(r, mode, address, operand);
 }
 
 template <mem_mode mode>
-void cpu::ROR() {  // Rotate one bit right.
+void cpu::ROR(cpu_registers &r) {  // Rotate one bit right.
   // Old carry bit becomes the MSB and the old LSB becomes the carry bit.
-  u16 address = this->get_address(mode);
-  u8 operand = this->mem.read_address(address);
+  u16 address = this->get_address(r, mode);
+  u8 operand = this->load(r, mode, address);
 
-  u8 old_carry = this->P.C.get();
+  u8 old_carry = r.carry();
   u8 new_carry = (operand & 0x01);
 
   operand = (operand >> 1);              // Right shift.
   operand = operand | (old_carry << 7);  // Put old carry on MSB.
-  this->P.C = new_carry;                 // old LSB becomes new carry bit.
+  r.set_carry(new_carry);            // old LSB becomes new carry bit.
 
-  set_flags(operand);
-  this->mem.write_address(address, operand);
+  set_flags(r, operand);
+  this->store(r, mode, address, operand);
 }
 
 template <mem_mode mode>
-void cpu::SBC() {  // Subtract operand from accumulator with borrow.
-  // SBC does A -> A - M - (1-C) and then sets relevant flags. Flags are set as
-  // if (M+(1-C)) was subtracted from A.
-  u8 operand = this->operand(mode);
-  u8 op1 = this->A;
-  u8 op2 = operand;
-  if (this->P.C.get() == 0) op2++;
+void cpu::SBC(cpu_registers &r) {  // Subtract operand from accumulator with borrow.
+  // SBC does A -> A - M - (1-C), which is the same as A + ~M + C. Thus, all
+  // flags come out of the adder.
+  u8 operand = this->operand(r, mode);
+  r.A = add(r, r.A, u8(~operand));
+}
 
-  u8 result = subtract(op1, op2);
-  this->A = result;
-  // Set the overflow flag if needed.
-  this->P.V = (op1 ^ result) & ((~op2) ^ result) & 0x80;
+template <mem_mode mode>
+void cpu::STA(cpu_registers &r) {  // // Store Accumulator in Memory
+  // No dummy read here, as reading some registers (e.g. PPU) has side effects.
+  u16 address = this->get_address(r, mode);
+  this->mem.write_address(address, r.A);
 }
 
 template <mem_mode mode>
-void cpu::STA() {  // // Store Accumulator in Memory
-  u16 address = this->get_address(mode);
-  u8 operand = this->mem.read_address(address);
+void cpu::STX(cpu_registers &r) {  // Store Index X in Memory
+  u16 address = this->get_address(r, mode);
+  this->mem.write_address(address, r.X);
+}
 
-  operand = this->A;
-  this->mem.write_address(address, operand);
+template <mem_mode mode>
+void cpu::STY(cpu_registers &r) {  // Store Index Y in Memory
+  u16 address = this->get_address(r, mode);
+  this->mem.write_address(address, r.Y);
 }
 
 template <mem_mode mode>
-void cpu::STX() {  // Store Index X in Memory
-  u16 address = this->get_address(mode);
-  u8 operand = this->mem.read_address(address);
+void cpu::XXX(cpu_registers &r) {  // Unofficial opcode. The operand was skipped on fetch.
+  // Nothing is read, but the address is worked out, as some take the page
+  // crossing cycle, which must not be left over from the last instruction.
+  this->get_address(r, mode);
+}
 
-  operand = this->X;
-  this->mem.write_address(address, operand);
+// ------------------- Dispatch ------------------------------ //
+template <mnemonic op, mem_mode mode>
+constexpr cpu::opcode_fn cpu::handler() {
+  if constexpr (op == o_ADC)
+    return &cpu::ADC<mode>;
+  else if constexpr (op == o_AND)
+    return &cpu::AND<mode>;
+  else if constexpr (op == o_ASL)
+    return &cpu::ASL<mode>;
+  else if constexpr (op == o_BCC)
+    return &cpu::BCC;
+  else if constexpr (op == o_BCS)
+    return &cpu::BCS;
+  else if constexpr (op == o_BEQ)
+    return &cpu::BEQ;
+  else if constexpr (op == o_BIT)
+    return &cpu::BIT<mode>;
+  else if constexpr (op == o_BMI)
+    return &cpu::BMI;
+  else if constexpr (op == o_BNE)
+    return &cpu::BNE;
+  else if constexpr (op == o_BPL)
+    return &cpu::BPL;
+  else if constexpr (op == o_BRK)
+    return &cpu::BRK;
+  else if constexpr (op == o_BVC)
+    return &cpu::BVC;
+  else if constexpr (op == o_BVS)
+    return &cpu::BVS;
+  else if constexpr (op == o_CLC)
+    return &cpu::CLC;
+  else if constexpr (op == o_CLD)
+    return &cpu::CLD;
+  else if constexpr (op == o_CLI)
+    return &cpu::CLI;
+  else if constexpr (op == o_CLV)
+    return &cpu::CLV;
+  else if constexpr (op == o_CMP)
+    return &cpu::CMP<mode>;
+  else if constexpr (op == o_CPX)
+    return &cpu::CPX<mode>;
+  else if constexpr (op == o_CPY)
+    return &cpu::CPY<mode>;
+  else if constexpr (op == o_DEC)
+    return &cpu::DEC<mode>;
+  else if constexpr (op == o_DEX)
+    return &cpu::DEX;
+  else if constexpr (op == o_DEY)
+    return &cpu::DEY;
+  else if constexpr (op == o_EOR)
+    return &cpu::EOR<mode>;
+  else if constexpr (op == o_INC)
+    return &cpu::INC<mode>;
+  else if constexpr (op == o_INX)
+    return &cpu::INX;
+  else if constexpr (op == o_INY)
+    return &cpu::INY;
+  else if constexpr (op == o_JMP)
+    return mode == m_IND ? &cpu::JMP_IND : &cpu::JMP_ABS;
+  else if constexpr (op == o_JSR)
+    return &cpu::JSR;
+  else if constexpr (op == o_LDA)
+    return &cpu::LDA<mode>;
+  else if constexpr (op == o_LDX)
+    return &cpu::LDX<mode>;
+  else if constexpr (op == o_LDY)
+    return &cpu::LDY<mode>;
+  else if constexpr (op == o_LSR)
+    return &cpu::LSR<mode>;
+  else if constexpr (op == o_NOP)
+    return &cpu::NOP;
+  else if constexpr (op == o_ORA)
+    return &cpu::ORA<mode>;
+  else if constexpr (op == o_PHA)
+    return &cpu::PHA;
+  else if constexpr (op == o_PHP)
+    return &cpu::PHP;
+  else if constexpr (op == o_PLA)
+    return &cpu::PLA;
+  else if constexpr (op == o_PLP)
+    return &cpu::PLP;
+  else if constexpr (op == o_ROL)
+    return &cpu::ROL<mode>;
+  else if constexpr (op == o_ROR)
+    return &cpu::ROR<mode>;
+  else if constexpr (op == o_RTI)
+    return &cpu::RTI;
+  else if constexpr (op == o_RTS)
+    return &cpu::RTS;
+  else if constexpr (op == o_SBC)
+    return &cpu::SBC<mode>;
+  else if constexpr (op == o_SEC)
+    return &cpu::SEC;
+  else if constexpr (op == o_SED)
+    return &cpu::SED;
+  else if constexpr (op == o_SEI)
+    return &cpu::SEI;
+  else if constexpr (op == o_STA)
+    return &cpu::STA<mode>;
+  else if constexpr (op == o_STX)
+    return &cpu::STX<mode>;
+  else if constexpr (op == o_STY)
+    return &cpu::STY<mode>;
+  else if constexpr (op == o_TAX)
+    return &cpu::TAX;
+  else if constexpr (op == o_TAY)
+    return &cpu::TAY;
+  else if constexpr (op == o_TSX)
+    return &cpu::TSX;
+  else if constexpr (op == o_TXA)
+    return &cpu::TXA;
+  else if constexpr (op == o_TXS)
+    return &cpu::TXS;
+  else if constexpr (op == o_TYA)
+    return &cpu::TYA;
+  else
+    return &cpu::XXX<mode>;
 }
 
-template <mem_mode mode>
-void cpu::STY() {  // Store Index Y in Memory
-  u16 address = this->get_address(mode);
-  u8 operand = this->mem.read_address(address);
+template <std::size_t... codes>
+constexpr std::array<cpu::opcode_fn, 256> cpu::make_opcode_table(
+    std::index_sequence<codes...>) {
+  return {{handler<opcode_infos[codes].op, opcode_infos[codes].mode>()...}};
+}
 
-  operand = this->Y;
-  this->mem.write_address(address, operand);
+inline constexpr std::array<cpu::opcode_fn, 256> cpu::opcode_table =
+    make_opcode_table(std::make_index_sequence<256>());
+
+template <u8 code>
+inline void cpu::execute(cpu_registers &r) {
+  // Everything about the opcode is a constant here, so the handler is called
+  // directly and the page penalty check folds away when it doesn't apply. The
+  // operand must be in r.operand already.
+  constexpr opcode_info info = opcode_infos[code];
+  cycle_count = info.cycles;  // Handlers add the branch penalty cycles.
+  (this->*handler<info.op, info.mode>())(r);
+  if (info.page_penalty) cycle_count += page_crossed;
 }
 
 #endif /* CPU_IMPL_HPP */
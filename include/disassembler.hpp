@@ -0,0 +1,15 @@
+#ifndef DISASSEMBLER_HPP
+#define DISASSEMBLER_HPP
+
+// Turns machine code back to 6502 assembly, using the opcode table.
+#include <string>
+
+#include "cpu_opcode_info.hpp"
+#include "util.hpp"
+
+// Disassemble the instruction at address pc. bytes holds the opcode followed by
+// its operands, mode_length(mode) bytes in all. Branch targets are resolved
+// against pc, so the output reads like "BNE $C72D" or "LDA ($80),Y".
+std::string disassemble(u16 pc, const u8 *bytes);
+
+#endif /* DISASSEMBLER_HPP */
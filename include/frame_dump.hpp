@@ -0,0 +1,92 @@
+#ifndef FRAME_DUMP_HPP
+#define FRAME_DUMP_HPP
+
+// Captures rendered frames to a file or a pipe without a display, for
+// regression runs and datasets.
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "ppu.hpp"
+#include "spsc_ring.hpp"
+#include "util.hpp"
+
+enum class dump_format : u8 {
+  indices,  // NES colour indices 0-63, a byte per pixel.
+  rgba,     // 4 bytes per pixel, see to_rgba.
+  y4m,      // YUV4MPEG2, 4:4:4 at the NTSC frame rate, for ffmpeg and players.
+};
+
+const char *dump_format_name(dump_format format);
+
+struct frame_dump_stats {
+  u64 written;    // Frames written.
+  u64 unchanged;  // Frames skipped for being the same as the last one written.
+  u64 bytes;      // Written to the file.
+  u64 waits;      // Times the emulation had to wait for the writer.
+};
+
+// The emulation draws a frame straight into a slot of a ring, and a writer
+// thread converts it into a large aligned buffer, which is written out in
+// whole whenever it fills up. With three slots, the emulation runs up to two
+// frames ahead, and only waits if the writer falls further behind than that.
+//
+// Every interval-th frame is captured, and with changed_only, frames the same
+// as the last one written are dropped by the writer.
+class frame_dump {
+  struct frame_slot {
+    u8 pixels[ppu::width * ppu::height];
+  };
+
+  static const std::size_t slots = 3;
+  static const std::size_t buffer_size = 4 << 20;
+  static const std::size_t alignment = 4096;  // Of the buffer, for the page cache.
+
+  dump_format format;
+  u64 interval;
+  bool changed_only;
+  int fd;
+  spsc_ring<frame_slot> ring;
+  std::thread writer;
+  std::string error;
+
+  // Emulation side.
+  u64 frames_seen;
+  frame_slot *current;  // Being drawn into.
+
+  // Writer side.
+  u8 *buffer;
+  std::size_t used;  // Bytes of buffer.
+  std::vector<u8> converted;
+  std::vector<u8> last;  // The last frame written, for changed_only.
+  u8 yuv[64][3];         // Y, Cb, Cr of each colour.
+  frame_dump_stats stats;
+  bool failed;
+
+  void run();  // The writer thread.
+  void convert(const u8 *pixels);
+  void append(const u8 *data, std::size_t size);
+  void flush();
+
+ public:
+  frame_dump(dump_format _format, u64 _interval, bool _changed_only);
+  ~frame_dump();
+  frame_dump(const frame_dump &) = delete;
+  frame_dump &operator=(const frame_dump &) = delete;
+
+  // Create the file, and start the writer. A name of - is standard output, in
+  // which case what the program prints goes to standard error instead.
+  bool open(const std::string &file_name);
+
+  // Where to draw the next frame, see ppu::set_frame_target, or null if it
+  // isn't captured. end_frame hands it to the writer.
+  u8 *begin_frame();
+  void end_frame();
+
+  // Write out the rest, and close the file. False if anything failed.
+  bool close();
+  const std::string &get_error() const { return error; }
+  frame_dump_stats get_stats() const;  // Once closed.
+};
+
+#endif /* FRAME_DUMP_HPP */
@@ -0,0 +1,28 @@
+#ifndef INTERRUPT_HPP
+#define INTERRUPT_HPP
+
+#include "util.hpp"
+
+// Sources of the IRQ line. Each device holds its own bit, and the line is
+// asserted while any of them is set.
+enum irq_source : u8 { irq_mapper = 1, irq_frame_counter = 2, irq_dmc = 4 };
+
+// The interrupt inputs of the CPU. Devices set them, and the CPU polls them
+// before every instruction.
+struct interrupt_lines {
+  u8 irq = 0;        // Level triggered. One bit per irq_source.
+  bool nmi = false;  // Edge triggered. Cleared when the CPU takes it.
+  // Not an interrupt: ends run_for_cycles before the next instruction, so that
+  // a device can hand control back to the scheduler after changing its plans.
+  bool yield = false;
+
+  bool pending() const { return irq | nmi | yield; }
+  void set_irq(irq_source source, bool level) {
+    if (level)
+      irq |= source;
+    else
+      irq &= ~source;
+  }
+};
+
+#endif /* INTERRUPT_HPP */
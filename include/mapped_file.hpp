@@ -0,0 +1,29 @@
+#ifndef MAPPED_FILE_HPP
+#define MAPPED_FILE_HPP
+
+// A read only view of a whole file, memory mapped where possible.
+#include <string>
+#include <vector>
+
+#include "util.hpp"
+
+class mapped_file {
+  const u8 *data = nullptr;
+  std::size_t length = 0;
+  bool mapped = false;     // True if data is a mapping, to be unmapped.
+  std::vector<u8> buffer;  // Holds the contents when mapping is not possible.
+
+ public:
+  mapped_file() {}
+  mapped_file(const std::string &file);  // Map the file. Check is_open().
+  ~mapped_file();
+
+  mapped_file(const mapped_file &) = delete;
+  mapped_file &operator=(const mapped_file &) = delete;
+
+  bool is_open() const { return data != nullptr; }
+  const u8 *get_data() const { return data; }
+  std::size_t size() const { return length; }
+};
+
+#endif /* MAPPED_FILE_HPP */
@@ -0,0 +1,107 @@
+#ifndef MAPPER_HPP
+#define MAPPER_HPP
+
+#include <memory>
+
+#include "interrupt.hpp"
+#include "mmu.hpp"
+#include "rom_bank.hpp"
+#include "savestate.hpp"
+#include "tile_cache.hpp"
+#include "util.hpp"
+
+class cartridge;
+
+// How the two nametables of the console fill the four of the PPU address space.
+enum class nt_mirroring : u8 { horizontal, vertical, single_low, single_high, four_screen };
+
+// The bank switching logic of a cartridge board. Writes to 0x8000-0xFFFF are
+// routed to the mapper as register writes, while reads of the same pages go
+// straight to PRG ROM through the CPU page table. A bank switch only swaps the
+// page pointers of the affected window, and the 1 KB CHR window pointers the
+// PPU reads pattern data through, so it takes the same time whatever the bank
+// size. Nothing is ever copied.
+class mapper : public mem_handler {
+  cpu_memory *mem = nullptr;  // Set by attach.
+  const u8 *prg_map[4] = {};  // The 8 KB windows at 0x8000, 0xA000, 0xC000, 0xE000.
+
+ protected:
+  cartridge &cart;
+  interrupt_lines *lines = nullptr;  // Set by attach.
+
+  rom_bank<8> prg;  // PRG ROM, in the smallest bank size of any mapper.
+  rom_bank<1> chr;  // CHR ROM or RAM, likewise.
+
+  const u8 *chr_map[8] = {};      // The pattern tables, in 1 KB windows.
+  std::size_t chr_banks[8] = {};  // The banks in them.
+  tile_cache tiles;               // The same windows, decoded.
+  bool chr_writable;              // The windows point into CHR RAM.
+  nt_mirroring mirroring;
+
+  // Switch a window to a bank. Bank numbers are in units of the window size,
+  // and wrap around the ROM size. Slots count windows from 0x8000 for PRG, and
+  // from 0x0000 for CHR.
+  void map_prg_8k(u8 slot, std::size_t bank);
+  void map_prg_16k(u8 slot, std::size_t bank);
+  void map_prg_32k(std::size_t bank);
+  void map_chr_1k(u8 slot, std::size_t bank);
+  void map_chr_2k(u8 slot, std::size_t bank);
+  void map_chr_4k(u8 slot, std::size_t bank);
+  void map_chr_8k(std::size_t bank);
+
+  std::size_t num_prg_8k() const { return prg.get_num_banks(); }
+  void set_irq(bool level) { lines->set_irq(irq_mapper, level); }
+
+  virtual void power_on() = 0;  // Set up the registers and banks at power on.
+
+  // The registers of the board, for save states. Loading must remap the banks.
+  virtual void save_registers(state_buffer &) const {}
+  virtual void load_registers(state_buffer &) {}
+
+ public:
+  explicit mapper(cartridge &_cart);
+  mapper(const mapper &) = delete;
+  mapper &operator=(const mapper &) = delete;
+
+  // Take over the cartridge space of the CPU: PRG RAM at 0x6000-0x7FFF, and
+  // PRG ROM at 0x8000-0xFFFF.
+  void attach(cpu_memory &_mem, interrupt_lines &_lines);
+
+  u8 read(u16 address) override;  // PRG reads never get here. Open bus.
+  virtual void scanline() {}      // Called by the PPU once per rendered scanline.
+  // The number of scanline calls until the one that raises the IRQ, as things
+  // stand, or 0 if none will. The scheduler stops the CPU there.
+  virtual unsigned scanlines_to_irq() const { return 0; }
+
+  nt_mirroring get_mirroring() const { return mirroring; }
+  std::size_t get_chr_bank(u8 slot) const { return chr_banks[slot]; }  // Of a 1 KB window.
+
+  // Save states. Banks are not saved, but worked out again from the registers.
+  void save_state(state_buffer &state) const {
+    state.put(u8(mirroring));
+    save_registers(state);
+  }
+  void load_state(state_buffer &state) {
+    mirroring = nt_mirroring(state.get<u8>());
+    load_registers(state);
+    if (chr_writable) tiles.invalidate_all();  // The cartridge has just loaded CHR RAM.
+  }
+
+  // Pattern table access for the PPU, 0x0000-0x1FFF.
+  u8 chr_read(u16 address) const { return chr_map[(address >> 10) & 7][address & 0x3FF]; }
+  void chr_write(u16 address, u8 data) {
+    // The window points into the cartridge's CHR RAM, which is not const.
+    if (!chr_writable) return;
+    const_cast<u8 *>(chr_map[(address >> 10) & 7])[address & 0x3FF] = data;
+    tiles.invalidate(address);
+  }
+
+  // A row of 8 decoded pixels, see tile_cache. What the PPU renders from.
+  u64 chr_row(u16 address) { return tiles.row(address); }
+  tile_cache_stats get_tile_stats() const { return tiles.get_stats(); }
+};
+
+// Make the mapper for an iNES mapper number. Return nullptr if it isn't supported.
+std::unique_ptr<mapper> make_mapper(u8 number, cartridge &cart);
+
+#endif /* MAPPER_HPP */
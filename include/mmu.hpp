@@ -3,55 +3,260 @@
 
 // Beginning of MMU class.
 
+#include <cstring>
 #include <memory>
 
+#include "savestate.hpp"
 #include "util.hpp"
 
+// A device mapped in the CPU address space. Pages where reads or writes have
+// side effects (PPU and APU registers, mapper registers, ...) are routed to a
+// handler instead of plain memory.
+class mem_handler {
+ public:
+  virtual ~mem_handler() {}
+  virtual u8 read(u16 address) = 0;
+  virtual void write(u16 address, u8 data) = 0;
+
+  // Until which cycle the reads of address that follow another read of it,
+  // with no writes in between, all return the same value and change nothing.
+  // 0 if that can't be promised, as for most registers. Lets the CPU skip
+  // loops that poll a register, see cpu::idle_loop.
+  virtual u64 stable_until(u16 address) {
+    (void)address;
+    return 0;
+  }
+};
+
+// The CPU address space, as a table of 256 pages of 256 bytes. A page is either
+// a direct pointer to plain RAM/ROM, which is the fast path, or is routed to a
+// handler. Remapping a bank is a matter of swapping a few page pointers.
 template <std::size_t size>
 class cpu_core_memory {
-  // FIXME: This needs to be heavily re-factored. In particular, writes to ROM
-  // Area mean something particularly special, in context of MMU implementation.
+  static const std::size_t page_size = 256;
+  static const std::size_t num_pages = 256;
+
+  u8 mem[size];  // Backing store for the pages not mapped elsewhere.
+
+  const u8 *read_map[num_pages];     // Page data to read from, or nullptr.
+  u8 *write_map[num_pages];          // Page data to write to, or nullptr.
+  mem_handler *handlers[num_pages];  // Used when the map has a nullptr.
+
+  // Support for caches of decoded code. A page's generation changes whenever
+  // its contents may have changed behind the cache's back: it was remapped, or
+  // written to while watched.
+  u32 generation[num_pages];
+  u8 *watched[num_pages];  // Write pointer of a watched page, whose writes are diverted.
+  u64 invalidations = 0;   // Generation changes.
 
-  u8 mem[size];
+  void invalidate(std::size_t page) {
+    generation[page]++;
+    invalidations++;
+  }
+  void unwatch(u8 page);
+
+  // Call f on each page showing the same memory as page. The 2 KB of RAM shows
+  // up in four places below 0x2000, and code cached from one of them can be
+  // written through any.
+  template <typename F>
+  void for_aliases(u8 page, F f) {
+    if (page >= 0x20) return f(page);
+    for (std::size_t alias = page % 8; alias < 0x20; alias += 8) f(alias);
+  }
+
+  NOINLINE u8 read_slow(u16 address);
+  NOINLINE void write_slow(u16 address, u8 data);
 
  public:
+  cpu_core_memory();
+
   // Return appropriate memory location, taking mirroring into account.
-  u8 operator[](u16 address) {
-    u8 data = mem[address];
+  u8 operator[](u16 address) { return read_address(address); }
 
-    if (address <= 0x1FFF) data = mem[address % 0x0800];
+  u8 read_address(u16 address) {
+    const u8 *page = read_map[address >> 8];
+    if (page) return page[address & 0xFF];
+    return read_slow(address);
+  }
 
-    if (0x2000 <= address && address < 0x4000) data = mem[0x2000 + (address % 8)];
+  void write_address(u16 address, u8 data) {
+    u8 *page = write_map[address >> 8];
+    if (page)
+      page[address & 0xFF] = data;
+    else
+      write_slow(address, data);
+  }
 
-    return data;
-  };
+  // See mem_handler::stable_until. Plain memory only changes when written.
+  u64 stable_until(u16 address) {
+    if (read_map[address >> 8]) return ~u64(0);
+    mem_handler *handler = handlers[address >> 8];
+    return handler ? handler->stable_until(address) : ~u64(0);
+  }
 
-  void write_address(u16 address, u8 data);
-  u8 read_address(u16 address);
+  // Page mapping. Pages are given by the high byte of their address, and data
+  // must hold num * 256 bytes.
+  void map_read(u8 first, std::size_t num, const u8 *data);
+  void map_write(u8 first, std::size_t num, u8 *data);
+  void map_handler(u8 first, std::size_t num, mem_handler *handler);
+  // Give the accesses pages leave to the slow path to another handler, keeping
+  // what they map directly. For a device that sits in front of another.
+  void set_handler(u8 first, std::size_t num, mem_handler *handler);
+  void map_default(u8 first, std::size_t num);  // Back to the built in memory.
 
   void zeros() { std::memset(mem, 0, size); }
+
+  // Save states: the 2 KB of RAM, and what was written to the I/O space.
+  void save_state(state_buffer &state) const;
+  void load_state(state_buffer &state);
+  void invalidate_all();  // Memory changed behind the map's back. Drop cached code.
+
+  // Cached code support. A page can only be cached while it is directly mapped
+  // for reads. Watching a writable page diverts its writes to the slow path
+  // until the next one, which bumps the generation. RAM mirrors are watched
+  // together.
+  u32 get_generation(u8 page) const { return generation[page]; }
+  bool is_direct(u8 page) const { return read_map[page] != nullptr; }
+  const u8 *get_read_page(u8 page) const { return read_map[page]; }  // Or null.
+  void watch_writes(u8 page);
+  u64 get_invalidations() const { return invalidations; }
 };
 
-// Reading data stub. Data needs to be read from proper bank of MMU.
 template <std::size_t size>
-u8 cpu_core_memory<size>::read_address(u16 address) {
-  u8 data = mem[address];
+cpu_core_memory<size>::cpu_core_memory() {
+  static_assert(size >= num_pages * page_size, "The backing store must cover 64 KB.");
+  for (std::size_t page = 0; page < num_pages; page++) {
+    generation[page] = 1;  // Caches start with generation 0, which is never valid.
+    watched[page] = nullptr;
+  }
+  map_default(0x00, num_pages);
+}
+
+// The built in map. The 2 KB of RAM is mirrored up to 0x1FFF, and the 8 PPU
+// registers up to 0x3FFF. The latter don't fit in a page, so are done by
+// read_slow and write_slow.
+template <std::size_t size>
+void cpu_core_memory<size>::map_default(u8 first, std::size_t num) {
+  for (std::size_t page = first; page < first + num; page++) {
+    u8 *data = mem + page * page_size;
+    if (page < 0x20) data = mem + (page % 8) * page_size;
+    if (0x20 <= page && page < 0x40) data = nullptr;
 
-  if (address <= 0x1FFF) data = mem[address % 0x0800];
+    read_map[page] = data;
+    write_map[page] = data;
+    handlers[page] = nullptr;
+    watched[page] = nullptr;
+    invalidate(page);
+  }
+}
+
+template <std::size_t size>
+void cpu_core_memory<size>::map_read(u8 first, std::size_t num, const u8 *data) {
+  for (std::size_t ii = 0; ii < num; ii++) {
+    read_map[first + ii] = data ? data + ii * page_size : nullptr;
+    invalidate(first + ii);
+  }
+}
 
-  if (0x2000 <= address && address < 0x4000) data = mem[0x2000 + (address % 8)];
+template <std::size_t size>
+void cpu_core_memory<size>::map_write(u8 first, std::size_t num, u8 *data) {
+  for (std::size_t ii = 0; ii < num; ii++) {
+    write_map[first + ii] = data ? data + ii * page_size : nullptr;
+    watched[first + ii] = nullptr;
+  }
+}
 
-  return data;
+template <std::size_t size>
+void cpu_core_memory<size>::set_handler(u8 first, std::size_t num, mem_handler *handler) {
+  for (std::size_t page = first; page < first + num; page++) handlers[page] = handler;
+}
+
+template <std::size_t size>
+void cpu_core_memory<size>::map_handler(u8 first, std::size_t num, mem_handler *handler) {
+  for (std::size_t page = first; page < first + num; page++) {
+    read_map[page] = nullptr;
+    write_map[page] = nullptr;
+    handlers[page] = handler;
+    watched[page] = nullptr;
+    invalidate(page);
+  }
+}
+
+template <std::size_t size>
+void cpu_core_memory<size>::watch_writes(u8 page) {
+  for_aliases(page, [this](std::size_t alias) {
+    if (!write_map[alias]) return;
+    watched[alias] = write_map[alias];
+    write_map[alias] = nullptr;
+  });
+}
+
+template <std::size_t size>
+void cpu_core_memory<size>::unwatch(u8 page) {
+  for_aliases(page, [this](std::size_t alias) {
+    if (!watched[alias]) return;
+    write_map[alias] = watched[alias];
+    watched[alias] = nullptr;
+    invalidate(alias);
+  });
+}
+
+template <std::size_t size>
+void cpu_core_memory<size>::save_state(state_buffer &state) const {
+  state.put_bytes(mem, 0x800);
+  state.put_bytes(mem + 0x2000, 8);
+  state.put_bytes(mem + 0x4000, 0x2000);
+}
+
+template <std::size_t size>
+void cpu_core_memory<size>::load_state(state_buffer &state) {
+  state.get_bytes(mem, 0x800);
+  state.get_bytes(mem + 0x2000, 8);
+  state.get_bytes(mem + 0x4000, 0x2000);
+  invalidate_all();
+}
+
+template <std::size_t size>
+void cpu_core_memory<size>::invalidate_all() {
+  for (std::size_t page = 0; page < num_pages; page++) {
+    if (watched[page]) {
+      write_map[page] = watched[page];
+      watched[page] = nullptr;
+    }
+    invalidate(page);
+  }
+}
+
+// Reading data stub. Data needs to be read from proper bank of MMU.
+template <std::size_t size>
+u8 cpu_core_memory<size>::read_slow(u16 address) {
+  mem_handler *handler = handlers[address >> 8];
+  if (handler) return handler->read(address);
+
+  if (0x2000 <= address && address < 0x4000) return mem[0x2000 + (address % 8)];
+  return mem[address];
 }
 
 // Write data stub. Need to intercept various MMU calls.
 template <std::size_t size>
-void cpu_core_memory<size>::write_address(u16 address, u8 data) {
-  if (address <= 0x1FFF) address = address % 0x0800;
+void cpu_core_memory<size>::write_slow(u16 address, u8 data) {
+  if (u8 *page = watched[address >> 8]) {
+    unwatch(address >> 8);
+    page[address & 0xFF] = data;
+    return;
+  }
 
-  if (0x2000 <= address && address < 0x4000) address = 0x2000 + (address % 8);
+  mem_handler *handler = handlers[address >> 8];
+  if (handler) {
+    handler->write(address, data);
+    return;
+  }
 
+  if (0x2000 <= address && address < 0x4000) address = 0x2000 + (address % 8);
   mem[address] = data;
 }
 
+// The memory map of the NES CPU.
+typedef cpu_core_memory<64 * 1024> cpu_memory;
+
 #endif /* MMU_HPP */
@@ -0,0 +1,136 @@
+#ifndef PPU_HPP
+#define PPU_HPP
+
+// The picture processing unit, 2C02. It is driven a scanline at a time: a
+// visible line is rendered in one go at its start, from the registers as the
+// CPU left them at the end of the previous line.
+#include <vector>
+
+#include "compose.hpp"
+#include "interrupt.hpp"
+#include "mapper.hpp"
+#include "mmu.hpp"
+#include "savestate.hpp"
+#include "util.hpp"
+
+// What a frame did to the PPU, in order, for another PPU to do the same and
+// draw the same picture, see render_thread.
+struct ppu_event {
+  enum kind_t : u8 {
+    read,        // Of a register with side effects, at address.
+    write,       // Of data to a register, at address.
+    oam_dma,     // Of the page at address in ppu_log::pages.
+    start_line,  // Of the line at address.
+    hblank,      // Likewise.
+    mirroring,   // The mapper's nametable mirroring is now data.
+    chr_bank,    // The 1 KB pattern window data now shows bank address.
+  };
+  kind_t kind;
+  u8 data;
+  u16 address;
+};
+
+struct ppu_log {
+  std::vector<ppu_event> events;
+  std::vector<u8> pages;  // Copied by OAM DMA, 256 bytes each.
+
+  void clear() {
+    events.clear();
+    pages.clear();
+  }
+};
+
+class ppu : public mem_handler {
+ public:
+  static const int width = 256;
+  static const int height = 240;
+  static const int dots_per_line = 341;
+  static const int lines_per_frame = 262;  // NTSC.
+  static const int vblank_line = 241;      // VBL is set, and NMI raised, at its dot 1.
+  static const int prerender_line = 261;   // Clears the flags, and reloads the scroll.
+  static const int counter_dot = 260;      // When the MMC3 counter sees the A12 rise.
+
+ private:
+  mapper &board;           // The pattern tables, and the nametable mirroring.
+  interrupt_lines &lines;  // For NMI.
+
+  // Registers. http://wiki.nesdev.com/w/index.php/PPU_scrolling
+  u8 ctrl;       // 0x2000
+  u8 mask;       // 0x2001
+  u8 status;     // 0x2002, the top three bits.
+  u8 oam_addr;   // 0x2003
+  u16 v;         // Current VRAM address, 15 bits.
+  u16 t;         // Temporary VRAM address, where the top left of the screen is.
+  u8 fine_x;     // Fine X scroll, 3 bits.
+  bool w;        // First or second write of 0x2005 and 0x2006.
+  u8 read_data;  // The 0x2007 read buffer.
+  u8 io_latch;   // The data bus. Unused register bits read from it.
+
+  u8 vram[4096];  // Nametables. 2 KB on the console, the rest for four screen boards.
+  u8 palette[32];
+  u8 oam[256];
+
+  // The picture, as NES colour indices 0-63, width * height. It is drawn into
+  // own_frame, or into a buffer of the caller's, such as a ring slot.
+  u8 own_frame[height * width];
+  u8 *frame;
+  bool drawing;  // Off, lines only set the flags that drawing them would.
+  ppu_log *log;  // Where the events go, if anywhere.
+
+  // Memory of the PPU address space.
+  u16 nametable_address(u16 address) const;  // Into vram, after mirroring.
+  u8 ppu_read(u16 address);
+  void ppu_write(u16 address, u8 data);
+  static u8 palette_index(u16 address) {
+    // 0x3F10, 0x3F14, 0x3F18 and 0x3F1C mirror the backdrop entries below.
+    address &= 0x1F;
+    return (address & 0x13) == 0x10 ? address & 0x0F : address;
+  }
+
+  // A line is drawn as a background and a sprite layer, which are then
+  // composed. Layers hold indices into palette, 0 being transparent.
+  void render_line(int line);
+  void render_background(u8 *pixels);
+  void render_sprites(int line, u8 *pixels, u8 *flags);  // See sprite_flags.
+  void check_line(int line);  // Sprite 0 hit and overflow, without drawing.
+  void increment_y();  // Move v down a line, wrapping to the next nametable.
+
+ public:
+  ppu(mapper &_board, interrupt_lines &_lines);
+  void reset();
+
+  u8 read(u16 address) override;  // CPU side, 0x2000-0x3FFF.
+  void write(u16 address, u8 data) override;
+  void oam_dma(const u8 *page);  // 256 bytes from 0x4014.
+
+  // Scanline timing. The console calls them in this order for every line.
+  void start_line(int line);  // Dot 0: flags and rendering.
+  void hblank(int line);      // Dot 256 and after: scroll updates, mapper counter.
+  // The background or sprites are on, so lines are drawn and clock the mapper
+  // counter.
+  bool rendering() const { return mask & 0x18; }
+  u8 get_status() const { return status; }  // Without the side effects of reading it.
+
+  const u8 *get_frame() const { return frame; }  // width * height.
+  // Draw the following lines into target, or back into the PPU's own buffer
+  // for null, which then takes a copy of the picture so far.
+  void set_frame_target(u8 *target);
+  // Skip composing the picture, for frames no one will see. The CPU sees the
+  // same sprite 0 hit and overflow flags, but the frame keeps what was last
+  // drawn into it. On by default.
+  void set_drawing(bool _drawing) { drawing = _drawing; }
+  bool is_drawing() const { return drawing; }
+  void load_picture(const u8 *picture);  // Drawn elsewhere, width * height.
+
+  // Record what happens to the PPU into log, or stop for null. The mapper
+  // can't tell the PPU when it switches the pattern tables or mirroring, so
+  // the console calls board_changed after its writes.
+  void set_log(ppu_log *_log) { log = _log; }
+  void board_changed();
+  u64 state_hash() const;  // Of the picture and memories.
+
+  void save_state(state_buffer &state) const;
+  void load_state(state_buffer &state);
+};
+
+#endif /* PPU_HPP */
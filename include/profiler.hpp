@@ -0,0 +1,62 @@
+#ifndef PROFILER_HPP
+#define PROFILER_HPP
+
+// Execution profile of the CPU: how often each opcode runs and the cycles it
+// takes, and where the program counter spends its time. The cpu only keeps one
+// when built with NESCPP_PROFILE, see cpu::profile.
+#include <cstdint>
+#include <cstdio>
+#include <vector>
+
+#include "mmu.hpp"
+#include "util.hpp"
+
+class cpu_profiler {
+  u64 opcode_count[256];
+  u64 opcode_cycles[256];
+  u64 interrupt_count;
+  u64 interrupt_cycles;
+
+  // Instructions by where they were fetched from. Code in PRG ROM is counted
+  // by its offset in the ROM, so the same address in two banks is two entries,
+  // along with the address it ran at. Anything else is counted by address.
+  const u8 *prg;
+  std::size_t prg_size;
+  std::vector<u64> rom_hits;
+  std::vector<u16> rom_address;
+  std::vector<u64> other_hits;
+
+ public:
+  static const std::size_t bank_size = 16 * 1024;  // PRG banks, as counted by iNES.
+
+  cpu_profiler();
+  void set_prg(const u8 *data, std::size_t size);  // Allocates the counters.
+  void clear();
+
+  // An instruction at pc, whose page is mapped to page, or null if it is not
+  // mapped directly. Counting is all it does, without locks or allocation.
+  void record(u16 pc, const u8 *page, u8 opcode, u16 cycles) {
+    opcode_count[opcode]++;
+    opcode_cycles[opcode] += cycles;
+    if (page) {
+      // Pages outside of the ROM give offsets past its end, or wrap around.
+      std::size_t offset = std::uintptr_t(page) + (pc & 0xFF) - std::uintptr_t(prg);
+      if (offset < prg_size) {
+        rom_hits[offset]++;
+        rom_address[offset] = pc;
+        return;
+      }
+    }
+    other_hits[pc]++;
+  }
+  void record_interrupt(u16 cycles) {
+    interrupt_count++;
+    interrupt_cycles += cycles;
+  }
+
+  // The top opcodes, by cycles, the totals of each addressing mode and PRG
+  // bank, and the top addresses. Code outside of the ROM is read from mem.
+  void report(std::FILE *out, std::size_t top, cpu_memory &mem) const;
+};
+
+#endif /* PROFILER_HPP */
@@ -0,0 +1,60 @@
+#ifndef RENDER_THREAD_HPP
+#define RENDER_THREAD_HPP
+
+// Draws the picture on a thread of its own, so that a console runs on two
+// cores. The console's PPU doesn't draw, but works out the sprite 0 hit and
+// overflow flags the CPU reads, see ppu::set_drawing, and logs what happens to
+// it: register accesses, OAM DMA, line events and mapper switches, see
+// ppu_log. A copy of the PPU on the thread replays each frame's log, a frame
+// behind, and draws it exactly as the console's PPU would have.
+#include <atomic>
+#include <memory>
+#include <thread>
+
+#include "console.hpp"
+#include "ppu.hpp"
+#include "spsc_ring.hpp"
+#include "util.hpp"
+
+struct render_thread_stats {
+  u64 frames;      // Drawn by the thread.
+  u64 events;      // Replayed.
+  u64 overruns;    // Frames the emulation waited for the thread.
+  u64 underruns;   // Times the thread waited for a frame.
+  double draw_ns;  // Replaying and drawing, in all.
+};
+
+class render_thread {
+  class replay_mapper;  // The pattern tables and mirroring, as the log says.
+
+  console &machine;
+  std::unique_ptr<replay_mapper> board;
+  interrupt_lines lines;  // The copy's NMI, which goes nowhere.
+  ppu copy;
+  spsc_ring<ppu_log> logs;
+  std::atomic<u64> handed{0};  // Frames logged.
+  std::atomic<u64> drawn{0};   // Frames replayed.
+  u64 events = 0;
+  double draw_ns = 0;
+  std::thread worker;
+
+  void replay(const ppu_log &log);
+
+ public:
+  // Copy the console's PPU and mapper as they are. It must then only be run
+  // through run_frame, and not be restored, while this lives.
+  render_thread(console &_machine, std::size_t depth);
+  ~render_thread();
+
+  // Run a frame on the console, and hand its log to the thread. Waits if depth
+  // frames are waiting to be drawn.
+  void run_frame();
+
+  // Wait for the frames handed over to be drawn, and put the last one in the
+  // console's PPU, as if drawn there. Returns it, width * height.
+  const u8 *sync();
+
+  render_thread_stats get_stats() const;  // After sync.
+};
+
+#endif /* RENDER_THREAD_HPP */
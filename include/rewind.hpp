@@ -0,0 +1,68 @@
+#ifndef REWIND_HPP
+#define REWIND_HPP
+
+// A history of save states, one per frame, to step a long run back. Only the
+// newest state is kept whole. Each older one is kept as the XOR of it with the
+// state after it, with the runs of zeros, which are most of it, coded as
+// lengths. Going back a frame XORs the newest delta into the whole state, and
+// the oldest deltas can be dropped without touching the others.
+//
+// The deltas are packed in a byte ring of a fixed size, the budget, and the
+// oldest are dropped to make room for new ones, so the history is as long as
+// the budget allows rather than a number of frames.
+#include <deque>
+#include <string>
+#include <vector>
+
+#include "savestate.hpp"
+#include "util.hpp"
+
+struct rewind_stats {
+  u64 frames;        // States held, the newest included.
+  u64 pushed;        // States pushed since the start.
+  u64 dropped;       // Deltas dropped for room.
+  u64 state_bytes;   // Of the newest state, whole.
+  u64 stored_bytes;  // Of the deltas in the ring, and of the newest state.
+  u64 raw_bytes;     // That the states held would take whole.
+  double push_ns;    // In all: snapshot, delta and copy into the ring.
+  double rewind_ns;  // In all.
+  u64 rewound;       // Frames.
+};
+
+class rewind_buffer {
+  // A delta in the ring. It turns the state after it into the one before.
+  struct delta {
+    std::size_t offset;  // In the ring.
+    std::size_t size;
+  };
+
+  std::vector<u8> ring;
+  std::deque<delta> deltas;  // Oldest first.
+  state_buffer newest;
+  state_buffer next;      // The state being pushed.
+  std::vector<u8> coded;  // The delta being pushed.
+  u64 stored;             // Bytes of the deltas.
+  rewind_stats stats;
+  std::string error;
+
+  std::size_t place(std::size_t size);  // Make room, dropping the oldest.
+  void drop_oldest();
+
+ public:
+  // Keep up to budget bytes of deltas, on top of the newest state.
+  explicit rewind_buffer(std::size_t budget);
+
+  // Snapshot the console, between frames, as the newest state.
+  void push(console &machine);
+
+  // Restore the console as it was the given number of frames before the
+  // newest state, or as far back as is held, and forget the frames after it.
+  // On failure, get_error says why.
+  bool rewind(console &machine, u64 frames);
+
+  void clear();
+  rewind_stats get_stats() const;
+  const std::string &get_error() const { return error; }
+};
+
+#endif /* REWIND_HPP */
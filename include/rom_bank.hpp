@@ -5,54 +5,49 @@
 
 #include "util.hpp"
 
-// Declares different templated rom banks for character and program rom.
+// Declares different templated rom banks for character and program rom. A
+// rom_bank doesn't own its data: it is a view into the mapped ROM file (or into
+// RAM owned by the cartridge), so nothing is copied at load time.
 
 template <std::size_t size_in_kb>
 class rom_bank {
+ public:
   static const std::size_t bank_size = size_in_kb * 1024;
-  bool allocated = false;
-  std::size_t num_banks;
 
-  u8 *data;
-  std::size_t base_address;
-  std::size_t current_bank;
+ private:
+  std::size_t num_banks = 0;
+
+  const u8 *data = nullptr;
+  std::size_t base_address = 0;
+  std::size_t current_bank = 0;
 
  public:
   rom_bank(){};
-  rom_bank(u8 _num_banks);
-  void init(u8 _num_banks);
-
-  ~rom_bank();
+  rom_bank(const u8 *_data, std::size_t _num_banks);
+  void view(const u8 *_data, std::size_t _num_banks);  // Point at _num_banks banks.
 
   void switch_bank(std::size_t bank_id);
   std::size_t get_current_bank();
+  std::size_t get_num_banks() const { return num_banks; }
 
-  u8 &operator[](std::size_t location);
-  void set_bank(std::size_t bank_id, u8 *_bank_data);
+  const u8 &operator[](std::size_t location);
+  const u8 *bank(std::size_t bank_id) const;  // Start of a bank. Wraps around.
 };
 
 //-------------Declaration for templated functions. -------------------
 template <std::size_t size_in_kb>
-void rom_bank<size_in_kb>::init(u8 _num_banks) {
+void rom_bank<size_in_kb>::view(const u8 *_data, std::size_t _num_banks) {
+  data = _data;
   num_banks = _num_banks;
-  if (allocated) delete[] data;
-
-  data = new u8[num_banks * bank_size];
   base_address = 0;
-  allocated = true;
+  current_bank = 0;
 }
 
 template <std::size_t size_in_kb>
-rom_bank<size_in_kb>::rom_bank(u8 _num_banks) {
-  init(_num_banks);
+rom_bank<size_in_kb>::rom_bank(const u8 *_data, std::size_t _num_banks) {
+  view(_data, _num_banks);
 }
 
-template <std::size_t size_in_kb>
-rom_bank<size_in_kb>::~rom_bank() {
-  if (allocated) delete[] data;
-  allocated = false;
-};
-
 template <std::size_t size_in_kb>
 void rom_bank<size_in_kb>::switch_bank(std::size_t bank_id) {
   current_bank = bank_id;
@@ -60,7 +55,7 @@ void rom_bank<size_in_kb>::switch_bank(std::size_t bank_id) {
 }
 
 template <std::size_t size_in_kb>
-u8 &rom_bank<size_in_kb>::operator[](std::size_t location) {
+const u8 &rom_bank<size_in_kb>::operator[](std::size_t location) {
   return data[base_address + location];
 }
 
@@ -70,9 +65,9 @@ std::size_t rom_bank<size_in_kb>::get_current_bank() {
 }
 
 template <std::size_t size_in_kb>
-void rom_bank<size_in_kb>::set_bank(std::size_t bank_id, u8 *_bank_data) {
-  std::size_t base_addr = bank_id * bank_size;
-  std::copy(_bank_data, _bank_data + bank_size, (data + base_addr));
+const u8 *rom_bank<size_in_kb>::bank(std::size_t bank_id) const {
+  if (num_banks == 0) return nullptr;
+  return data + (bank_id % num_banks) * bank_size;
 }
 
 #endif /* ROM_BANK_HPP */
@@ -0,0 +1,45 @@
+#ifndef RUN_AHEAD_HPP
+#define RUN_AHEAD_HPP
+
+// Run-ahead, to cut the delay between input and picture. Games typically
+// show the effect of a button a frame or more after reading it. After each
+// frame, the console is saved, run some frames more with the same input,
+// silent, and the last of these is shown. Then the saved state is restored,
+// so the frames run ahead leave no trace, and the next input takes effect as
+// if they never ran. The picture then shows the response that many frames
+// earlier.
+#include "console.hpp"
+#include "ppu.hpp"
+#include "savestate.hpp"
+#include "util.hpp"
+
+struct run_ahead_stats {
+  u64 frames;       // Run ahead, and rolled back.
+  u64 snapshots;    // Taken, and as many restored.
+  double save_ns;   // In all.
+  double load_ns;   // In all.
+  u64 state_bytes;  // Size of a snapshot.
+};
+
+class run_ahead {
+  console &machine;
+  unsigned frames;  // Run ahead of each one.
+  state_buffer state;
+  u8 real[ppu::width * ppu::height];   // What the frames that count draw.
+  u8 shown[ppu::width * ppu::height];  // The picture, unless the caller has a buffer.
+  const u8 *picture;                   // The last one shown.
+  run_ahead_stats stats;
+
+ public:
+  run_ahead(console &_machine, unsigned _frames);
+
+  // Run a frame with the buttons set on the console, and draw the one frames
+  // after it into target, or into a buffer of its own for null. The sound of
+  // the frame that counts is left in the APU, see apu::get_samples. With
+  // drawing off on the PPU, nothing is drawn.
+  void run_frame(u8 *target);
+  const u8 *get_picture() const { return picture; }  // width * height.
+  const run_ahead_stats &get_stats() const { return stats; }
+};
+
+#endif /* RUN_AHEAD_HPP */
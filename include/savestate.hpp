@@ -0,0 +1,81 @@
+#ifndef SAVESTATE_HPP
+#define SAVESTATE_HPP
+
+// Save states: the mutable state of the machine in a fixed layout. ROM is
+// never saved, so a state only restores onto the cartridge it came from.
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "util.hpp"
+
+class console;
+
+// Byte buffer with little endian fields, written and read back in the same
+// order. Reads past the end return zeros and clear ok, so that loaders can
+// check once at the end.
+class state_buffer {
+  std::vector<u8> data;
+  std::size_t position = 0;  // Read cursor.
+  bool ok = true;
+
+ public:
+  void clear() {
+    data.clear();
+    position = 0;
+    ok = true;
+  }
+  void rewind() {
+    position = 0;
+    ok = true;
+  }
+  bool good() const { return ok; }
+  bool at_end() const { return position == data.size(); }
+  std::vector<u8> &bytes() { return data; }
+  const std::vector<u8> &bytes() const { return data; }
+
+  void put_bytes(const u8 *src, std::size_t size) { data.insert(data.end(), src, src + size); }
+  void get_bytes(u8 *dst, std::size_t size) {
+    if (data.size() - position < size) {
+      ok = false;
+      std::memset(dst, 0, size);
+      return;
+    }
+    std::memcpy(dst, data.data() + position, size);
+    position += size;
+  }
+
+  template <typename T>
+  void put(T value) {
+    u8 raw[sizeof(T)];
+    for (std::size_t ii = 0; ii < sizeof(T); ii++) raw[ii] = u64(value) >> (8 * ii);
+    put_bytes(raw, sizeof(T));
+  }
+  template <typename T>
+  T get() {
+    u8 raw[sizeof(T)];
+    get_bytes(raw, sizeof(T));
+    u64 value = 0;
+    for (std::size_t ii = 0; ii < sizeof(T); ii++) value |= u64(raw[ii]) << (8 * ii);
+    return T(value);
+  }
+};
+
+// Layout version. Bump it whenever a field is added, removed or resized.
+const u16 savestate_version = 4;
+
+// Snapshot the console into state, replacing its contents. The buffer keeps
+// its capacity, so snapshots after the first don't allocate.
+//
+// Layout: "NESS", u16 version, u8 mapper number, u8 CHR RAM flag, u32 total
+// size, then the cartridge (PRG RAM, CHR RAM if any, mapper registers), the
+// cpu (registers, counters, interrupt lines, 2 KB of RAM and the I/O backing
+// store), the ppu (registers, VRAM, palette, OAM), the apu (channels and frame
+// counter), the controllers (strobe and shift registers) and the frame count.
+void save_state(console &machine, state_buffer &state);
+
+// Restore a snapshot taken on the same cartridge. On failure, error says why,
+// and the machine is left alone.
+bool load_state(console &machine, state_buffer &state, std::string &error);
+
+#endif /* SAVESTATE_HPP */
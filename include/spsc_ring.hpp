@@ -0,0 +1,145 @@
+#ifndef SPSC_RING_HPP
+#define SPSC_RING_HPP
+
+// Hands frames and blocks of samples from the emulation thread to one
+// consumer thread, without locks.
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <thread>
+#include <vector>
+
+#include "util.hpp"
+
+// What the producer does when every slot is unread.
+enum class ring_policy : u8 {
+  drop_oldest,  // Drop the oldest unread slot. The producer never waits.
+  block,        // Wait for the consumer.
+};
+
+// A ring of fixed slots for one producer and one consumer thread. Slots are
+// filled and read in place: the producer gets a slot from begin_write, and
+// publishes it with end_write; the consumer gets the oldest one from try_read
+// or wait_read, and hands it back with end_read. Nothing is copied, nor
+// allocated after construction.
+//
+// Positions only grow, and slot p is slots[p % slots.size()]. The consumer
+// claims a slot by moving the tail past it, and the producer drops one the same
+// way, so the two only race on the tail, by compare and swap. There is a slot
+// more than the capacity for the one being read. After enough drops the write
+// position comes round to it anyway, and the frame is written to a spare slot
+// and dropped instead.
+//
+// Each shared index has a cache line of its own, so that the two threads don't
+// steal the line from each other on every access.
+template <typename T>
+class spsc_ring {
+  static constexpr u64 none = ~u64(0);
+  static constexpr std::size_t cache_line = 64;
+
+  std::vector<T> slots;
+  u64 capacity;  // Of unread slots.
+  ring_policy policy;
+  T spare;
+  bool writing_spare = false;
+
+  alignas(cache_line) std::atomic<u64> head{0};        // Next position to write.
+  alignas(cache_line) std::atomic<u64> tail{0};        // Oldest unread position.
+  alignas(cache_line) std::atomic<u64> reading{none};  // Held by the consumer.
+  alignas(cache_line) std::atomic<bool> closed{false};
+  alignas(cache_line) std::atomic<u64> overruns{0};   // Producer side.
+  alignas(cache_line) std::atomic<u64> underruns{0};  // Consumer side.
+
+  // Wait a little. A short wait yields, and a long one sleeps, so that a
+  // thread waiting for long doesn't keep a core from the other one.
+  static void backoff(unsigned &tries) {
+    if (++tries < 64)
+      std::this_thread::yield();
+    else
+      std::this_thread::sleep_for(std::chrono::microseconds(50));
+  }
+
+ public:
+  spsc_ring(std::size_t _capacity, ring_policy _policy, const T &prototype = T());
+
+  // Producer.
+  T *begin_write();
+  void end_write();
+  void close();  // No more slots. The consumer still gets the unread ones.
+
+  // Consumer. try_read returns null when the ring is empty, wait_read only
+  // once it is also closed.
+  T *try_read();
+  T *wait_read();
+  void end_read() { reading.store(none); }
+
+  std::size_t get_capacity() const { return capacity; }
+  // Slots dropped, or writes that had to wait, by policy.
+  u64 get_overruns() const { return overruns.load(std::memory_order_relaxed); }
+  // Reads that had to wait.
+  u64 get_underruns() const { return underruns.load(std::memory_order_relaxed); }
+};
+
+//-------------Declaration for templated functions. -------------------
+template <typename T>
+spsc_ring<T>::spsc_ring(std::size_t _capacity, ring_policy _policy, const T &prototype)
+    : slots(_capacity + 1, prototype), capacity(_capacity), policy(_policy), spare(prototype) {}
+
+template <typename T>
+T *spsc_ring<T>::begin_write() {
+  u64 position = head.load(std::memory_order_relaxed);
+  unsigned tries = 0;
+  for (u64 oldest = tail.load(); position - oldest >= capacity; oldest = tail.load()) {
+    if (policy == ring_policy::drop_oldest) {
+      if (tail.compare_exchange_weak(oldest, oldest + 1))
+        overruns.fetch_add(1, std::memory_order_relaxed);
+    } else {
+      if (!tries) overruns.fetch_add(1, std::memory_order_relaxed);
+      backoff(tries);
+    }
+  }
+
+  u64 held = reading.load();
+  writing_spare = held != none && (position - held) % slots.size() == 0;
+  return writing_spare ? &spare : &slots[position % slots.size()];
+}
+
+template <typename T>
+void spsc_ring<T>::end_write() {
+  if (writing_spare) {
+    overruns.fetch_add(1, std::memory_order_relaxed);
+    return;
+  }
+  head.store(head.load(std::memory_order_relaxed) + 1);
+}
+
+template <typename T>
+void spsc_ring<T>::close() {
+  closed.store(true);
+}
+
+template <typename T>
+T *spsc_ring<T>::try_read() {
+  // Mark the slot as held before claiming it, so that the producer can't see
+  // it claimed but not held.
+  u64 position = tail.load();
+  while (position != head.load()) {
+    reading.store(position);
+    if (tail.compare_exchange_weak(position, position + 1)) return &slots[position % slots.size()];
+  }
+  reading.store(none);
+  return nullptr;
+}
+
+template <typename T>
+T *spsc_ring<T>::wait_read() {
+  unsigned tries = 0;
+  for (;;) {
+    if (T *slot = try_read()) return slot;
+    if (closed.load()) return try_read();  // Written before it was closed.
+    if (!tries) underruns.fetch_add(1, std::memory_order_relaxed);
+    backoff(tries);
+  }
+}
+
+#endif /* SPSC_RING_HPP */
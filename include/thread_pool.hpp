@@ -0,0 +1,34 @@
+#ifndef THREAD_POOL_HPP
+#define THREAD_POOL_HPP
+
+// Runs a fixed set of independent tasks across threads.
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <vector>
+
+// Tasks are dealt out to a queue per thread up front. A thread works through
+// its own queue from the front, and when it runs dry steals from the back of
+// the others, so that uneven task lengths still keep every core busy. The
+// queues are only contended when stealing.
+class work_stealing_pool {
+  struct task_queue {
+    std::mutex lock;
+    std::deque<std::size_t> tasks;
+  };
+
+  unsigned num_threads;
+  std::vector<task_queue> queues;
+
+  bool next_task(unsigned thread, std::size_t &task);  // Own queue first, then steal.
+
+ public:
+  explicit work_stealing_pool(unsigned _num_threads = 0);  // 0 is one per core.
+  unsigned get_num_threads() const { return num_threads; }
+
+  // Call task(ii) for ii in [0, num_tasks), and return once all are done.
+  void run(std::size_t num_tasks, const std::function<void(std::size_t)> &task);
+};
+
+#endif /* THREAD_POOL_HPP */
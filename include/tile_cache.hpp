@@ -0,0 +1,65 @@
+#ifndef TILE_CACHE_HPP
+#define TILE_CACHE_HPP
+
+// Decoded pattern tables. A tile is 16 bytes of CHR, two bit planes of 8x8
+// pixels, and the PPU needs it as pixel values. Rather than pulling the planes
+// apart bit by bit on every fetch, each row of a tile is decoded once into a
+// 64 bit word: 8 bytes, one pixel value 0-3 each, leftmost pixel first in
+// memory.
+//
+// CHR is decoded a 1 KB bank (64 tiles) at a time, the first time the bank is
+// mapped into a window. The windows then point into the decoded banks, so a
+// mapper CHR switch costs as much as it did before. Writes to CHR RAM only
+// invalidate the tile they hit, which is decoded again by its next fetch.
+#include <cstring>
+#include <vector>
+
+#include "rom_bank.hpp"
+#include "util.hpp"
+
+struct tile_cache_stats {
+  u64 hits;      // Row fetches served from decoded tiles.
+  u64 rebuilds;  // Tiles decoded, on first map or after a CHR RAM write.
+};
+
+class tile_cache {
+ public:
+  static const std::size_t tiles_per_bank = 64;  // Of 16 bytes, in a 1 KB bank.
+
+ private:
+  const rom_bank<1> *chr = nullptr;  // The mapper's CHR, which is decoded.
+  std::vector<u64> rows;             // 8 per tile, for the whole CHR.
+  std::vector<u8> valid;             // Per tile. Cleared by CHR RAM writes.
+  std::vector<u8> built;             // Per bank. Decoded at least once.
+
+  u64 *window_rows[8] = {};  // Decoded rows of the 1 KB windows.
+  u8 *window_valid[8] = {};
+  const u8 *window_data[8] = {};  // The raw windows, to decode from.
+
+  u64 hits = 0;
+  u64 rebuilds = 0;
+
+  NOINLINE void decode(u8 slot, std::size_t tile);  // Tile within the window.
+
+ public:
+  void attach(const rom_bank<1> &_chr);  // Size the cache for the CHR banks.
+  void map(u8 slot, std::size_t bank);   // As the mapper maps a 1 KB window.
+  void invalidate(u16 address) { window_valid[(address >> 10) & 7][(address >> 4) & 0x3F] = 0; }
+  void invalidate_all();  // After the whole of CHR RAM was replaced.
+
+  // The decoded row of the tile at address, a pattern table address with the
+  // fine Y in its low bits. Bit 3, which selects the plane, is ignored.
+  u64 row(u16 address) {
+    u8 slot = (address >> 10) & 7;
+    std::size_t tile = (address >> 4) & 0x3F;
+    if (!window_valid[slot][tile])
+      decode(slot, tile);
+    else
+      hits++;
+    return window_rows[slot][tile * 8 + (address & 7)];
+  }
+
+  tile_cache_stats get_stats() const { return {hits, rebuilds}; }
+};
+
+#endif /* TILE_CACHE_HPP */
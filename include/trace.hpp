@@ -0,0 +1,106 @@
+#ifndef TRACE_HPP
+#define TRACE_HPP
+
+// Records every instruction the CPU runs, with the registers before it, to a
+// binary file, for comparing against known good logs such as nestest's.
+// Records are fixed size and collected in large blocks, which a writer thread
+// writes out, so that tracing doesn't slow the emulation down much.
+#include <cstdio>
+#include <string>
+#include <thread>
+
+#include "spsc_ring.hpp"
+#include "util.hpp"
+
+// An instruction about to run. Unused operand bytes are 0, as are bytes that
+// could not be read without side effects.
+struct trace_record {
+  u64 cycle;  // CPU cycles since power on, as nestest's CYC.
+  u16 pc;
+  u8 bytes[3];  // The opcode, and its operands.
+  u8 length;    // Of the instruction, in bytes.
+  u8 a, x, y, p, sp;
+  u8 reserved[3];
+};
+static_assert(sizeof(trace_record) == 24, "Trace records are written as they are.");
+
+// The file starts with this, then has records up to the end.
+struct trace_header {
+  char magic[8];  // "NESTRACE"
+  u32 version;
+  u32 record_size;  // sizeof(trace_record).
+};
+
+// Which instructions are recorded: those at a PC in [first_pc, last_pc], that
+// start on a cycle in [first_cycle, last_cycle].
+struct trace_trigger {
+  u16 first_pc = 0x0000;
+  u16 last_pc = 0xFFFF;
+  u64 first_cycle = 0;
+  u64 last_cycle = ~u64(0);
+
+  bool matches(u16 pc, u64 cycle) const {
+    return first_pc <= pc && pc <= last_pc && first_cycle <= cycle && cycle <= last_cycle;
+  }
+};
+
+class trace_recorder {
+  static const std::size_t block_records = 1 << 15;  // 768 KB.
+  static const std::size_t slots = 4;
+
+  struct trace_block {
+    std::size_t count;
+    trace_record records[block_records];
+  };
+
+  trace_trigger trigger;
+  int fd;
+  spsc_ring<trace_block> ring;
+  std::thread writer;
+  trace_block *current;  // Being filled, or null.
+  u64 recorded;
+  std::string error;
+  bool failed;  // Set by the writer, and only read once it has stopped.
+
+  void run();  // The writer thread.
+  bool write_all(const void *data, std::size_t size);
+
+ public:
+  static const u32 version = 1;
+
+  explicit trace_recorder(const trace_trigger &_trigger);
+  ~trace_recorder();
+  trace_recorder(const trace_recorder &) = delete;
+  trace_recorder &operator=(const trace_recorder &) = delete;
+
+  bool open(const std::string &file_name);  // Create the file, and start the writer.
+
+  bool wants(u16 pc, u64 cycle) const { return fd >= 0 && trigger.matches(pc, cycle); }
+  void record(const trace_record &entry) {
+    if (!current) {
+      current = ring.begin_write();
+      current->count = 0;
+    }
+    current->records[current->count++] = entry;
+    recorded++;
+    if (current->count == block_records) {
+      ring.end_write();
+      current = nullptr;
+    }
+  }
+
+  // Write out the rest, and close the file. False if anything failed.
+  bool close();
+  const std::string &get_error() const { return error; }
+  u64 get_recorded() const { return recorded; }
+  u64 get_waits() const { return ring.get_overruns(); }  // For the writer.
+};
+
+// Convert a trace to text, a line per instruction in the layout of nestest.log:
+//   C000  4C F5 C5  JMP $C5F5                       A:00 X:00 Y:00 P:24 SP:FD PPU:  0, 21 CYC:7
+// The values nestest shows after the operands ("= 00") are not recorded, so
+// are left out. The PPU position is worked out from the cycle, as nestest runs
+// with rendering off.
+bool trace_to_text(const std::string &file_name, std::FILE *out, std::string &error);
+
+#endif /* TRACE_HPP */
@@ -15,6 +15,17 @@ typedef int16_t i16;
 typedef int32_t i32;
 typedef int64_t i64;
 
+// Ask the compiler to inline every call made by a function, recursively. Used on
+// the dispatch loops, so that no opcode handler is left behind a call. Cold
+// paths are kept out of them with NOINLINE.
+#if defined(__GNUC__)
+#define FLATTEN __attribute__((flatten))
+#define NOINLINE __attribute__((noinline))
+#else
+#define FLATTEN
+#define NOINLINE
+#endif
+
 // A structure to access individual bits.
 template <std::size_t bitnum, typename T = u8>
 struct bitReg {
@@ -23,7 +34,7 @@ struct bitReg {
   constexpr const T mask() const { return 1u << bitnum; }
   void set() { data = (data | mask()); }
   void clear() { data = (data & ~mask()); }
-  T get() { return (data & mask()) >> bitnum; }
+  T get() const { return (data & mask()) >> bitnum; }
   void operator=(bool val) { val ? set() : clear(); }
 };
 
@@ -43,7 +54,10 @@ enum mem_mode  // Total 10 modes for NES where actual memory is read.
   m_INX,  //  Pre-Indexed Indirect Addressing
   m_INY,  //  Post-Indexed Indirect Addressing
   // --------Special additional modes -----------
-  m_ACCUM  // Accumulator
+  m_ACCUM,  // Accumulator
+  m_IMPL,   // Implied. No operand.
+  m_REL,    // Relative, for branches.
+  m_IND     // Indirect, for JMP.
 };
 
 // ---------- Utility to get high/low byte -------------- //
@@ -54,4 +68,12 @@ inline u16 combine_bytes(u8 low_byte, u8 high_byte) {
   return temp;
 }
 
+// ---------- Hashing -------------- //
+// 64 bit FNV-1a. Chain calls by passing the previous result as hash.
+const u64 fnv_offset_basis = 0xcbf29ce484222325ull;
+inline u64 fnv1a(const u8 *data, std::size_t size, u64 hash = fnv_offset_basis) {
+  for (std::size_t ii = 0; ii < size; ii++) hash = (hash ^ data[ii]) * 0x100000001b3ull;
+  return hash;
+}
+
 #endif /* UTIL_HPP */
@@ -0,0 +1,632 @@
+#include "apu.hpp"
+
+#include <algorithm>
+
+//------------------ Tables ---------------------//
+// http://wiki.nesdev.com/w/index.php/APU_Length_Counter
+static const u8 length_table[32] = {10, 254, 20, 2,  40, 4,  80, 6,  160, 8,  60,
+                                    10, 14,  12, 26, 14, 12, 16, 24, 18,  48, 20,
+                                    96, 22,  192, 24, 72, 26, 16, 28, 32, 30};
+
+// The sequencer counts down, so these read backwards in time.
+static const u8 duty_table[4][8] = {
+    {0, 1, 0, 0, 0, 0, 0, 0},
+    {0, 1, 1, 0, 0, 0, 0, 0},
+    {0, 1, 1, 1, 1, 0, 0, 0},
+    {1, 0, 0, 1, 1, 1, 1, 1},
+};
+
+static const u8 triangle_sequence[32] = {15, 14, 13, 12, 11, 10, 9,  8,  7,  6,  5,
+                                         4,  3,  2,  1,  0,  0,  1,  2,  3,  4,  5,
+                                         6,  7,  8,  9,  10, 11, 12, 13, 14, 15};
+
+// Timer periods in CPU cycles, NTSC.
+static const u16 noise_periods[16] = {4,   8,   16,  32,  64,  96,   128,  160,
+                                      202, 254, 380, 508, 762, 1016, 2034, 4068};
+static const u16 dmc_periods[16] = {428, 380, 340, 320, 286, 254, 226, 214,
+                                    190, 160, 142, 128, 106, 84,  72,  54};
+
+// Move a timer that is not run past end, keeping its phase.
+static void skip_ticks(u64 &next_tick, u64 end, u64 period) {
+  if (next_tick < end) next_tick += (end - next_tick + period - 1) / period * period;
+}
+
+//------------------ Units ---------------------//
+void envelope_unit::clock() {
+  if (start) {
+    start = false;
+    decay = 15;
+    divider = volume;
+  } else if (divider == 0) {
+    divider = volume;
+    if (decay)
+      decay--;
+    else if (loop)
+      decay = 15;
+  } else {
+    divider--;
+  }
+}
+
+void envelope_unit::save(state_buffer &state) const {
+  u8 fields[6] = {start, loop, constant, volume, divider, decay};
+  state.put_bytes(fields, sizeof(fields));
+}
+
+void envelope_unit::load(state_buffer &state) {
+  u8 fields[6];
+  state.get_bytes(fields, sizeof(fields));
+  start = fields[0];
+  loop = fields[1];
+  constant = fields[2];
+  volume = fields[3];
+  divider = fields[4];
+  decay = fields[5];
+}
+
+//------------------ Pulse ---------------------//
+u16 pulse_channel::sweep_target() const {
+  int change = period >> sweep_shift;
+  if (!sweep_negate) return period + change;
+  // Pulse 1 negates in one's complement.
+  int target = int(period) - change - (second ? 0 : 1);
+  return target < 0 ? 0 : target;
+}
+
+u8 pulse_channel::output() const {
+  if (!duty_table[duty][step] || !length || muted()) return 0;
+  return envelope.output();
+}
+
+void pulse_channel::clock_sweep() {
+  if (sweep_divider == 0 && sweep_enabled && sweep_shift && !muted()) period = sweep_target();
+  if (sweep_divider == 0 || sweep_reload) {
+    sweep_divider = sweep_period;
+    sweep_reload = false;
+  } else {
+    sweep_divider--;
+  }
+}
+
+void pulse_channel::write(u8 reg, u8 data) {
+  switch (reg) {
+    case 0:
+      duty = data >> 6;
+      envelope.loop = data & 0x20;
+      envelope.constant = data & 0x10;
+      envelope.volume = data & 0x0F;
+      break;
+    case 1:
+      sweep_enabled = data & 0x80;
+      sweep_period = (data >> 4) & 7;
+      sweep_negate = data & 0x08;
+      sweep_shift = data & 7;
+      sweep_reload = true;
+      break;
+    case 2:
+      period = (period & 0x700) | data;
+      break;
+    case 3:  // Also restarts the duty cycle and the envelope.
+      period = (period & 0xFF) | ((data & 7) << 8);
+      if (enabled) length = length_table[data >> 3];
+      step = 0;
+      envelope.start = true;
+      break;
+  }
+}
+
+void pulse_channel::save(state_buffer &state) const {
+  u8 fields[11] = {enabled,      duty,         step,        length,       sweep_enabled,
+                   sweep_negate, sweep_reload, sweep_period, sweep_shift, sweep_divider, second};
+  state.put_bytes(fields, sizeof(fields));
+  state.put(period);
+  state.put(next_tick);
+  envelope.save(state);
+}
+
+void pulse_channel::load(state_buffer &state) {
+  u8 fields[11];
+  state.get_bytes(fields, sizeof(fields));
+  enabled = fields[0];
+  duty = fields[1];
+  step = fields[2];
+  length = fields[3];
+  sweep_enabled = fields[4];
+  sweep_negate = fields[5];
+  sweep_reload = fields[6];
+  sweep_period = fields[7];
+  sweep_shift = fields[8];
+  sweep_divider = fields[9];
+  second = fields[10];
+  period = state.get<u16>();
+  next_tick = state.get<u64>();
+  envelope.load(state);
+}
+
+//------------------ Triangle ---------------------//
+u8 triangle_channel::output() const { return triangle_sequence[step]; }
+
+void triangle_channel::clock_linear() {
+  if (linear_reload)
+    linear = linear_reload_value;
+  else if (linear)
+    linear--;
+  if (!control) linear_reload = false;
+}
+
+void triangle_channel::write(u8 reg, u8 data) {
+  switch (reg) {
+    case 0:
+      control = data & 0x80;
+      linear_reload_value = data & 0x7F;
+      break;
+    case 2:
+      period = (period & 0x700) | data;
+      break;
+    case 3:
+      period = (period & 0xFF) | ((data & 7) << 8);
+      if (enabled) length = length_table[data >> 3];
+      linear_reload = true;
+      break;
+    default:  // 0x4009 is unused.
+      break;
+  }
+}
+
+void triangle_channel::save(state_buffer &state) const {
+  u8 fields[7] = {enabled, control, linear_reload_value, linear, linear_reload, step, length};
+  state.put_bytes(fields, sizeof(fields));
+  state.put(period);
+  state.put(next_tick);
+}
+
+void triangle_channel::load(state_buffer &state) {
+  u8 fields[7];
+  state.get_bytes(fields, sizeof(fields));
+  enabled = fields[0];
+  control = fields[1];
+  linear_reload_value = fields[2];
+  linear = fields[3];
+  linear_reload = fields[4];
+  step = fields[5];
+  length = fields[6];
+  period = state.get<u16>();
+  next_tick = state.get<u64>();
+}
+
+//------------------ Noise ---------------------//
+u64 noise_channel::timer_cycles() const { return noise_periods[period_index]; }
+
+void noise_channel::write(u8 reg, u8 data) {
+  switch (reg) {
+    case 0:
+      envelope.loop = data & 0x20;
+      envelope.constant = data & 0x10;
+      envelope.volume = data & 0x0F;
+      break;
+    case 2:
+      short_mode = data & 0x80;
+      period_index = data & 0x0F;
+      break;
+    case 3:
+      if (enabled) length = length_table[data >> 3];
+      envelope.start = true;
+      break;
+    default:  // 0x400D is unused.
+      break;
+  }
+}
+
+void noise_channel::save(state_buffer &state) const {
+  u8 fields[4] = {enabled, short_mode, period_index, length};
+  state.put_bytes(fields, sizeof(fields));
+  state.put(shift);
+  state.put(next_tick);
+  envelope.save(state);
+}
+
+void noise_channel::load(state_buffer &state) {
+  u8 fields[4];
+  state.get_bytes(fields, sizeof(fields));
+  enabled = fields[0];
+  short_mode = fields[1];
+  period_index = fields[2];
+  length = fields[3];
+  shift = state.get<u16>();
+  next_tick = state.get<u64>();
+  envelope.load(state);
+}
+
+//------------------ DMC ---------------------//
+u64 dmc_channel::timer_cycles() const { return dmc_periods[rate_index]; }
+
+void dmc_channel::save(state_buffer &state) const {
+  u8 fields[9] = {irq_enabled, loop, rate_index, level, buffer, buffer_full, shift, bits, silence};
+  state.put_bytes(fields, sizeof(fields));
+  state.put(u8(irq));
+  state.put(sample_address);
+  state.put(sample_length);
+  state.put(address);
+  state.put(remaining);
+  state.put(next_tick);
+}
+
+void dmc_channel::load(state_buffer &state) {
+  u8 fields[9];
+  state.get_bytes(fields, sizeof(fields));
+  irq_enabled = fields[0];
+  loop = fields[1];
+  rate_index = fields[2];
+  level = fields[3];
+  buffer = fields[4];
+  buffer_full = fields[5];
+  shift = fields[6];
+  bits = fields[7];
+  silence = fields[8];
+  irq = state.get<u8>();
+  sample_address = state.get<u16>();
+  sample_length = state.get<u16>();
+  address = state.get<u16>();
+  remaining = state.get<u16>();
+  next_tick = state.get<u64>();
+}
+
+void apu::fetch_sample() {
+  // The CPU is stalled for the read on hardware. It is not here.
+  dmc.buffer = mem.read_address(dmc.address);
+  dmc.buffer_full = true;
+  dmc.address = dmc.address == 0xFFFF ? 0x8000 : dmc.address + 1;
+  if (--dmc.remaining == 0) {
+    if (dmc.loop) {
+      dmc.restart();
+    } else if (dmc.irq_enabled) {
+      dmc.irq = true;
+      update_irq();
+    }
+  }
+}
+
+void apu::run_dmc(u64 end) {
+  u64 period = dmc.timer_cycles();
+  while (dmc.next_tick < end) {
+    if (!dmc.active()) {  // Nothing to play, or to fetch.
+      skip_ticks(dmc.next_tick, end, period);
+      return;
+    }
+    if (!dmc.silence) {
+      if (dmc.shift & 1) {
+        if (dmc.level <= 125) dmc.level += 2;
+      } else if (dmc.level >= 2) {
+        dmc.level -= 2;
+      }
+      if (sounding()) outputs[4].change(dmc.next_tick, dmc.level);
+    }
+    dmc.shift >>= 1;
+    if (--dmc.bits == 0) {  // Next byte, and fetch the one after.
+      dmc.bits = 8;
+      dmc.silence = !dmc.buffer_full;
+      dmc.shift = dmc.buffer;
+      dmc.buffer_full = false;
+      if (dmc.remaining) fetch_sample();
+    }
+    dmc.next_tick += period;
+  }
+}
+
+//------------------ Timing ---------------------//
+void apu::reset(u64 cycle) {
+  pulse[0] = pulse_channel();
+  pulse[1] = pulse_channel();
+  pulse[1].second = true;
+  triangle = triangle_channel();
+  noise = noise_channel();
+  dmc = dmc_channel();
+  pulse[0].next_tick = pulse[1].next_tick = triangle.next_tick = cycle;
+  noise.next_tick = dmc.next_tick = cycle;
+
+  five_step = irq_inhibit = frame_irq = false;
+  sequence_start = cycle;
+  sequence_step = 0;
+  clock = cycle;
+
+  set_sample_rate(sample_rate);
+  update_irq();
+}
+
+u64 apu::sequence_cycle(u8 step) const {
+  static const u16 steps[2][4] = {{7457, 14913, 22371, 29829}, {7457, 14913, 22371, 37281}};
+  return sequence_start + steps[five_step][step];
+}
+
+void apu::quarter_frame() {
+  pulse[0].envelope.clock();
+  pulse[1].envelope.clock();
+  triangle.clock_linear();
+  noise.envelope.clock();
+}
+
+void apu::half_frame() {
+  for (auto &channel : pulse) {
+    if (channel.length && !channel.envelope.loop) channel.length--;
+    channel.clock_sweep();
+  }
+  if (triangle.length && !triangle.control) triangle.length--;
+  if (noise.length && !noise.envelope.loop) noise.length--;
+}
+
+void apu::clock_sequence() {
+  quarter_frame();
+  if (sequence_step & 1) half_frame();
+  if (sequence_step == 3) {
+    if (!five_step && !irq_inhibit) frame_irq = true;
+    sequence_start += five_step ? 37282 : 29830;
+    sequence_step = 0;
+  } else {
+    sequence_step++;
+  }
+  record(clock);
+  update_irq();
+}
+
+void apu::run_channels(u64 end) {
+  run_dmc(end);
+  if (!sounding()) return;  // The other timers only matter to the output.
+
+  for (int ii = 0; ii < 2; ii++) {
+    pulse_channel &channel = pulse[ii];
+    u64 period = channel.timer_cycles();
+    if (!channel.length || channel.muted()) {  // Silent whatever the step.
+      skip_ticks(channel.next_tick, end, period);
+      continue;
+    }
+    for (; channel.next_tick < end; channel.next_tick += period) {
+      channel.step = (channel.step - 1) & 7;
+      outputs[ii].change(channel.next_tick, channel.output());
+    }
+  }
+
+  // The triangle holds its step while either counter is 0. Ultrasonic
+  // periods are held too, rather than played as a pop.
+  u64 period = triangle.timer_cycles();
+  if (!triangle.length || !triangle.linear || triangle.period < 2) {
+    skip_ticks(triangle.next_tick, end, period);
+  } else {
+    for (; triangle.next_tick < end; triangle.next_tick += period) {
+      triangle.step = (triangle.step + 1) & 31;
+      outputs[2].change(triangle.next_tick, triangle.output());
+    }
+  }
+
+  period = noise.timer_cycles();
+  if (!noise.length) {
+    skip_ticks(noise.next_tick, end, period);
+  } else {
+    for (; noise.next_tick < end; noise.next_tick += period) {
+      u16 feedback = (noise.shift ^ (noise.shift >> (noise.short_mode ? 6 : 1))) & 1;
+      noise.shift = (noise.shift >> 1) | (feedback << 14);
+      outputs[3].change(noise.next_tick, noise.output());
+    }
+  }
+}
+
+void apu::run_until(u64 cycle) {
+  while (clock < cycle) {
+    u64 step_cycle = sequence_cycle(sequence_step);
+    u64 next = std::min(cycle, step_cycle);
+    run_channels(next);
+    clock = next;
+    if (clock == step_cycle) clock_sequence();
+  }
+}
+
+u64 apu::next_irq() const {
+  u64 next = ~u64(0);
+  if (!five_step && !irq_inhibit) next = sequence_cycle(3);
+
+  // The DMC raises its IRQ when it fetches the last byte, at the timer tick
+  // that empties the shift register. Ticks run when the APU is run past them.
+  if (dmc.irq_enabled && !dmc.loop && dmc.remaining && dmc.buffer_full) {
+    u64 period = dmc.timer_cycles();
+    u64 fetch = dmc.next_tick + (dmc.bits - 1) * period + (dmc.remaining - 1) * 8 * period;
+    next = std::min(next, fetch + 1);
+  }
+  return next;
+}
+
+u64 apu::next_fetch() const {
+  // A byte is fetched when the shift register is reloaded, at the tick that
+  // empties it.
+  if (!dmc.remaining) return ~u64(0);
+  return dmc.next_tick + (dmc.bits - 1) * dmc.timer_cycles() + 1;
+}
+
+//------------------ Registers ---------------------//
+u8 apu::read_status() {
+  u8 status = (pulse[0].length ? 0x01 : 0) | (pulse[1].length ? 0x02 : 0) |
+              (triangle.length ? 0x04 : 0) | (noise.length ? 0x08 : 0) |
+              (dmc.remaining ? 0x10 : 0) | (frame_irq ? 0x40 : 0) | (dmc.irq ? 0x80 : 0);
+  frame_irq = false;  // Reading acknowledges the frame IRQ.
+  update_irq();
+  return status;
+}
+
+void apu::write(u16 address, u8 data) {
+  if (address < 0x4008) {
+    pulse[(address >> 2) & 1].write(address & 3, data);
+  } else if (address < 0x400C) {
+    triangle.write(address & 3, data);
+  } else if (address < 0x4010) {
+    noise.write(address & 3, data);
+  } else {
+    switch (address) {
+      case 0x4010:
+        dmc.irq_enabled = data & 0x80;
+        dmc.loop = data & 0x40;
+        dmc.rate_index = data & 0x0F;
+        if (!dmc.irq_enabled) dmc.irq = false;
+        break;
+      case 0x4011:  // Direct load of the output, for PCM.
+        dmc.level = data & 0x7F;
+        break;
+      case 0x4012:
+        dmc.sample_address = 0xC000 + data * 64;
+        break;
+      case 0x4013:
+        dmc.sample_length = data * 16 + 1;
+        break;
+      case 0x4015: {  // Channel enables. Disabling clears the length counter.
+        for (int ii = 0; ii < 2; ii++) {
+          pulse[ii].enabled = data & (1 << ii);
+          if (!pulse[ii].enabled) pulse[ii].length = 0;
+        }
+        triangle.enabled = data & 0x04;
+        if (!triangle.enabled) triangle.length = 0;
+        noise.enabled = data & 0x08;
+        if (!noise.enabled) noise.length = 0;
+
+        dmc.irq = false;
+        if (!(data & 0x10)) {
+          dmc.remaining = 0;
+        } else if (!dmc.remaining) {
+          dmc.restart();
+          if (!dmc.buffer_full) fetch_sample();
+        }
+        break;
+      }
+      case 0x4017:  // Frame counter mode. The sequence restarts.
+        five_step = data & 0x80;
+        irq_inhibit = data & 0x40;
+        if (irq_inhibit) frame_irq = false;
+        sequence_start = clock;
+        sequence_step = 0;
+        if (five_step) {
+          quarter_frame();
+          half_frame();
+        }
+        break;
+      default:
+        break;
+    }
+  }
+  record(clock);
+  update_irq();
+}
+
+//------------------ Output ---------------------//
+void apu::record(u64 cycle) {
+  if (!sounding()) return;
+  outputs[0].change(cycle, pulse[0].output());
+  outputs[1].change(cycle, pulse[1].output());
+  outputs[2].change(cycle, triangle.output());
+  outputs[3].change(cycle, noise.output());
+  outputs[4].change(cycle, dmc.level);
+}
+
+void apu::set_sample_rate(u32 rate) {
+  sample_rate = rate;
+  samples.clear();
+  samples_done = 0;
+  rate_start = clock;
+  high_pass = last_mix = 0;
+  for (auto &output : outputs) output.events.clear();
+  if (!rate) return;
+
+  // The timers were not run while muted.
+  for (auto &channel : pulse) channel.next_tick = std::max(channel.next_tick, clock);
+  triangle.next_tick = std::max(triangle.next_tick, clock);
+  noise.next_tick = std::max(noise.next_tick, clock);
+
+  u8 levels[5] = {pulse[0].output(), pulse[1].output(), triangle.output(), noise.output(),
+                  dmc.level};
+  for (int ii = 0; ii < 5; ii++) outputs[ii].start = outputs[ii].current = levels[ii];
+}
+
+void apu::end_frame(u64 cycle) {
+  run_until(cycle);
+  if (silent) return;
+  std::vector<i16> &out = sample_target ? *sample_target : samples;
+  out.clear();
+  if (!sample_rate) return;
+
+  // Each sample is the average level of every channel over its span, walking
+  // the events in order. They are then mixed with the nonlinear DAC formulas.
+  // http://wiki.nesdev.com/w/index.php/APU_Mixer
+  std::size_t cursor[5] = {};
+  u8 level[5];
+  for (int ii = 0; ii < 5; ii++) level[ii] = outputs[ii].start;
+
+  u64 begin = sample_cycle(samples_done);
+  u64 end = sample_cycle(samples_done + 1);
+  while (end <= clock) {
+    double average[5];
+    for (int ii = 0; ii < 5; ii++) {
+      const std::vector<level_event> &events = outputs[ii].events;
+      u64 time = begin;
+      double sum = 0;
+      for (; cursor[ii] < events.size() && events[cursor[ii]].cycle < end; cursor[ii]++) {
+        const level_event &event = events[cursor[ii]];
+        if (event.cycle > time) {
+          sum += double(level[ii]) * (event.cycle - time);
+          time = event.cycle;
+        }
+        level[ii] = event.level;
+      }
+      sum += double(level[ii]) * (end - time);
+      average[ii] = sum / (end - begin);
+    }
+
+    double pulses = average[0] + average[1];
+    double pulse_out = pulses > 0 ? 95.88 / (8128.0 / pulses + 100) : 0;
+    double tnd = average[2] / 8227 + average[3] / 12241 + average[4] / 22638;
+    double tnd_out = tnd > 0 ? 159.79 / (1 / tnd + 100) : 0;
+    double mix = pulse_out + tnd_out;
+
+    // The console's output is AC coupled. A one pole high pass takes the DC off.
+    high_pass = 0.996 * high_pass + mix - last_mix;
+    last_mix = mix;
+    double value = std::min(std::max(high_pass * 32767, -32768.0), 32767.0);
+    out.push_back(i16(value));
+
+    samples_done++;
+    begin = end;
+    end = sample_cycle(samples_done + 1);
+  }
+
+  // Events of the sample that isn't finished yet wait for the next frame.
+  for (int ii = 0; ii < 5; ii++) {
+    std::vector<level_event> &events = outputs[ii].events;
+    events.erase(events.begin(), events.begin() + cursor[ii]);
+    outputs[ii].start = level[ii];
+  }
+}
+
+//------------------ State ---------------------//
+void apu::save_state(state_buffer &state) const {
+  pulse[0].save(state);
+  pulse[1].save(state);
+  triangle.save(state);
+  noise.save(state);
+  dmc.save(state);
+  u8 fields[4] = {five_step, irq_inhibit, frame_irq, sequence_step};
+  state.put_bytes(fields, sizeof(fields));
+  state.put(sequence_start);
+  state.put(clock);
+}
+
+void apu::load_state(state_buffer &state) {
+  pulse[0].load(state);
+  pulse[1].load(state);
+  triangle.load(state);
+  noise.load(state);
+  dmc.load(state);
+  u8 fields[4];
+  state.get_bytes(fields, sizeof(fields));
+  five_step = fields[0];
+  irq_inhibit = fields[1];
+  frame_irq = fields[2];
+  sequence_step = fields[3] & 3;
+  sequence_start = state.get<u64>();
+  clock = state.get<u64>();
+  if (!silent) set_sample_rate(sample_rate);
+  update_irq();
+}
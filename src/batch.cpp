@@ -0,0 +1,127 @@
+#include "batch.hpp"
+
+#include <chrono>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <memory>
+#include <sstream>
+#include <vector>
+
+#include "cartridge.hpp"
+#include "console.hpp"
+#include "thread_pool.hpp"
+
+namespace {
+
+struct batch_job {
+  std::string rom;
+  u64 frames = 600;
+  u64 cycles = UINT64_MAX;
+};
+
+struct batch_result {
+  std::string error;  // Empty if the run went fine.
+  u64 frames = 0;
+  u64 cycles = 0;
+  u64 instructions = 0;
+  u64 hash = 0;
+  u64 wall_ns = 0;
+};
+
+bool parse_manifest(const std::string &name, std::vector<batch_job> &jobs) {
+  std::ifstream file(name);
+  if (!file) return false;
+
+  std::string line;
+  while (std::getline(file, line)) {
+    std::istringstream fields(line);
+    batch_job job;
+    if (!(fields >> job.rom) || job.rom[0] == '#') continue;
+
+    // Unknown fields are ignored, so that manifests can carry notes.
+    std::string field;
+    while (fields >> field) {
+      if (field.compare(0, 7, "frames=") == 0)
+        job.frames = std::strtoull(field.c_str() + 7, nullptr, 10);
+      else if (field.compare(0, 7, "cycles=") == 0)
+        job.cycles = std::strtoull(field.c_str() + 7, nullptr, 10);
+    }
+    jobs.push_back(job);
+  }
+  return true;
+}
+
+void run_job(const batch_job &job, cpu_engine engine, batch_result &result) {
+  auto start = std::chrono::steady_clock::now();
+
+  cartridge cart(job.rom);
+  if (!cart.check_rom()) {
+    result.error = cart.get_error();
+    return;
+  }
+
+  // On the heap, as the thread stacks may be small.
+  std::unique_ptr<console> machine(new console(cart));
+  cpu &processor = machine->get_cpu();
+  processor.set_engine(engine);
+  machine->reset();
+
+  // Whole frames. The cycle limit is checked between frames, so a run can go
+  // over it by up to a frame.
+  while (result.frames < job.frames && processor.get_cycles() < job.cycles) {
+    machine->run_frame();
+    result.frames++;
+  }
+
+  result.cycles = processor.get_cycles();
+  result.instructions = processor.get_instructions();
+  result.hash = machine->state_hash();
+  result.wall_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                       std::chrono::steady_clock::now() - start)
+                       .count();
+}
+
+}  // namespace
+
+int run_batch(const batch_options &options) {
+  std::vector<batch_job> jobs;
+  if (!parse_manifest(options.manifest, jobs)) {
+    std::fprintf(stderr, "Cannot read the manifest %s.\n", options.manifest.c_str());
+    return -1;
+  }
+
+  // Each run owns its cartridge and cpu, and the results are written to
+  // separate slots, so the threads share nothing while running.
+  std::vector<batch_result> results(jobs.size());
+  work_stealing_pool pool(options.threads);
+  auto start = std::chrono::steady_clock::now();
+  pool.run(jobs.size(), [&](std::size_t ii) { run_job(jobs[ii], options.engine, results[ii]); });
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+  FILE *out = options.output.empty() ? stdout : std::fopen(options.output.c_str(), "w");
+  if (!out) {
+    std::fprintf(stderr, "Cannot write %s.\n", options.output.c_str());
+    return -1;
+  }
+
+  int failed = 0;
+  u64 instructions = 0;
+  for (std::size_t ii = 0; ii < jobs.size(); ii++) {
+    const batch_result &result = results[ii];
+    if (!result.error.empty()) {
+      std::fprintf(out, "%s\terror\t%s\n", jobs[ii].rom.c_str(), result.error.c_str());
+      failed++;
+      continue;
+    }
+    std::fprintf(out, "%s\t%" PRIu64 "\t%" PRIu64 "\t%016" PRIx64 "\t%" PRIu64 "\n",
+                 jobs[ii].rom.c_str(), result.frames, result.cycles, result.hash, result.wall_ns);
+    instructions += result.instructions;
+  }
+  if (out != stdout) std::fclose(out);
+
+  std::fprintf(stderr, "%zu runs (%d failed) on %u threads in %.3f s, %.2f M instructions/s.\n",
+               jobs.size(), failed, pool.get_num_threads(), seconds, instructions / seconds / 1e6);
+  return failed;
+}
@@ -1,16 +1,24 @@
 #include "cartridge.hpp"
 
-#include <fstream>
+#include <algorithm>
+#include <cstdio>
 
 //------------------ Cartridge functions ---------------------//
-cartridge::cartridge(std::string file) {
-  // Open and read the NES cartridge file.
-  std::ifstream fh;
-  fh.open(file, std::ifstream::binary | std::ifstream::in);
-  fh.seekg(0, fh.beg);  // Go to the start of the file.
+cartridge::cartridge(std::string file_name) : file(file_name) {
+  // The file is memory mapped, and the banks are views into it. Only the parts
+  // of the ROM a game touches are ever read from disk.
+  const u8 *data = file.get_data();
+  std::size_t size = file.size();
+  if (!file.is_open() || size < 16) {
+    error = "cannot read the file, or it is too short";
+    num_prg_rom = num_chr_rom = num_prg_ram = mapper_number = 0;
+    trainer_present = prg_ram_present = four_screen_vram = false;
+    mirroring_type = horiz;
+    return;
+  }
 
   // Read in the required flags.
-  fh.read(reinterpret_cast<char *>(header), 16);
+  std::copy(data, data + 16, header);
 
   num_prg_rom = header[4];
   num_chr_rom = header[5];
@@ -21,33 +29,43 @@ cartridge::cartridge(std::string file) {
   trainer_present = header[6] & 4;
   four_screen_vram = header[6] & 16;
 
-  mapper_number = combine_bytes(get_low_byte(header[6]), get_high_byte(header[7]));
-  prg_rom.init(num_prg_rom);
-  chr_rom.init(num_chr_rom);
-
-  u8 *buffer;
-  if (trainer_present) {
-    buffer = new u8[512];
-    fh.read(reinterpret_cast<char *>(buffer), 512);
-    std::copy(buffer, buffer + 512, trainer);
-    delete[] buffer;
+  // The low nibble of the mapper number is in flags 6, the high one in flags 7.
+  mapper_number = (header[6] >> 4) | (header[7] & 0xF0);
+
+  // Validate the lengths against the header counts before pointing into the
+  // file.
+  std::size_t offset = 16;
+  std::size_t trainer_size = trainer_present ? 512 : 0;
+  std::size_t prg_size = std::size_t(num_prg_rom) * decltype(prg_rom)::bank_size;
+  std::size_t chr_size = std::size_t(num_chr_rom) * decltype(chr_rom)::bank_size;
+  if (num_prg_rom == 0) {
+    error = "there is no PRG ROM";
+    return;
   }
-
-  // Read PRG ROM.
-  buffer = new u8[16 * 1024];
-  for (std::size_t ii = 0; ii < num_prg_rom; ii++) {
-    fh.read(reinterpret_cast<char *>(buffer), 16 * 1024);
-    prg_rom.set_bank(ii, buffer);
+  if (offset + trainer_size + prg_size + chr_size > size) {
+    error = "the file is shorter than its header says";
+    return;
   }
-  delete[] buffer;
 
-  // Read CHR ROM.
-  buffer = new u8[8 * 1024];
-  for (std::size_t ii = 0; ii < num_prg_rom; ii++) {
-    fh.read(reinterpret_cast<char *>(buffer), 16 * 1024);
-    chr_rom.set_bank(ii, buffer);
+  if (trainer_present) trainer = data + offset;
+  offset += trainer_size;
+
+  prg_rom.view(data + offset, num_prg_rom);
+  offset += prg_size;
+
+  if (num_chr_rom) {
+    chr_rom.view(data + offset, num_chr_rom);
+  } else {  // The board has 8 KB of CHR RAM instead.
+    chr_ram.assign(decltype(chr_rom)::bank_size, 0);
+    chr_rom.view(chr_ram.data(), 1);
   }
-  delete[] buffer;
+
+  // The trainer, if any, is loaded at 0x7000.
+  prg_ram.assign(8 * 1024, 0);
+  if (trainer) std::copy(trainer, trainer + trainer_size, prg_ram.begin() + 0x1000);
+
+  board = make_mapper(mapper_number, *this);
+  if (!board) error = "mapper " + std::to_string(mapper_number) + " is not supported";
 
   // Discarding other part of NES ROM here.
 }
@@ -76,10 +94,22 @@ bool cartridge::check_rom() {
   bool is_valid = true;
   // First see if thise first fours bytes are NES and break character.
   is_valid = is_valid & (header[0] == 0x4E) & (header[1] == 0x45) & (header[2] == 0x53) &
-             (header[4] == 0x1A);
+             (header[3] == 0x1A);
+  if (!is_valid && error.empty()) error = "the header has no NES magic number";
 
-  // Make sure Byte 8-15 are 0.
-  for (u8 ii = 8; ii < 16; ii++) is_valid &= (header[ii] == 0);
+  // Bytes 8-15 are not checked. They hold the PRG RAM size, and NES 2.0 uses
+  // the rest.
+  return is_valid && error.empty();
+}
+
+void cartridge::save_state(state_buffer &state) const {
+  state.put_bytes(prg_ram.data(), prg_ram.size());
+  state.put_bytes(chr_ram.data(), chr_ram.size());
+  board->save_state(state);
+}
 
-  return is_valid;
+void cartridge::load_state(state_buffer &state) {
+  state.get_bytes(prg_ram.data(), prg_ram.size());
+  state.get_bytes(chr_ram.data(), chr_ram.size());
+  board->load_state(state);
 }
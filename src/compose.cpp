@@ -0,0 +1,306 @@
+#include "compose.hpp"
+
+#include <cstring>
+
+// The vector paths are built with per function target attributes, so that the
+// rest of the program keeps the baseline instruction set and still runs on
+// CPUs without them.
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define COMPOSE_X86 1
+#include <immintrin.h>
+#define TARGET(isa) __attribute__((target(isa)))
+#endif
+
+static const int line_width = 256;
+
+//------------------ Colours ---------------------//
+// The 2C02 palette, as R, G, B.
+static const u8 nes_rgb[64][3] = {
+    {0x66, 0x66, 0x66}, {0x00, 0x2A, 0x88}, {0x14, 0x12, 0xA7}, {0x3B, 0x00, 0xA4},
+    {0x5C, 0x00, 0x7E}, {0x6E, 0x00, 0x40}, {0x6C, 0x06, 0x00}, {0x56, 0x1D, 0x00},
+    {0x33, 0x35, 0x00}, {0x0B, 0x48, 0x00}, {0x00, 0x52, 0x00}, {0x00, 0x4F, 0x08},
+    {0x00, 0x40, 0x4D}, {0x00, 0x00, 0x00}, {0x00, 0x00, 0x00}, {0x00, 0x00, 0x00},
+    {0xAD, 0xAD, 0xAD}, {0x15, 0x5F, 0xD9}, {0x42, 0x40, 0xFF}, {0x75, 0x27, 0xFE},
+    {0xA0, 0x1A, 0xCC}, {0xB7, 0x1E, 0x7B}, {0xB5, 0x31, 0x20}, {0x99, 0x4E, 0x00},
+    {0x6B, 0x6D, 0x00}, {0x38, 0x87, 0x00}, {0x0C, 0x93, 0x00}, {0x00, 0x8F, 0x32},
+    {0x00, 0x7C, 0x8D}, {0x00, 0x00, 0x00}, {0x00, 0x00, 0x00}, {0x00, 0x00, 0x00},
+    {0xFF, 0xFE, 0xFF}, {0x64, 0xB0, 0xFF}, {0x92, 0x90, 0xFF}, {0xC6, 0x76, 0xFF},
+    {0xF3, 0x6A, 0xFF}, {0xFE, 0x6E, 0xCC}, {0xFE, 0x81, 0x70}, {0xEA, 0x9E, 0x22},
+    {0xBC, 0xBE, 0x00}, {0x88, 0xD8, 0x00}, {0x5C, 0xE4, 0x30}, {0x45, 0xE0, 0x82},
+    {0x48, 0xCD, 0xDE}, {0x4F, 0x4F, 0x4F}, {0x00, 0x00, 0x00}, {0x00, 0x00, 0x00},
+    {0xFF, 0xFE, 0xFF}, {0xC0, 0xDF, 0xFF}, {0xD3, 0xD2, 0xFF}, {0xE8, 0xC8, 0xFF},
+    {0xFB, 0xC2, 0xFF}, {0xFE, 0xC4, 0xEA}, {0xFE, 0xCC, 0xC5}, {0xF7, 0xD8, 0xA5},
+    {0xE4, 0xE5, 0x94}, {0xCF, 0xEF, 0x96}, {0xBD, 0xF4, 0xAB}, {0xB3, 0xF3, 0xCC},
+    {0xB5, 0xEB, 0xF2}, {0xB8, 0xB8, 0xB8}, {0x00, 0x00, 0x00}, {0x00, 0x00, 0x00},
+};
+
+// The palette laid out for each path: whole pixels for copies and gathers, and
+// one plane per channel for byte shuffles.
+struct colour_tables {
+  u32 rgba[64];
+  u8 channels[3][64];
+
+  colour_tables() {
+    for (int ii = 0; ii < 64; ii++) {
+      u8 pixel[4] = {nes_rgb[ii][0], nes_rgb[ii][1], nes_rgb[ii][2], 0xFF};
+      std::memcpy(&rgba[ii], pixel, sizeof(pixel));
+      for (int channel = 0; channel < 3; channel++) channels[channel][ii] = nes_rgb[ii][channel];
+    }
+  }
+};
+
+static const colour_tables &get_colour_tables() {
+  static const colour_tables tables;
+  return tables;
+}
+
+//------------------ Scalar ---------------------//
+static bool compose_line_scalar(const u8 *background, const u8 *sprites, const u8 *flags,
+                                const u8 *palette, u8 colour_mask, u8 *out) {
+  bool hit = false;
+  for (int x = 0; x < line_width; x++) {
+    bool opaque_background = background[x];
+    bool opaque_sprite = sprites[x];
+    if (opaque_background && opaque_sprite && (flags[x] & sprite_zero) && x != 255) hit = true;
+
+    u8 index = background[x];
+    if (opaque_sprite && !(opaque_background && (flags[x] & sprite_behind))) index = sprites[x];
+    out[x] = palette[index] & colour_mask;
+  }
+  return hit;
+}
+
+static void to_rgba_scalar(const u8 *indices, std::size_t count, u8 *out) {
+  const colour_tables &tables = get_colour_tables();
+  for (std::size_t ii = 0; ii < count; ii++)
+    std::memcpy(out + ii * 4, &tables.rgba[indices[ii] & 0x3F], 4);
+}
+
+#ifdef COMPOSE_X86
+//------------------ SSSE3 ---------------------//
+// 16 pixels at a time. Every test is a byte mask, so the priority rules become
+// ands and ors, and the 32 entry palette is looked up with two byte shuffles.
+TARGET("ssse3")
+static bool compose_line_ssse3(const u8 *background, const u8 *sprites, const u8 *flags,
+                               const u8 *palette, u8 colour_mask, u8 *out) {
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i ones = _mm_set1_epi8(-1);
+  const __m128i behind_bit = _mm_set1_epi8(sprite_behind);
+  const __m128i zero_bit = _mm_set1_epi8(sprite_zero);
+  const __m128i high_bit = _mm_set1_epi8(0x10);
+  const __m128i mask = _mm_set1_epi8(colour_mask);
+  const __m128i palette_low = _mm_loadu_si128((const __m128i *)palette);
+  const __m128i palette_high = _mm_loadu_si128((const __m128i *)(palette + 16));
+
+  int hits = 0;
+  for (int x = 0; x < line_width; x += 16) {
+    __m128i bg = _mm_loadu_si128((const __m128i *)(background + x));
+    __m128i sp = _mm_loadu_si128((const __m128i *)(sprites + x));
+    __m128i fl = _mm_loadu_si128((const __m128i *)(flags + x));
+
+    __m128i bg_clear = _mm_cmpeq_epi8(bg, zero);
+    __m128i sp_clear = _mm_cmpeq_epi8(sp, zero);
+    __m128i behind = _mm_cmpeq_epi8(_mm_and_si128(fl, behind_bit), behind_bit);
+    __m128i sprite_0 = _mm_cmpeq_epi8(_mm_and_si128(fl, zero_bit), zero_bit);
+
+    // Hits where neither layer is clear. Not at x = 255, the last lane.
+    int hit = _mm_movemask_epi8(_mm_andnot_si128(_mm_or_si128(bg_clear, sp_clear), sprite_0));
+    hits |= x == line_width - 16 ? hit & 0x7FFF : hit;
+
+    // The sprite shows where it is opaque, unless behind an opaque background.
+    __m128i hidden = _mm_andnot_si128(bg_clear, behind);
+    __m128i use_sprite = _mm_andnot_si128(_mm_or_si128(sp_clear, hidden), ones);
+    __m128i index = _mm_or_si128(_mm_and_si128(use_sprite, sp), _mm_andnot_si128(use_sprite, bg));
+
+    __m128i low = _mm_shuffle_epi8(palette_low, index);  // Uses the low 4 bits.
+    __m128i high = _mm_shuffle_epi8(palette_high, index);
+    __m128i is_high = _mm_cmpeq_epi8(_mm_and_si128(index, high_bit), high_bit);
+    __m128i colour = _mm_or_si128(_mm_and_si128(is_high, high), _mm_andnot_si128(is_high, low));
+    _mm_storeu_si128((__m128i *)(out + x), _mm_and_si128(colour, mask));
+  }
+  return hits;
+}
+
+// Each channel of 16 pixels is looked up in its 64 entry plane as four 16
+// entry shuffles, keeping the one the top bits of the index select. The
+// channels are then interleaved into pixels.
+TARGET("ssse3")
+static void to_rgba_ssse3(const u8 *indices, std::size_t count, u8 *out) {
+  const colour_tables &tables = get_colour_tables();
+  const __m128i index_mask = _mm_set1_epi8(0x3F);
+  const __m128i quarter_mask = _mm_set1_epi8(0x30);
+  const __m128i alpha = _mm_set1_epi8(-1);
+
+  std::size_t ii = 0;
+  for (; ii + 16 <= count; ii += 16) {
+    __m128i index = _mm_and_si128(_mm_loadu_si128((const __m128i *)(indices + ii)), index_mask);
+    __m128i quarter = _mm_and_si128(index, quarter_mask);
+
+    __m128i channels[3];
+    for (int channel = 0; channel < 3; channel++) {
+      __m128i value = _mm_setzero_si128();
+      for (int part = 0; part < 4; part++) {
+        __m128i plane = _mm_loadu_si128((const __m128i *)(tables.channels[channel] + part * 16));
+        __m128i selected = _mm_cmpeq_epi8(quarter, _mm_set1_epi8(part * 16));
+        value = _mm_or_si128(value, _mm_and_si128(selected, _mm_shuffle_epi8(plane, index)));
+      }
+      channels[channel] = value;
+    }
+
+    __m128i rg_low = _mm_unpacklo_epi8(channels[0], channels[1]);
+    __m128i rg_high = _mm_unpackhi_epi8(channels[0], channels[1]);
+    __m128i ba_low = _mm_unpacklo_epi8(channels[2], alpha);
+    __m128i ba_high = _mm_unpackhi_epi8(channels[2], alpha);
+    __m128i *dst = (__m128i *)(out + ii * 4);
+    _mm_storeu_si128(dst, _mm_unpacklo_epi16(rg_low, ba_low));
+    _mm_storeu_si128(dst + 1, _mm_unpackhi_epi16(rg_low, ba_low));
+    _mm_storeu_si128(dst + 2, _mm_unpacklo_epi16(rg_high, ba_high));
+    _mm_storeu_si128(dst + 3, _mm_unpackhi_epi16(rg_high, ba_high));
+  }
+  to_rgba_scalar(indices + ii, count - ii, out + ii * 4);
+}
+
+//------------------ AVX2 ---------------------//
+// The same as SSSE3 over 32 pixels. Byte shuffles stay within 128 bit lanes,
+// so the palette halves are repeated in both.
+TARGET("avx2")
+static bool compose_line_avx2(const u8 *background, const u8 *sprites, const u8 *flags,
+                              const u8 *palette, u8 colour_mask, u8 *out) {
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i ones = _mm256_set1_epi8(-1);
+  const __m256i behind_bit = _mm256_set1_epi8(sprite_behind);
+  const __m256i zero_bit = _mm256_set1_epi8(sprite_zero);
+  const __m256i high_bit = _mm256_set1_epi8(0x10);
+  const __m256i mask = _mm256_set1_epi8(colour_mask);
+  const __m256i palette_low =
+      _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)palette));
+  const __m256i palette_high =
+      _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)(palette + 16)));
+
+  u32 hits = 0;
+  for (int x = 0; x < line_width; x += 32) {
+    __m256i bg = _mm256_loadu_si256((const __m256i *)(background + x));
+    __m256i sp = _mm256_loadu_si256((const __m256i *)(sprites + x));
+    __m256i fl = _mm256_loadu_si256((const __m256i *)(flags + x));
+
+    __m256i bg_clear = _mm256_cmpeq_epi8(bg, zero);
+    __m256i sp_clear = _mm256_cmpeq_epi8(sp, zero);
+    __m256i behind = _mm256_cmpeq_epi8(_mm256_and_si256(fl, behind_bit), behind_bit);
+    __m256i sprite_0 = _mm256_cmpeq_epi8(_mm256_and_si256(fl, zero_bit), zero_bit);
+
+    u32 hit = _mm256_movemask_epi8(
+        _mm256_andnot_si256(_mm256_or_si256(bg_clear, sp_clear), sprite_0));
+    hits |= x == line_width - 32 ? hit & 0x7FFFFFFF : hit;
+
+    __m256i hidden = _mm256_andnot_si256(bg_clear, behind);
+    __m256i use_sprite = _mm256_andnot_si256(_mm256_or_si256(sp_clear, hidden), ones);
+    __m256i index = _mm256_blendv_epi8(bg, sp, use_sprite);
+
+    __m256i low = _mm256_shuffle_epi8(palette_low, index);
+    __m256i high = _mm256_shuffle_epi8(palette_high, index);
+    __m256i is_high = _mm256_cmpeq_epi8(_mm256_and_si256(index, high_bit), high_bit);
+    __m256i colour = _mm256_blendv_epi8(low, high, is_high);
+    _mm256_storeu_si256((__m256i *)(out + x), _mm256_and_si256(colour, mask));
+  }
+  return hits;
+}
+
+// 8 pixels at a time, each fetched whole from the RGBA table with a gather.
+TARGET("avx2")
+static void to_rgba_avx2(const u8 *indices, std::size_t count, u8 *out) {
+  const colour_tables &tables = get_colour_tables();
+  const __m256i index_mask = _mm256_set1_epi32(0x3F);
+
+  std::size_t ii = 0;
+  for (; ii + 8 <= count; ii += 8) {
+    __m256i index = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(indices + ii)));
+    index = _mm256_and_si256(index, index_mask);
+    __m256i pixels = _mm256_i32gather_epi32((const int *)tables.rgba, index, 4);
+    _mm256_storeu_si256((__m256i *)(out + ii * 4), pixels);
+  }
+  to_rgba_scalar(indices + ii, count - ii, out + ii * 4);
+}
+#endif
+
+//------------------ Selection ---------------------//
+const char *simd_path_name(simd_path path) {
+  switch (path) {
+    case simd_path::ssse3:
+      return "ssse3";
+    case simd_path::avx2:
+      return "avx2";
+    default:
+      return "scalar";
+  }
+}
+
+bool simd_path_supported(simd_path path) {
+  switch (path) {
+    case simd_path::scalar:
+      return true;
+#ifdef COMPOSE_X86
+    case simd_path::ssse3:
+      __builtin_cpu_init();
+      return __builtin_cpu_supports("ssse3");
+    case simd_path::avx2:
+      __builtin_cpu_init();
+      return __builtin_cpu_supports("avx2");
+#endif
+    default:
+      return false;
+  }
+}
+
+static simd_path &active_path() {
+  static simd_path path = simd_path_supported(simd_path::avx2)    ? simd_path::avx2
+                          : simd_path_supported(simd_path::ssse3) ? simd_path::ssse3
+                                                                  : simd_path::scalar;
+  return path;
+}
+
+simd_path get_simd_path() { return active_path(); }
+
+bool set_simd_path(simd_path path) {
+  if (!simd_path_supported(path)) return false;
+  active_path() = path;
+  return true;
+}
+
+bool compose_line(simd_path path, const u8 *background, const u8 *sprites, const u8 *flags,
+                  const u8 *palette, u8 colour_mask, u8 *out) {
+  switch (path) {
+#ifdef COMPOSE_X86
+    case simd_path::ssse3:
+      return compose_line_ssse3(background, sprites, flags, palette, colour_mask, out);
+    case simd_path::avx2:
+      return compose_line_avx2(background, sprites, flags, palette, colour_mask, out);
+#endif
+    default:
+      return compose_line_scalar(background, sprites, flags, palette, colour_mask, out);
+  }
+}
+
+bool compose_line(const u8 *background, const u8 *sprites, const u8 *flags, const u8 *palette,
+                  u8 colour_mask, u8 *out) {
+  return compose_line(active_path(), background, sprites, flags, palette, colour_mask, out);
+}
+
+void to_rgba(simd_path path, const u8 *indices, std::size_t count, u8 *out) {
+  switch (path) {
+#ifdef COMPOSE_X86
+    case simd_path::ssse3:
+      to_rgba_ssse3(indices, count, out);
+      break;
+    case simd_path::avx2:
+      to_rgba_avx2(indices, count, out);
+      break;
+#endif
+    default:
+      to_rgba_scalar(indices, count, out);
+      break;
+  }
+}
+
+void to_rgba(const u8 *indices, std::size_t count, u8 *out) {
+  to_rgba(active_path(), indices, count, out);
+}
@@ -0,0 +1,225 @@
+#include "console.hpp"
+
+#include <algorithm>
+
+console::console(cartridge &_cart)
+    : cart(_cart),
+      video(_cart.get_mapper(), processor.get_interrupt_lines()),
+      audio(processor.get_memory(), processor.get_interrupt_lines()),
+      frame_count(0),
+      timing(console_timing::scheduled),
+      buttons{},
+      shifts{},
+      strobe(false),
+      next_event(0),
+      slice_end(0) {
+  processor.insert_cartridge(cart);
+  // Every access that can change what the PPU draws comes through here, so it
+  // is caught up first. PRG reads still go straight to the ROM.
+  cpu_memory &mem = processor.get_memory();
+  mem.map_handler(0x20, 0x20, this);
+  mem.map_handler(0x40, 0x01, this);
+  mem.set_handler(0x80, 0x80, this);
+}
+
+void console::reset() {
+  video.reset();
+  processor.reset();
+  audio.reset(processor.get_cycles());
+}
+
+u64 console::event_cycle(int event) const {
+  // Event times come from the frame count, so the CPU overshooting one doesn't
+  // drift.
+  u64 dot = frame_count * dots_per_frame + u64(event / 2) * ppu::dots_per_line;
+  if (event & 1) dot += ppu::counter_dot;
+  return dot / 3;
+}
+
+void console::catch_up(u64 cycle) {
+  for (; next_event < events_per_frame && event_cycle(next_event) <= cycle; next_event++) {
+    if (next_event & 1)
+      video.hblank(next_event / 2);
+    else
+      video.start_line(next_event / 2);
+  }
+}
+
+u64 console::next_due() {
+  u64 due = std::min(audio.next_irq(), audio.next_fetch());
+
+  // The start of vblank, which may raise NMI.
+  const int vblank_event = 2 * ppu::vblank_line;
+  if (next_event <= vblank_event) due = std::min(due, event_cycle(vblank_event));
+
+  // The hblank at which the mapper counter reaches its IRQ. It is clocked on
+  // rendered lines while rendering, which only a write to the PPU can change.
+  unsigned clocks = cart.get_mapper().scanlines_to_irq();
+  if (clocks && video.rendering()) {
+    for (int event = next_event | 1; event < events_per_frame; event += 2) {
+      int line = event / 2;
+      if (line >= ppu::height && line != ppu::prerender_line) continue;
+      if (--clocks == 0) {
+        due = std::min(due, event_cycle(event));
+        break;
+      }
+    }
+  }
+  return due;
+}
+
+void console::reschedule() {
+  if (timing == console_timing::scheduled && next_due() < slice_end) processor.yield();
+}
+
+void console::run_frame() {
+  next_event = 0;
+  const u64 frame_end = ((frame_count + 1) * dots_per_frame) / 3;
+  for (u64 now = processor.get_cycles(); now < frame_end; now = processor.get_cycles()) {
+    catch_up(now);
+    audio.run_until(now);
+    if (timing == console_timing::lockstep)
+      slice_end = now + 1;  // One instruction.
+    else
+      slice_end = std::max(std::min(frame_end, next_due()), now + 1);
+    processor.run_for_cycles(slice_end - now);
+  }
+  catch_up(frame_end - 1);  // The lines nothing looked at.
+  audio.end_frame(processor.get_cycles());
+  frame_count++;
+}
+
+const u8 *console::run_frames(u64 count) {
+  bool drawing = video.is_drawing();
+  video.set_drawing(false);
+  for (u64 ii = 1; ii < count; ii++) run_frame();
+  video.set_drawing(true);
+  if (count) run_frame();
+  video.set_drawing(drawing);
+  return video.get_frame();
+}
+
+u64 console::state_hash() {
+  u64 video_hash = video.state_hash();
+  u8 bytes[8];
+  for (int ii = 0; ii < 8; ii++) bytes[ii] = video_hash >> (8 * ii);
+  u64 hash = fnv1a(bytes, sizeof(bytes), processor.state_hash());
+
+  state_buffer audio_state;
+  audio.save_state(audio_state);
+  return fnv1a(audio_state.bytes().data(), audio_state.bytes().size(), hash);
+}
+
+// ------------------- Device registers -------------------- //
+u8 console::read(u16 address) {
+  u64 now = processor.get_cycles();
+  if (address < 0x4000) {
+    catch_up(now);
+    return video.read(address);
+  }
+  if (address >= 0x8000) return cart.get_mapper().read(address);
+
+  switch (address) {
+    case 0x4015:
+      audio.run_until(now);
+      return audio.read_status();
+    case 0x4016:  // Controllers. The top bits are open bus.
+    case 0x4017:
+      return 0x40 | read_controller(address & 1);
+    default:
+      return 0;
+  }
+}
+
+u64 console::stable_until(u16 address) {
+  if (address == 0x4015) return audio.status_stable_until();
+  if (address >= 0x4000 || (address & 7) != 2) return 0;
+
+  // PPUSTATUS changes at the start of vblank and of the prerender line, and on
+  // a rendered line, which may set sprite 0 hit or overflow unless both are.
+  bool lines_may_set = video.rendering() && (video.get_status() & 0x60) != 0x60;
+  for (int event = (next_event + 1) & ~1; event < events_per_frame; event += 2) {
+    int line = event / 2;
+    if (line == ppu::vblank_line || line == ppu::prerender_line ||
+        (line < ppu::height && lines_may_set))
+      return event_cycle(event);
+  }
+  return ((frame_count + 1) * dots_per_frame) / 3;  // The frame ends first.
+}
+
+void console::write(u16 address, u8 data) {
+  u64 now = processor.get_cycles();
+  if (address < 0x4000) {
+    catch_up(now);
+    video.write(address, data);
+    if ((address & 7) == 1) reschedule();  // Rendering may have been turned on or off.
+    return;
+  }
+  if (address >= 0x8000) {
+    // The DMC may fetch from the banks being switched.
+    catch_up(now);
+    audio.run_until(now);
+    cart.get_mapper().write(address, data);
+    video.board_changed();
+    reschedule();
+    return;
+  }
+
+  switch (address) {
+    case 0x4014: {  // OAM DMA. The CPU is stopped while a page is copied.
+      catch_up(now);
+      cpu_memory &mem = processor.get_memory();
+      u8 page[256];
+      for (int ii = 0; ii < 256; ii++) page[ii] = mem.read_address((data << 8) | ii);
+      video.oam_dma(page);
+      processor.stall(513);
+      break;
+    }
+    case 0x4016:  // Controller strobe.
+      strobe = data & 1;
+      if (strobe) {
+        shifts[0] = buttons[0];
+        shifts[1] = buttons[1];
+      }
+      break;
+    default:  // The APU, 0x4000-0x4013, 0x4015 and 0x4017.
+      if (address <= 0x4017) {
+        audio.run_until(now);
+        audio.write(address, data);
+        reschedule();
+      }
+      break;
+  }
+}
+
+u8 console::read_controller(int port) {
+  // A standard controller shifts out its 8 buttons, and then ones.
+  if (strobe) shifts[port] = buttons[port];
+  u8 bit = shifts[port] & 1;
+  shifts[port] = (shifts[port] >> 1) | 0x80;
+  return bit;
+}
+
+// ------------------- Save states ------------------------- //
+void console::save_state(state_buffer &state) {
+  cart.save_state(state);
+  processor.save_state(state);
+  video.save_state(state);
+  audio.save_state(state);
+  state.put(u8(strobe));
+  state.put(shifts[0]);
+  state.put(shifts[1]);
+  state.put(frame_count);
+}
+
+void console::load_state(state_buffer &state) {
+  // The cartridge comes first, as the CPU drops decoded code, PRG RAM included.
+  cart.load_state(state);
+  processor.load_state(state);
+  video.load_state(state);
+  audio.load_state(state);
+  strobe = state.get<u8>();
+  shifts[0] = state.get<u8>();
+  shifts[1] = state.get<u8>();
+  frame_count = state.get<u64>();
+}
@@ -1,174 +1,379 @@
 #include "cpu.hpp"
 
-// Implement the constructor which defines the opcode table.
+#include <algorithm>
+
+#include "trace.hpp"
+
+#ifdef NESCPP_PROFILE
+static const bool profiling = true;  // Which counts every instruction, so skips none.
+#else
+static const bool profiling = false;
+#endif
+
+// Implement the constructor. The opcode table is built at compile time.
 cpu::cpu() {
   // Set the initial variables to be zero.
   cycle_count = 0;
+  page_crossed = false;
+  total_cycles = 0;
+  total_instructions = 0;
+  engine = cpu_engine::table;
+  regs.operand = 0;
+  uncached_op = {};
+  decode_hits = 0;
+  decode_misses = 0;
+  tracer = nullptr;
+  loop = {};
+  idle_skip = true;
+  run_end = 0;
+  idle_instructions = 0;
+  idle_stats = {};
   mem.zeros();
-  P.byte = 0;
-  A = 0;
-  X = 0;
-  Y = 0;
-  SP = 0;
-  PC = 0;
-
-  // Initialize the opcode table.
-  opcode_table[0x00] = &cpu::BRK;
-  opcode_table[0x10] = &cpu::BPL;
-  opcode_table[0x01] = &cpu::ORA<m_INX>;
-  opcode_table[0x11] = &cpu::ORA<m_INY>;
-  opcode_table[0x05] = &cpu::ORA<m_ZPG>;
-  opcode_table[0x15] = &cpu::ORA<m_ZPX>;
-  opcode_table[0x06] = &cpu::ASL<m_ZPG>;
-  opcode_table[0x16] = &cpu::ASL<m_ZPX>;
-  opcode_table[0x08] = &cpu::PHP;
-  opcode_table[0x18] = &cpu::CLC;
-  opcode_table[0x09] = &cpu::ORA<m_IMM>;
-  opcode_table[0x19] = &cpu::ORA<m_ABY>;
-  opcode_table[0x0A] = &cpu::ASL<m_ACCUM>;
-  opcode_table[0x1D] = &cpu::ORA<m_ABX>;
-  opcode_table[0x0D] = &cpu::ORA<m_ABS>;
-  opcode_table[0x1E] = &cpu::ASL<m_ABX>;
-  opcode_table[0x0E] = &cpu::ASL<m_ABS>;
-
-  opcode_table[0x20] = &cpu::JSR;
-  opcode_table[0x30] = &cpu::BMI;
-  opcode_table[0x21] = &cpu::AND<m_INX>;
-  opcode_table[0x31] = &cpu::AND<m_INY>;
-  opcode_table[0x24] = &cpu::BIT<m_ZPG>;
-  opcode_table[0x35] = &cpu::AND<m_ZPG>;
-  opcode_table[0x25] = &cpu::AND<m_ZPG>;
-  opcode_table[0x36] = &cpu::ROL<m_ZPG>;
-  opcode_table[0x26] = &cpu::ROL<m_ZPG>;
-  opcode_table[0x38] = &cpu::SEC;
-  opcode_table[0x28] = &cpu::PLP;
-  opcode_table[0x39] = &cpu::AND<m_ABY>;
-  opcode_table[0x29] = &cpu::AND<m_IMM>;
-  opcode_table[0x3D] = &cpu::AND<m_ABX>;
-  opcode_table[0x2A] = &cpu::ROL<m_ACCUM>;
-  opcode_table[0x3E] = &cpu::ROL<m_ABX>;
-  opcode_table[0x2C] = &cpu::BIT<m_ABS>;
-  opcode_table[0x2D] = &cpu::AND<m_ABS>;
-  opcode_table[0x2E] = &cpu::ROL<m_ABS>;
-
-  opcode_table[0x40] = &cpu::RTI;
-  opcode_table[0x50] = &cpu::BVC;
-  opcode_table[0x41] = &cpu::EOR<m_INX>;
-  opcode_table[0x51] = &cpu::EOR<m_INY>;
-  opcode_table[0x45] = &cpu::EOR<m_ZPG>;
-  opcode_table[0x55] = &cpu::EOR<m_ZPG>;
-  opcode_table[0x46] = &cpu::LSR<m_ZPG>;
-  opcode_table[0x56] = &cpu::LSR<m_ZPG>;
-  opcode_table[0x48] = &cpu::PHA;
-  opcode_table[0x58] = &cpu::CLI;
-  opcode_table[0x49] = &cpu::EOR<m_IMM>;
-  opcode_table[0x59] = &cpu::EOR<m_ABY>;
-  opcode_table[0x4A] = &cpu::LSR<m_ACCUM>;
-  opcode_table[0x5D] = &cpu::EOR<m_ABX>;
-  opcode_table[0x4C] = &cpu::JMP_ABS;
-  opcode_table[0x5E] = &cpu::LSR<m_ABX>;
-  opcode_table[0x4D] = &cpu::EOR<m_ABS>;
-  opcode_table[0x4E] = &cpu::LSR<m_ABS>;
-
-  opcode_table[0x60] = &cpu::RTS;
-  opcode_table[0x70] = &cpu::BVS;
-  opcode_table[0x61] = &cpu::ADC<m_INX>;
-  opcode_table[0x71] = &cpu::ADC<m_INX>;
-  opcode_table[0x65] = &cpu::ADC<m_ZPG>;
-  opcode_table[0x75] = &cpu::ADC<m_ZPX>;
-  opcode_table[0x66] = &cpu::ROR<m_ZPG>;
-  opcode_table[0x76] = &cpu::ROR<m_ZPX>;
-  opcode_table[0x68] = &cpu::PLA;
-  opcode_table[0x78] = &cpu::SEI;
-  opcode_table[0x69] = &cpu::ADC<m_IMM>;
-  opcode_table[0x79] = &cpu::ADC<m_ABY>;
-  opcode_table[0x6A] = &cpu::ROR<m_ACCUM>;
-  opcode_table[0x7D] = &cpu::ADC<m_ABX>;
-  opcode_table[0x6C] = &cpu::JMP_IND;
-  opcode_table[0x7E] = &cpu::ROR<m_ABX>;
-  opcode_table[0x6D] = &cpu::ADC<m_ABS>;
-  opcode_table[0x6E] = &cpu::ROR<m_ABS>;
-
-  opcode_table[0x81] = &cpu::STA<m_INX>;
-  opcode_table[0x90] = &cpu::BCC;
-  opcode_table[0x84] = &cpu::STY<m_ZPG>;
-  opcode_table[0x91] = &cpu::STA<m_INY>;
-  opcode_table[0x85] = &cpu::STA<m_ZPG>;
-  opcode_table[0x94] = &cpu::STY<m_ZPG>;
-  opcode_table[0x86] = &cpu::STX<m_ZPG>;
-  opcode_table[0x95] = &cpu::STA<m_ZPG>;
-  opcode_table[0x88] = &cpu::DEY;
-  opcode_table[0x96] = &cpu::STX<m_ZPY>;
-  opcode_table[0x8A] = &cpu::TXA;
-  opcode_table[0x98] = &cpu::TYA;
-  opcode_table[0x8C] = &cpu::STY<m_ABS>;
-  opcode_table[0x99] = &cpu::STA<m_ABY>;
-  opcode_table[0x8D] = &cpu::STA<m_ABS>;
-  opcode_table[0x9A] = &cpu::TXS;
-  opcode_table[0x8E] = &cpu::STX<m_ABS>;
-  opcode_table[0x9D] = &cpu::STA<m_ABX>;
-
-  opcode_table[0xA0] = &cpu::LDY<m_IMM>;
-  opcode_table[0xB0] = &cpu::BCS;
-  opcode_table[0xA1] = &cpu::LDA<m_INX>;
-  opcode_table[0xB1] = &cpu::LDA<m_INY>;
-  opcode_table[0xA2] = &cpu::LDX<m_IMM>;
-  opcode_table[0xB4] = &cpu::LDY<m_ZPG>;
-  opcode_table[0xA4] = &cpu::LDY<m_ZPG>;
-  opcode_table[0xB5] = &cpu::LDA<m_ZPG>;
-  opcode_table[0xA5] = &cpu::LDA<m_ZPG>;
-  opcode_table[0xB6] = &cpu::LDX<m_ZPY>;
-  opcode_table[0xA6] = &cpu::LDX<m_ZPG>;
-  opcode_table[0xB8] = &cpu::CLV;
-  opcode_table[0xA8] = &cpu::TAY;
-  opcode_table[0xB9] = &cpu::LDA<m_ABY>;
-  opcode_table[0xA9] = &cpu::LDA<m_IMM>;
-  opcode_table[0xBA] = &cpu::TSX;
-  opcode_table[0xAA] = &cpu::TAX;
-  opcode_table[0xBC] = &cpu::LDY<m_ABX>;
-  opcode_table[0xAC] = &cpu::LDY<m_ABS>;
-  opcode_table[0xBD] = &cpu::LDA<m_ABX>;
-  opcode_table[0xAD] = &cpu::LDA<m_ABS>;
-  opcode_table[0xBE] = &cpu::LDX<m_ABY>;
-  opcode_table[0xAE] = &cpu::LDX<m_ABS>;
-
-  opcode_table[0xC0] = &cpu::CPY<m_IMM>;
-  opcode_table[0xD0] = &cpu::BNE;
-  opcode_table[0xC1] = &cpu::CMP<m_INX>;
-  opcode_table[0xD1] = &cpu::CMP<m_INY>;
-  opcode_table[0xC4] = &cpu::CPY<m_ZPG>;
-  opcode_table[0xD5] = &cpu::CMP<m_ZPG>;
-  opcode_table[0xC5] = &cpu::CMP<m_ZPG>;
-  opcode_table[0xD6] = &cpu::DEC<m_ZPG>;
-  opcode_table[0xC6] = &cpu::DEC<m_ZPG>;
-  opcode_table[0xD8] = &cpu::CLD;
-  opcode_table[0xC8] = &cpu::INY;
-  opcode_table[0xD9] = &cpu::CMP<m_ABY>;
-  opcode_table[0xC9] = &cpu::CMP<m_IMM>;
-  opcode_table[0xDD] = &cpu::CMP<m_ABX>;
-  opcode_table[0xCA] = &cpu::DEX;
-  opcode_table[0xDE] = &cpu::DEC<m_ABX>;
-  opcode_table[0xCC] = &cpu::CPY<m_ABS>;
-  opcode_table[0xCD] = &cpu::CMP<m_ABS>;
-  opcode_table[0xCE] = &cpu::DEC<m_ABS>;
-
-  opcode_table[0xE0] = &cpu::CPX<m_IMM>;
-  opcode_table[0xF0] = &cpu::BEQ;
-  opcode_table[0xE1] = &cpu::SBC<m_INX>;
-  opcode_table[0xF1] = &cpu::SBC<m_INY>;
-  opcode_table[0xE4] = &cpu::CPX<m_ZPG>;
-  opcode_table[0xF5] = &cpu::SBC<m_ZPG>;
-  opcode_table[0xE5] = &cpu::SBC<m_ZPG>;
-  opcode_table[0xF6] = &cpu::INC<m_ZPG>;
-  opcode_table[0xE6] = &cpu::INC<m_ZPG>;
-  opcode_table[0xF8] = &cpu::SED;
-  opcode_table[0xE8] = &cpu::INX;
-  opcode_table[0xF9] = &cpu::SBC<m_ABY>;
-  opcode_table[0xE9] = &cpu::SBC<m_IMM>;
-  opcode_table[0xFD] = &cpu::SBC<m_ABX>;
-  opcode_table[0xEA] = &cpu::NOP;
-  opcode_table[0xFE] = &cpu::INC<m_ABX>;
-  opcode_table[0xEC] = &cpu::CPX<m_ABS>;
-  opcode_table[0xED] = &cpu::SBC<m_ABS>;
-  opcode_table[0xEE] = &cpu::INC<m_ABS>;
+  regs.set_status(0);
+  regs.A = 0;
+  regs.X = 0;
+  regs.Y = 0;
+  regs.SP = 0;
+  regs.PC = 0;
+}
+
+// ------------------- Execution ----------------------------- //
+void cpu::insert_cartridge(cartridge &cart) {
+  // The mapper points the pages into the cartridge, so nothing is copied, and
+  // gets the IRQ line for its counters.
+  cart.attach(mem, lines);
+#ifdef NESCPP_PROFILE
+  profiler.set_prg(cart.prg_data(), cart.prg_size());
+#endif
+}
+
+void cpu::reset() {
+  // Power up state. http://wiki.nesdev.com/w/index.php/CPU_power_up_state
+  regs.set_status(0x34);
+  regs.SP = 0xFD;
+  regs.PC = combine_bytes(mem[0xFFFC], mem[0xFFFD]);
+  total_cycles += 7;  // The reset sequence takes as long as BRK.
+  left_loop();
+}
+
+u16 cpu::step() {
+  if (lines.pending()) {
+    u16 cycles = poll_interrupts(regs);
+    total_cycles += cycles;
+    if (cycles) {
+      profile_interrupt(cycles);
+      return cycles;
+    }
+  }
+
+  const u16 pc = regs.PC;
+  if (tracer) trace(regs);
+  u8 opcode = mem[regs.PC++];
+  const opcode_info &info = opcode_infos[opcode];
+  fetch_operand(regs, mode_length(info.mode));
+  cycle_count = info.cycles;  // Handlers add the branch penalty cycles.
+  (this->*opcode_table[opcode])(regs);
+  if (info.page_penalty) cycle_count += page_crossed;
+  profile(pc, opcode);
+
+  total_cycles += cycle_count;
+  total_instructions++;
+  return cycle_count;
+}
+
+u64 cpu::run_for_cycles(u64 budget) {
+  // The last instruction may overshoot the budget by a few cycles. Callers
+  // working against a fixed deadline should budget from get_cycles().
+  const u64 start = total_cycles;
+  const u64 end = start + budget;
+  lines.yield = false;  // Left over from a run that ended anyway.
+  run_end = end;
+  if (engine == cpu_engine::switch_case)
+    run_switch(end);
+  else if (engine == cpu_engine::decoded)
+    run_decoded(end);
+  else
+    run_table(end);
+  run_end = 0;
+  total_instructions += idle_instructions;
+  idle_instructions = 0;
+  return total_cycles - start;
+}
+
+u64 cpu::run_table(u64 end) {
+  while (total_cycles < end && !lines.yield) step();
+  return total_cycles;
+}
+
+void cpu::trace(cpu_registers &r) {
+  if (!tracer->wants(r.PC, total_cycles)) return;
+
+  // The bytes are only read from pages mapped directly, as reading a device
+  // has side effects.
+  trace_record entry = {};
+  entry.cycle = total_cycles;
+  entry.pc = r.PC;
+  entry.length = 1;
+  for (u8 ii = 0; ii < entry.length; ii++) {
+    u16 address = r.PC + ii;
+    const u8 *page = mem.get_read_page(address >> 8);
+    if (!page) break;
+    entry.bytes[ii] = page[address & 0xFF];
+    if (ii == 0) entry.length = mode_length(opcode_infos[entry.bytes[0]].mode);
+  }
+  entry.a = r.A;
+  entry.x = r.X;
+  entry.y = r.Y;
+  entry.p = r.status();
+  entry.sp = r.SP;
+  tracer->record(entry);
+}
+
+// ------------------- Idle loops --------------------------- //
+// Games wait for vblank or an interrupt in loops such as
+//   wait: BIT $2002
+//         BPL wait
+// which run the same iteration over and over, until a device changes what they
+// read. Such a loop is skipped whole iterations at a time, up to the first
+// cycle at which a read could give something else, or the end of the run, and
+// everything ends up exactly as if it had run.
+//
+// The body must run straight from head to the branch back at tail, branching
+// out maybe but never within, and only read: memory, and device registers
+// that say how long they stay the same (see mem_handler::stable_until). The
+// first iteration's reads may have side effects, such as clearing the vblank
+// flag, but the iterations after it read the same again, and change nothing.
+// So once the second whole iteration in a row ends with the registers it
+// started with, and none of the devices it read changed meanwhile, all of the
+// following iterations are the same, until one does.
+void cpu::idle_loop(cpu_registers &r, u16 head, u16 tail) {
+  if (!idle_skip || tracer || profiling) return;
+  if (!loop.arrivals || head != loop.head || tail != loop.tail) {
+    loop.head = head;
+    loop.tail = tail;
+    loop.arrivals = 0;
+    loop.checked = false;
+  }
+
+  // The branch lands on head when it ends.
+  const u64 now = total_cycles + cycle_count;
+  const u64 length = now - loop.cycle, stable = loop.stable;
+  u8 p = r.status();
+  bool same = r.A == loop.a && r.X == loop.x && r.Y == loop.y && p == loop.p && r.SP == loop.sp;
+  loop.a = r.A;
+  loop.x = r.X;
+  loop.y = r.Y;
+  loop.p = p;
+  loop.sp = r.SP;
+  loop.cycle = now;
+  if (loop.arrivals < 3) loop.arrivals++;
+  if (loop.arrivals < 2) return;  // The first iteration may have started halfway.
+
+  if (!loop.checked) {
+    loop.idle = check_idle_body();
+    loop.checked = true;
+  }
+  if (!loop.idle) return;
+  loop.stable = ~u64(0);
+  for (u8 ii = 0; ii < loop.reads; ii++)
+    loop.stable = std::min(loop.stable, mem.stable_until(loop.read_addresses[ii]));
+  if (loop.arrivals < 3 || !same || loop.stable != stable) return;
+
+  // Whole iterations, which end by the limit, as the run would have. The
+  // cycles go through cycle_count, which is 16 bits.
+  u64 limit = std::min(loop.stable, run_end);
+  if (limit <= now) return;
+  u64 iterations = std::min(limit - now, u64(0xF000)) / length;
+  if (!iterations) return;
+  cycle_count += iterations * length;
+  loop.cycle += iterations * length;
+  idle_instructions += iterations * loop.instructions;
+  idle_stats.skips++;
+  idle_stats.cycles += iterations * length;
+  idle_stats.instructions += iterations * loop.instructions;
+}
+
+bool cpu::check_idle_body() {
+  // Short loops only, in memory that can be read without side effects.
+  if (loop.tail - loop.head > 32) return false;
+  loop.instructions = 0;
+  loop.reads = 0;
+  for (u16 pc = loop.head;; loop.instructions++) {
+    u8 bytes[3] = {};
+    const u8 *page = mem.get_read_page(pc >> 8);
+    if (!page) return false;
+    bytes[0] = page[pc & 0xFF];
+    const opcode_info &info = opcode_infos[bytes[0]];
+    u8 length = mode_length(info.mode);
+    for (u8 ii = 1; ii < length; ii++) {
+      u16 address = pc + ii;
+      if (!(page = mem.get_read_page(address >> 8))) return false;
+      bytes[ii] = page[address & 0xFF];
+    }
+    if (pc == loop.tail) {  // The branch or jump back.
+      loop.instructions++;
+      return true;
+    }
+    if (pc + length > loop.tail) return false;
+
+    u16 address = length == 2 ? bytes[1] : combine_bytes(bytes[1], bytes[2]);
+    switch (info.op) {
+      case o_LDA:
+      case o_LDX:
+      case o_LDY:
+      case o_CMP:
+      case o_CPX:
+      case o_CPY:
+      case o_BIT:
+      case o_AND:
+      case o_ORA:
+      case o_EOR:
+      case o_ADC:
+      case o_SBC:
+        if (info.mode == m_IMM) break;
+        if (info.mode == m_ZPX || info.mode == m_ZPY) {
+          if (!mem.is_direct(0x00)) return false;
+        } else if (info.mode == m_ABX || info.mode == m_ABY) {
+          if (!mem.is_direct(address >> 8) || !mem.is_direct(u16(address + 0xFF) >> 8))
+            return false;
+        } else if (info.mode == m_ZPG || info.mode == m_ABS) {
+          if (mem.is_direct(address >> 8)) break;
+          if (loop.reads == sizeof(loop.read_addresses) / sizeof(loop.read_addresses[0]))
+            return false;
+          loop.read_addresses[loop.reads++] = address;
+        } else {
+          return false;  // Indirect, through memory.
+        }
+        break;
+      case o_ASL:
+      case o_LSR:
+      case o_ROL:
+      case o_ROR:
+        if (info.mode != m_ACCUM) return false;
+        break;
+      case o_BCC:
+      case o_BCS:
+      case o_BEQ:
+      case o_BMI:
+      case o_BNE:
+      case o_BPL:
+      case o_BVC:
+      case o_BVS: {
+        u16 target = pc + 2 + i8(bytes[1]);
+        if (loop.head <= target && target <= loop.tail) return false;
+        break;
+      }
+      case o_CLC:
+      case o_CLD:
+      case o_CLI:
+      case o_CLV:
+      case o_SEC:
+      case o_SED:
+      case o_SEI:
+      case o_DEX:
+      case o_DEY:
+      case o_INX:
+      case o_INY:
+      case o_TAX:
+      case o_TAY:
+      case o_TSX:
+      case o_TXA:
+      case o_TXS:
+      case o_TYA:
+      case o_NOP:
+      case o_XXX:  // Runs as a NOP.
+        break;
+      default:
+        return false;  // Writes, the stack, and the rest of the control flow.
+    }
+    pc += length;
+  }
+}
+
+bool cpu::print_profile(std::FILE *out, std::size_t top) {
+#ifdef NESCPP_PROFILE
+  profiler.report(out, top, mem);
+  return true;
+#else
+  (void)out;
+  (void)top;
+  return false;
+#endif
+}
+
+u64 cpu::state_hash() {
+  u8 state[7] = {regs.A, regs.X, regs.Y, regs.status(),
+                 regs.SP, get_low_byte(regs.PC), get_high_byte(regs.PC)};
+  u64 hash = fnv1a(state, sizeof(state));
+
+  // Internal RAM, without its mirrors, and PRG RAM. Pages behind a handler are
+  // skipped, as reading them can have side effects.
+  u8 data[256];
+  for (u16 page = 0x00; page < 0x80; page++) {
+    if (page == 0x08) page = 0x60;
+    if (!mem.is_direct(page)) continue;
+    for (u16 ii = 0; ii < 256; ii++) data[ii] = mem[(page << 8) | ii];
+    hash = fnv1a(data, sizeof(data), hash);
+  }
+  return hash;
+}
+
+// ------------------- Save states ------------------------- //
+void cpu::save_state(state_buffer &state) {
+  state.put(regs.A);
+  state.put(regs.X);
+  state.put(regs.Y);
+  state.put(regs.status());
+  state.put(regs.SP);
+  state.put(regs.PC);
+  state.put(total_cycles);
+  state.put(total_instructions);
+  state.put(lines.irq);
+  state.put(u8(lines.nmi));
+  mem.save_state(state);
+}
+
+void cpu::load_state(state_buffer &state) {
+  regs.A = state.get<u8>();
+  regs.X = state.get<u8>();
+  regs.Y = state.get<u8>();
+  regs.set_status(state.get<u8>());
+  regs.SP = state.get<u8>();
+  regs.PC = state.get<u16>();
+  total_cycles = state.get<u64>();
+  total_instructions = state.get<u64>();
+  lines.irq = state.get<u8>();
+  lines.nmi = state.get<u8>();
+  mem.load_state(state);
+  left_loop();
+}
+
+// ------------------- Decoded instructions ----------------- //
+const cpu::decoded_op &cpu::decode(u16 pc) {
+  decode_misses++;
+
+  // The fetch happens here for real, so it reads the bytes just like the other
+  // engines.
+  cpu_registers r = regs;
+  r.PC = pc;
+  u8 opcode = mem[r.PC++];
+  u8 length = mode_length(opcode_infos[opcode].mode);
+  fetch_operand(r, length);
+
+  // Only code in a directly mapped page can be kept, and not if it straddles
+  // two pages, as the generation of one page doesn't cover the other. If the
+  // page is RAM, writing it will drop its instructions.
+  u8 page = pc >> 8;
+  bool cacheable = mem.is_direct(page) && u8((pc + length - 1) >> 8) == page;
+  decoded_op &op = cacheable ? decode_cache[pc] : uncached_op;
+  op = {cacheable ? mem.get_generation(page) : 0, r.operand, opcode, length};
+  if (cacheable) mem.watch_writes(page);
+  return op;
+}
+
+u64 cpu::run_frame() {
+  // Frame boundaries are multiples of cycles_per_frame, so overshoot from the
+  // previous frame doesn't accumulate.
+  u64 next_frame = (total_cycles / cycles_per_frame + 1) * cycles_per_frame;
+  return run_for_cycles(next_frame - total_cycles);
 }
@@ -2,90 +2,91 @@
 #include "cpu.hpp"
 
 // Compare and jump operations.
-void cpu::BCC() {  // Branch on Carry Clear
-  if (this->P.C.get() == 0) do_jump(this->mem[this->PC++]);
+void cpu::BCC(cpu_registers &r) {  // Branch on Carry Clear
+  branch(r, !r.carry());
 }
 
-void cpu::BCS() {  // Branch on Carry Set
-  if (this->P.C.get() == 1) do_jump(this->mem[this->PC++]);
+void cpu::BCS(cpu_registers &r) {  // Branch on Carry Set
+  branch(r, r.carry());
 }
 
-void cpu::BEQ() {  // Branch on Result Zero
-  if (this->P.Z.get() == 1) do_jump(this->mem[this->PC++]);
+void cpu::BEQ(cpu_registers &r) {  // Branch on Result Zero
+  branch(r, r.zero());
 }
 
-void cpu::BMI() {  // Branch on result minus
-  if (this->P.S.get() == 1) do_jump(this->mem[this->PC++]);
+void cpu::BMI(cpu_registers &r) {  // Branch on result minus
+  branch(r, r.sign());
 }
 
-void cpu::BNE() {  // Branch on result not zero
-  if (this->P.Z.get() == 0) do_jump(this->mem[this->PC++]);
+void cpu::BNE(cpu_registers &r) {  // Branch on result not zero
+  branch(r, !r.zero());
 }
 
-void cpu::BPL() {  // Branch on result plus
-  if (this->P.S.get() == 0) do_jump(this->mem[this->PC++]);
+void cpu::BPL(cpu_registers &r) {  // Branch on result plus
+  branch(r, !r.sign());
 }
 
-void cpu::BRK() {  // Force break.
+void cpu::BRK(cpu_registers &r) {  // Force break.
   // Reference here.
   // http://nesdev.com/the%20%27B%27%20flag%20&%20BRK%20instruction.txt
 
-  this->P.B.set();                            // Break flag is set.
-  this->PC++;                                 // Increment the program counter.
-  this->push_stack(get_high_byte(this->PC));  // Push the high byte on stack.
-  this->push_stack(get_low_byte(this->PC));   // Push the low byte on stack.
-  this->push_stack(this->P.byte);             // Push the status flags.
+  // The B flag only exists in the pushed copy of the status register.
+  r.PC++;                                    // Increment the program counter.
+  this->push_stack(r, get_high_byte(r.PC));  // Push the high byte on stack.
+  this->push_stack(r, get_low_byte(r.PC));   // Push the low byte on stack.
+  this->push_stack(r, r.status() | 0x30);    // Push the status flags, with B set.
+  r.P.I.set();                               // Disable further interrupts.
+  left_loop();
 
   // And then, set PC to the value found in 0xFFFE and 0xFFFF.
-  this->PC = combine_bytes(this->mem[0xFFFE], this->mem[0xFFFF]);
+  r.PC = combine_bytes(this->mem[0xFFFE], this->mem[0xFFFF]);
 }
 
-void cpu::BVC() {  // Branch on overflow clear.
-  if (this->P.V.get() == 0) do_jump(this->mem[this->PC++]);
+void cpu::BVC(cpu_registers &r) {  // Branch on overflow clear.
+  branch(r, !r.overflow());
 }
 
-void cpu::BVS() {  // Branch on overflow set
-  if (this->P.V.get() == 1) do_jump(this->mem[this->PC++]);
+void cpu::BVS(cpu_registers &r) {  // Branch on overflow set
+  branch(r, r.overflow());
 }
 
-void cpu::CLC() {  // Clear carry flag
-  this->P.C.clear();
+void cpu::CLC(cpu_registers &r) {  // Clear carry flag
+  r.set_carry(false);
 }
 
-void cpu::CLD() {  // Clear decimal mode.
-  this->P.D.clear();
+void cpu::CLD(cpu_registers &r) {  // Clear decimal mode.
+  r.P.D.clear();
 }
 
-void cpu::CLI() {  // Clear interrupt disable bit
-  this->P.I.clear();
+void cpu::CLI(cpu_registers &r) {  // Clear interrupt disable bit
+  r.P.I.clear();
 }
 
-void cpu::CLV() {  // Clear overflow flag
-  this->P.V.clear();
+void cpu::CLV(cpu_registers &r) {  // Clear overflow flag
+  r.set_overflow(false);
 }
 
-void cpu::DEX() {  // Decrement X. Carry ignored.
-  set_flags(--this->X);
+void cpu::DEX(cpu_registers &r) {  // Decrement X. Carry ignored.
+  set_flags(r, --r.X);
 }
 
-void cpu::DEY() {  // Decrement Y. Carry ignored.
-  set_flags(--this->Y);
+void cpu::DEY(cpu_registers &r) {  // Decrement Y. Carry ignored.
+  set_flags(r, --r.Y);
 }
 
-void cpu::INX() {  // Increment X.
-  set_flags(++this->X);
+void cpu::INX(cpu_registers &r) {  // Increment X.
+  set_flags(r, ++r.X);
 }
 
-void cpu::INY() {  // Increment Y
-  set_flags(++this->Y);
+void cpu::INY(cpu_registers &r) {  // Increment Y
+  set_flags(r, ++r.Y);
 }
 
-void cpu::JMP_IND() {  // Indirect jump
-  // Read the two bytes. Go the the this memory location, and read the next two
-  // bytes. This gives an address. Return this value.
-  u8 low_byte = this->mem[this->PC++];
-  u8 high_byte = this->mem[this->PC++];
-  u16 address = combine_bytes(low_byte, high_byte);
+void cpu::JMP_IND(cpu_registers &r) {  // Indirect jump
+  // Go the the memory location in the operand, and read the next two bytes.
+  // This gives an address. Return this value.
+  u16 address = r.operand;
+  u8 low_byte, high_byte;
 
   // BUG in 6502 used in NES. If address is at page boundary (xxFF) , then the
   // high byte is read from (xx00) instead of ((xx+1)00).
@@ -95,101 +96,219 @@ void cpu::JMP_IND() {  // Indirect jump
   high_byte = this->mem[hb_address];
   address = combine_bytes(low_byte, high_byte);
 
-  this->PC = address;  // And jump.
+  r.PC = address;  // And jump.
+  left_loop();
 }
 
-void cpu::JMP_ABS() {  // Direct jump to given address.
-  u8 low_byte = this->mem[this->PC++];
-  u8 high_byte = this->mem[this->PC++];
-  u16 address = combine_bytes(low_byte, high_byte);
-  this->PC = address;
+void cpu::JMP_ABS(cpu_registers &r) {  // Direct jump to given address.
+  u16 tail = r.PC - 3;
+  r.PC = r.operand;
+  jumped(r, tail);
 }
 
-void cpu::JSR() {  // Jump to absolute address, Saving Return Address
-  u8 low_byte = this->mem[this->PC++];
-  u8 high_byte = this->mem[this->PC++];
-  u16 address = combine_bytes(low_byte, high_byte);
+void cpu::JSR(cpu_registers &r) {  // Jump to absolute address, Saving Return Address
+  u16 address = r.operand;
   // JSR Bug. At this point, PC is at the next opcode. However, JSR pushes PC-1
   // as the return address.
-  this->push_stack(get_high_byte(this->PC - 1));
-  this->push_stack(get_low_byte(this->PC - 1));
-  this->PC = address;
+  this->push_stack(r, get_high_byte(r.PC - 1));
+  this->push_stack(r, get_low_byte(r.PC - 1));
+  r.PC = address;
+  left_loop();
 }
 
-void cpu::NOP() {  // No operation.
+void cpu::NOP(cpu_registers &) {  // No operation.
 }
 
-void cpu::PHA() {  // Push accumulator to stack.
-  this->push_stack(this->A);
+void cpu::PHA(cpu_registers &r) {  // Push accumulator to stack.
+  this->push_stack(r, r.A);
 }
 
-void cpu::PHP() {  // Push processor status to stack.
-  this->push_stack(this->P.byte);
+void cpu::PHP(cpu_registers &r) {  // Push processor status to stack, with B flag set.
+  this->push_stack(r, r.status() | 0x30);
 }
 
-void cpu::PLA() {  // Pop stack and store in accumulator.
-  this->A = this->pop_stack();
-  set_flags(this->A);
+void cpu::PLA(cpu_registers &r) {  // Pop stack and store in accumulator.
+  r.A = this->pop_stack(r);
+  set_flags(r, r.A);
 }
 
-void cpu::PLP() {  // Pop stack and store in process status.
-  this->P.byte = this->pop_stack();
+void cpu::PLP(cpu_registers &r) {  // Pop stack and store in process status. B is ignored.
+  r.set_status((this->pop_stack(r) & 0xCF) | 0x20);
 }
 
-void cpu::RTI() {  // Return from interrupt
+void cpu::RTI(cpu_registers &r) {  // Return from interrupt
   // An interrupt pushed PC into the stack, high byte followed by low byte. Then
   // it pushed status register. Now, pop back ... so reverse order.
-  this->P.byte = this->pop_stack();
-  u8 low_byte = this->pop_stack();
-  u8 high_byte = this->pop_stack();
-  this->PC = combine_bytes(low_byte, high_byte);
+  r.set_status((this->pop_stack(r) & 0xCF) | 0x20);
+  u8 low_byte = this->pop_stack(r);
+  u8 high_byte = this->pop_stack(r);
+  r.PC = combine_bytes(low_byte, high_byte);
+  left_loop();
 }
 
-void cpu::RTS() {  // Return from subroutine.
+void cpu::RTS(cpu_registers &r) {  // Return from subroutine.
   // An JSR pushed (PC-1) into the stack, high byte followed by low byte.
   // Now, pop back ... so reverse order.
-  u8 low_byte = this->pop_stack();
-  u8 high_byte = this->pop_stack();
-  this->PC = combine_bytes(low_byte, high_byte) + 1;
+  u8 low_byte = this->pop_stack(r);
+  u8 high_byte = this->pop_stack(r);
+  r.PC = combine_bytes(low_byte, high_byte) + 1;
+  left_loop();
+}
+
+void cpu::SEC(cpu_registers &r) {  // Set carry flag.
+  r.set_carry(true);
 }
 
-void cpu::SEC() {  // Set carry flag.
-  this->P.C.set();
-}
-
-void cpu::SED() {  // Set decimal flag. Not that it does anything.
-  this->P.D.set();
-}
-
-void cpu::SEI() {  // Srt interrupt disable status.
-  this->P.I.set();
-}
-
-void cpu::TAX() {  // Transfer accumulator to X
-  this->X = this->A;
-  set_flags(this->X);
-}
-
-void cpu::TAY() {  // Transfer accumulator to Y
-  this->Y = this->A;
-  set_flags(this->Y);
-}
-
-void cpu::TSX() {  // Transfer Stack Pointer to Index X.
-  this->X = this->SP;
-  set_flags(this->X);
-}
-
-void cpu::TXA() {  // Transfer Index X to Accumulator
-  this->A = this->X;
-  set_flags(this->A);
-}
-
-void cpu::TXS() {  // Transfer Index X to Stack Pointer
-  this->SP = this->X;
-}
-
-void cpu::TYA() {  // Transfer Index Y to Accumulator
-  this->A = this->Y;
-  set_flags(this->A);
-}
+void cpu::SED(cpu_registers &r) {  // Set decimal flag. Not that it does anything.
+  r.P.D.set();
+}
+
+void cpu::SEI(cpu_registers &r) {  // Srt interrupt disable status.
+  r.P.I.set();
+}
+
+void cpu::TAX(cpu_registers &r) {  // Transfer accumulator to X
+  r.X = r.A;
+  set_flags(r, r.X);
+}
+
+void cpu::TAY(cpu_registers &r) {  // Transfer accumulator to Y
+  r.Y = r.A;
+  set_flags(r, r.Y);
+}
+
+void cpu::TSX(cpu_registers &r) {  // Transfer Stack Pointer to Index X.
+  r.X = r.SP;
+  set_flags(r, r.X);
+}
+
+void cpu::TXA(cpu_registers &r) {  // Transfer Index X to Accumulator
+  r.A = r.X;
+  set_flags(r, r.A);
+}
+
+void cpu::TXS(cpu_registers &r) {  // Transfer Index X to Stack Pointer
+  r.SP = r.X;
+}
+
+void cpu::TYA(cpu_registers &r) {  // Transfer Index Y to Accumulator
+  r.A = r.Y;
+  set_flags(r, r.A);
+}
+
+// ------------------- Switch engines ------------------------ //
+// One case per opcode, generated from opcode_infos. Each engine defines
+// OPCODE_CASE(code) for its own case body. See cpu::execute.
+#define OPCODE_CASE_4(code) \
+  OPCODE_CASE(code) OPCODE_CASE(code + 1) OPCODE_CASE(code + 2) OPCODE_CASE(code + 3)
+#define OPCODE_CASE_16(code) \
+  OPCODE_CASE_4(code) OPCODE_CASE_4(code + 4) OPCODE_CASE_4(code + 8) OPCODE_CASE_4(code + 12)
+#define OPCODE_CASE_64(code)                                               \
+  OPCODE_CASE_16(code) OPCODE_CASE_16(code + 16) OPCODE_CASE_16(code + 32) \
+  OPCODE_CASE_16(code + 48)
+#define OPCODE_CASES   \
+  OPCODE_CASE_64(0x00) \
+  OPCODE_CASE_64(0x40) \
+  OPCODE_CASE_64(0x80) \
+  OPCODE_CASE_64(0xC0)
+
+FLATTEN u64 cpu::run_switch(u64 end) {
+  // The registers and counters are copied to locals for the whole run, and
+  // every handler is called directly, so the compiler can inline all of them
+  // into this function and keep the registers in machine registers. The
+  // results must match run_table instruction for instruction.
+  cpu_registers r = regs;
+  u64 cycles = total_cycles;
+  u64 instructions = total_instructions;
+
+  while (cycles < end) {
+    if (lines.pending()) {  // Same as step: an interrupt takes a whole iteration.
+      if (lines.yield) break;
+      u8 taken = poll_interrupts(r);
+      cycles += taken;
+      if (taken) {
+        profile_interrupt(taken);
+        continue;
+      }
+    }
+    // Handlers timestamp their accesses with it. A store is all it costs.
+    total_cycles = cycles;
+    const u16 pc = r.PC;
+    if (tracer) trace(r);
+    u8 opcode = mem[r.PC++];
+
+    switch (opcode) {
+#define OPCODE_CASE(code)                                   \
+  case code:                                                \
+    fetch_operand(r, mode_length(opcode_infos[code].mode)); \
+    execute<code>(r);                                       \
+    break;
+      OPCODE_CASES
+#undef OPCODE_CASE
+    }
+    profile(pc, opcode);
+
+    cycles += cycle_count;
+    instructions++;
+  }
+
+  regs = r;
+  total_cycles = cycles;
+  total_instructions = instructions;
+  return cycles;
+}
+
+FLATTEN u64 cpu::run_decoded(u64 end) {
+  // run_switch, except that the opcode and operand come from decode_cache
+  // instead of being fetched from memory. Code is decoded once per page
+  // generation, so a tight loop in ROM never touches the memory map to fetch.
+  if (decode_cache.empty()) decode_cache.resize(64 * 1024);  // Generation 0 is never valid.
+
+  cpu_registers r = regs;
+  u64 cycles = total_cycles;
+  u64 instructions = total_instructions;
+  const u64 start_misses = decode_misses;
+
+  while (cycles < end) {
+    if (lines.pending()) {
+      if (lines.yield) break;
+      u8 taken = poll_interrupts(r);
+      cycles += taken;
+      if (taken) {
+        profile_interrupt(taken);
+        continue;
+      }
+    }
+    total_cycles = cycles;
+    const u16 pc = r.PC;
+    if (tracer) trace(r);
+    const decoded_op &op = lookup(pc);
+    r.operand = op.operand;
+    r.PC += op.length;
+
+    switch (op.opcode) {
+#define OPCODE_CASE(code) \
+  case code:              \
+    execute<code>(r);     \
+    break;
+      OPCODE_CASES
+#undef OPCODE_CASE
+    }
+    profile(pc, op.opcode);
+
+    cycles += cycle_count;
+    instructions++;
+  }
+
+  // Every instruction is a lookup, and those that didn't miss hit.
+  decode_hits += (instructions - total_instructions) - (decode_misses - start_misses);
+  regs = r;
+  total_cycles = cycles;
+  total_instructions = instructions;
+  return cycles;
+}
+
+#undef OPCODE_CASES
+#undef OPCODE_CASE_64
+#undef OPCODE_CASE_16
+#undef OPCODE_CASE_4
@@ -0,0 +1,54 @@
+#include "disassembler.hpp"
+
+#include <cstdio>
+
+std::string disassemble(u16 pc, const u8 *bytes) {
+  const opcode_info &info = opcode_infos[bytes[0]];
+  const char *name = mnemonic_names[info.op];
+  u8 low_byte = bytes[1];
+  u16 word = combine_bytes(bytes[1], bytes[2]);
+  char text[32];
+
+  switch (info.mode) {
+    case m_IMM:
+      std::snprintf(text, sizeof(text), "%s #$%02X", name, low_byte);
+      break;
+    case m_ZPG:
+      std::snprintf(text, sizeof(text), "%s $%02X", name, low_byte);
+      break;
+    case m_ZPX:
+      std::snprintf(text, sizeof(text), "%s $%02X,X", name, low_byte);
+      break;
+    case m_ZPY:
+      std::snprintf(text, sizeof(text), "%s $%02X,Y", name, low_byte);
+      break;
+    case m_ABS:
+      std::snprintf(text, sizeof(text), "%s $%04X", name, word);
+      break;
+    case m_ABX:
+      std::snprintf(text, sizeof(text), "%s $%04X,X", name, word);
+      break;
+    case m_ABY:
+      std::snprintf(text, sizeof(text), "%s $%04X,Y", name, word);
+      break;
+    case m_INX:
+      std::snprintf(text, sizeof(text), "%s ($%02X,X)", name, low_byte);
+      break;
+    case m_INY:
+      std::snprintf(text, sizeof(text), "%s ($%02X),Y", name, low_byte);
+      break;
+    case m_IND:
+      std::snprintf(text, sizeof(text), "%s ($%04X)", name, word);
+      break;
+    case m_ACCUM:
+      std::snprintf(text, sizeof(text), "%s A", name);
+      break;
+    case m_REL:  // The offset is relative to the next instruction.
+      std::snprintf(text, sizeof(text), "%s $%04X", name, u16(pc + 2 + i8(low_byte)));
+      break;
+    default:  // Implied.
+      std::snprintf(text, sizeof(text), "%s", name);
+      break;
+  }
+  return text;
+}
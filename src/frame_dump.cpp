@@ -0,0 +1,189 @@
+#include "frame_dump.hpp"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include "compose.hpp"
+
+const char *dump_format_name(dump_format format) {
+  switch (format) {
+    case dump_format::rgba:
+      return "rgba";
+    case dump_format::y4m:
+      return "y4m";
+    default:
+      return "indices";
+  }
+}
+
+frame_dump::frame_dump(dump_format _format, u64 _interval, bool _changed_only)
+    : format(_format),
+      interval(_interval ? _interval : 1),
+      changed_only(_changed_only),
+      fd(-1),
+      ring(slots, ring_policy::block),
+      frames_seen(0),
+      current(nullptr),
+      buffer(static_cast<u8 *>(std::aligned_alloc(alignment, buffer_size))),
+      used(0),
+      stats(),
+      failed(false) {
+  // BT.601 studio swing, from the RGB of each colour.
+  u8 indices[64], rgba[64 * 4];
+  for (int ii = 0; ii < 64; ii++) indices[ii] = ii;
+  to_rgba(indices, 64, rgba);
+  for (int ii = 0; ii < 64; ii++) {
+    double r = rgba[ii * 4], g = rgba[ii * 4 + 1], b = rgba[ii * 4 + 2];
+    yuv[ii][0] = u8(16.5 + (65.738 * r + 129.057 * g + 25.064 * b) / 256);
+    yuv[ii][1] = u8(128.5 + (-37.945 * r - 74.494 * g + 112.439 * b) / 256);
+    yuv[ii][2] = u8(128.5 + (112.439 * r - 94.154 * g - 18.285 * b) / 256);
+  }
+}
+
+frame_dump::~frame_dump() {
+  close();
+  std::free(buffer);
+}
+
+bool frame_dump::open(const std::string &file_name) {
+#ifdef SIGPIPE
+  // A reader that goes away, such as head, must make writes fail with EPIPE,
+  // which is reported, rather than kill the process.
+  std::signal(SIGPIPE, SIG_IGN);
+#endif
+  if (file_name == "-") {
+    // Keep standard output for the frames, and send the rest to standard error.
+    std::fflush(stdout);
+    fd = dup(STDOUT_FILENO);
+    if (fd >= 0) dup2(STDERR_FILENO, STDOUT_FILENO);
+  } else {
+    fd = ::open(file_name.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  }
+  if (fd < 0 || !buffer) {
+    error = std::strerror(errno);
+    return false;
+  }
+
+  if (format == dump_format::y4m) {
+    // 39375000 / 655171 is the NTSC frame rate, 60.0988, and pixels are 8:7.
+    const char *header = "YUV4MPEG2 W256 H240 F39375000:655171 Ip A8:7 C444\n";
+    append(reinterpret_cast<const u8 *>(header), std::strlen(header));
+  }
+  writer = std::thread([this] { run(); });
+  return true;
+}
+
+u8 *frame_dump::begin_frame() {
+  if (fd < 0 || frames_seen++ % interval != 0) return nullptr;
+  current = ring.begin_write();
+  return current->pixels;
+}
+
+void frame_dump::end_frame() {
+  if (!current) return;
+  ring.end_write();
+  current = nullptr;
+}
+
+bool frame_dump::close() {
+  if (fd < 0) return !failed;
+  ring.close();
+  if (writer.joinable()) writer.join();
+  flush();
+  if (::close(fd) != 0 && !failed) {
+    error = std::strerror(errno);
+    failed = true;
+  }
+  fd = -1;
+  return !failed;
+}
+
+frame_dump_stats frame_dump::get_stats() const {
+  frame_dump_stats result = stats;
+  result.waits = ring.get_overruns();
+  return result;
+}
+
+// ------------------- Writer thread ----------------------- //
+void frame_dump::run() {
+  const std::size_t size = sizeof(frame_slot::pixels);
+  while (frame_slot *slot = ring.wait_read()) {
+    if (changed_only) {
+      if (!last.empty() && std::memcmp(slot->pixels, last.data(), size) == 0) {
+        stats.unchanged++;
+        ring.end_read();
+        continue;
+      }
+      last.assign(slot->pixels, slot->pixels + size);
+    }
+
+    if (format == dump_format::indices) {
+      append(slot->pixels, size);
+      ring.end_read();
+    } else {
+      convert(slot->pixels);
+      ring.end_read();
+      append(converted.data(), converted.size());
+    }
+    stats.written++;
+  }
+}
+
+void frame_dump::convert(const u8 *pixels) {
+  const std::size_t size = sizeof(frame_slot::pixels);
+  if (format == dump_format::rgba) {
+    converted.resize(size * 4);
+    to_rgba(pixels, size, converted.data());
+    return;
+  }
+
+  // A frame header, then the planes one after the other.
+  static const char frame_header[] = "FRAME\n";
+  const std::size_t header = sizeof(frame_header) - 1;
+  converted.resize(header + size * 3);
+  std::memcpy(converted.data(), frame_header, header);
+  u8 *planes = converted.data() + header;
+  for (std::size_t ii = 0; ii < size; ii++) {
+    const u8 *colour = yuv[pixels[ii] & 0x3F];
+    planes[ii] = colour[0];
+    planes[size + ii] = colour[1];
+    planes[2 * size + ii] = colour[2];
+  }
+}
+
+void frame_dump::append(const u8 *data, std::size_t size) {
+  // Only whole buffers are written until the end, so writes stay large and
+  // aligned to the page size.
+  while (size) {
+    std::size_t chunk = std::min(size, buffer_size - used);
+    std::memcpy(buffer + used, data, chunk);
+    used += chunk;
+    data += chunk;
+    size -= chunk;
+    if (used == buffer_size) flush();
+  }
+}
+
+void frame_dump::flush() {
+  // After a failure, frames are still taken from the ring, so that the
+  // emulation never waits for a writer that has stopped.
+  for (std::size_t done = 0; done < used && !failed;) {
+    ssize_t count = ::write(fd, buffer + done, used - done);
+    if (count < 0 && errno == EINTR) continue;
+    if (count <= 0) {
+      error = std::strerror(errno);
+      failed = true;
+      break;
+    }
+    done += count;
+  }
+  if (!failed) stats.bytes += used;
+  used = 0;
+}
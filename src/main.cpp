@@ -1,17 +1,755 @@
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
 #include <iostream>
+#include <memory>
+#include <random>
+#include <thread>
+#include <vector>
 
+#include "batch.hpp"
 #include "cartridge.hpp"
+#include "compose.hpp"
+#include "console.hpp"
 #include "cpu.hpp"
+#include "disassembler.hpp"
+#include "frame_dump.hpp"
+#include "render_thread.hpp"
+#include "rewind.hpp"
+#include "run_ahead.hpp"
+#include "savestate.hpp"
+#include "spsc_ring.hpp"
+#include "trace.hpp"
+
+static void usage(const char *name) {
+  std::printf("Need a file name. %s [--engine table|switch|decoded] <filename> [frames]\n", name);
+  std::printf("Options: --savestate-check, to test and time save states after the run.\n");
+  std::printf("         --lockstep, to catch every device up before each instruction.\n");
+  std::printf("         --scheduler-check, to compare it with the scheduled timing after.\n");
+  std::printf("         --simd scalar|ssse3|avx2, to force a pixel path.\n");
+  std::printf("         --audio <file.wav>, to record the sound. It is muted otherwise.\n");
+  std::printf("         --pipeline drop|block, to emulate on a thread of its own, handing\n");
+  std::printf("         frames and sound to this one through rings, which drop or wait.\n");
+  std::printf("         --dump-frames <file|->, to write the frames out, as --dump-format\n");
+  std::printf("         indices|rgba|y4m (indices by default). --dump-every n writes every\n");
+  std::printf("         nth one, and --dump-changed only those that changed.\n");
+  std::printf("         --trace <file>, to record the instructions run, limited to a PC range\n");
+  std::printf("         with --trace-pc C000-C5FF, and to cycles with --trace-cycles 7-5000.\n");
+  std::printf("         --entry C000, to start there instead of at the reset vector.\n");
+  std::printf("         --input <file>, of lines \"frame buttons\", to press the buttons\n");
+  std::printf("         a+b+select+start+up+down+left+right (or none) from that frame.\n");
+  std::printf("         --run-ahead n, to show each frame as it will be n frames later.\n");
+  std::printf("         --no-idle-skip, to run idle loops instead of skipping them.\n");
+  std::printf("         --render-every n, to draw only every nth frame, and the last.\n");
+  std::printf("         --ppu-thread n, to draw the frames on a thread of their own, up to\n");
+  std::printf("         n behind. --ppu-thread-check compares them with the PPU's after.\n");
+  std::printf("         --rewind kb, to keep the frames in a history of that size, and\n");
+  std::printf("         check going back through it after the run.\n");
+  std::printf("Or %s --simd-check, to compare the pixel paths.\n", name);
+  std::printf("Or %s --trace-text <trace> [out.log], to convert a trace to nestest's format.\n",
+              name);
+  std::printf("Or a manifest. %s [--engine ...] [--threads n] [--output file] --batch <manifest>\n",
+              name);
+}
+
+// Builds with NESCPP_PROFILE print the profile at the end, and while running
+// when sent SIGUSR1. It is printed from the frame loop, not the handler.
+static const std::size_t profile_top = 20;  // Opcodes and addresses shown.
+static volatile std::sig_atomic_t profile_requested = 0;
+#if defined(NESCPP_PROFILE) && defined(SIGUSR1)
+static void request_profile(int) { profile_requested = 1; }
+#endif
+
+// Check that a save state round trip is deterministic: running on from a
+// restored state must end exactly where running on from the original did, also
+// when each frame is run from a state restored after running on, as run-ahead
+// does. Then time snapshots and restores.
+static bool check_savestate(console &machine) {
+  const u64 frames = 60;
+  state_buffer state, again;
+  std::string error;
+  std::vector<u64> hashes;
+
+  save_state(machine, state);
+  for (u64 ii = 0; ii < frames; ii++) {
+    machine.run_frame();
+    hashes.push_back(machine.state_hash());
+  }
+  u64 expected = machine.state_hash();
+  save_state(machine, again);
+
+  if (!load_state(machine, state, error)) {
+    std::printf("Save state restore failed: %s.\n", error.c_str());
+    return false;
+  }
+  for (u64 ii = 0; ii < frames; ii++) machine.run_frame();
+  u64 replayed = machine.state_hash();
+  state_buffer replayed_state;
+  save_state(machine, replayed_state);
+  bool same = replayed == expected && replayed_state.bytes() == again.bytes();
+  std::printf("Save state round trip over %llu frames: %s (%016llx, %016llx).\n",
+              (unsigned long long)frames, same ? "identical" : "MISMATCH",
+              (unsigned long long)expected, (unsigned long long)replayed);
+
+  // Whatever running on leaves behind that a restore misses is then seen by
+  // the first instruction of the frame.
+  load_state(machine, state, error);
+  u64 diverged = frames;
+  for (u64 ii = 0; ii < frames && diverged == frames; ii++) {
+    save_state(machine, again);
+    machine.run_frame();
+    load_state(machine, again, error);
+    machine.run_frame();
+    if (machine.state_hash() != hashes[ii]) diverged = ii;
+  }
+  std::printf("Save state restored every frame over %llu frames: %s", (unsigned long long)frames,
+              diverged == frames ? "identical.\n" : "MISMATCH");
+  if (diverged != frames) std::printf(" at frame %llu.\n", (unsigned long long)diverged);
+  same = same && diverged == frames;
+
+  const int rounds = 10000;
+  auto start = std::chrono::steady_clock::now();
+  for (int ii = 0; ii < rounds; ii++) save_state(machine, state);
+  auto middle = std::chrono::steady_clock::now();
+  for (int ii = 0; ii < rounds; ii++) load_state(machine, state, error);
+  auto stop = std::chrono::steady_clock::now();
+  std::printf("Save state: %zu bytes, snapshot %.2f us, restore %.2f us.\n", state.bytes().size(),
+              std::chrono::duration<double, std::micro>(middle - start).count() / rounds,
+              std::chrono::duration<double, std::micro>(stop - middle).count() / rounds);
+  return same;
+}
+
+// Check that the scheduled timing, with the devices caught up lazily, gives
+// exactly what lockstep does: the same state and samples after every frame.
+// Then time both.
+static bool check_scheduler(const std::string &file_name, u64 frames, cpu_engine engine) {
+  cartridge scheduled_cart(file_name), lockstep_cart(file_name);
+  scheduled_cart.check_rom();
+  lockstep_cart.check_rom();
+  console scheduled(scheduled_cart), lockstep(lockstep_cart);
+  lockstep.set_timing(console_timing::lockstep);
+  double seconds[2] = {};
+  for (console *machine : {&scheduled, &lockstep}) {
+    machine->get_cpu().set_engine(engine);
+    machine->get_apu().set_sample_rate(44100);
+    machine->reset();
+  }
+
+  bool same = true;
+  u64 frame = 0;
+  for (; frame < frames && same; frame++) {
+    int ii = 0;
+    for (console *machine : {&scheduled, &lockstep}) {
+      auto start = std::chrono::steady_clock::now();
+      machine->run_frame();
+      seconds[ii++] += std::chrono::duration<double>(std::chrono::steady_clock::now() - start)
+                           .count();
+    }
+    same = scheduled.state_hash() == lockstep.state_hash() &&
+           scheduled.get_apu().get_samples() == lockstep.get_apu().get_samples();
+  }
+  if (same)
+    std::printf("Scheduled and lockstep timing over %llu frames: identical (%016llx).\n",
+                (unsigned long long)frames, (unsigned long long)scheduled.state_hash());
+  else
+    std::printf("Scheduled and lockstep timing differ after frame %llu.\n",
+                (unsigned long long)frame);
+  std::printf("Scheduled: %.1f frames/s, lockstep: %.1f frames/s.\n", frame / seconds[0],
+              frame / seconds[1]);
+  return same;
+}
+
+// Write 16 bit mono samples as a WAV file.
+static bool write_wav(const std::string &file_name, const std::vector<i16> &samples, u32 rate) {
+  FILE *file = std::fopen(file_name.c_str(), "wb");
+  if (!file) return false;
+  state_buffer header;  // Little endian, like the format.
+  u32 data_size = samples.size() * 2;
+  header.put_bytes((const u8 *)"RIFF", 4);
+  header.put(u32(36 + data_size));
+  header.put_bytes((const u8 *)"WAVEfmt ", 8);
+  header.put(u32(16));
+  header.put(u16(1));  // PCM.
+  header.put(u16(1));  // Mono.
+  header.put(rate);
+  header.put(u32(rate * 2));
+  header.put(u16(2));
+  header.put(u16(16));
+  header.put_bytes((const u8 *)"data", 4);
+  header.put(data_size);
+  for (i16 sample : samples) header.put(u16(sample));
+  bool ok = std::fwrite(header.bytes().data(), 1, header.bytes().size(), file) ==
+            header.bytes().size();
+  return std::fclose(file) == 0 && ok;
+}
+
+// A frame as handed from the emulation thread, as NES colour indices.
+struct frame_slot {
+  u64 number;
+  u8 pixels[ppu::width * ppu::height];
+};
+
+// Run the frames on a thread of their own, which draws them and their samples
+// straight into ring slots. This thread takes them as they come, converting
+// each frame to RGBA as a display would, and appends the sound.
+static void run_pipelined(console &machine, u64 frames, ring_policy policy,
+                         std::vector<i16> &sound) {
+  const std::size_t depth = 3;
+  spsc_ring<frame_slot> pictures(depth, policy);
+  spsc_ring<std::vector<i16>> blocks(depth, policy);
+
+  std::thread emulation([&] {
+    for (u64 ii = 0; ii < frames; ii++) {
+      frame_slot *picture = pictures.begin_write();
+      std::vector<i16> *block = blocks.begin_write();
+      picture->number = machine.get_frames();
+      machine.get_ppu().set_frame_target(picture->pixels);
+      machine.get_apu().set_sample_target(block);
+      machine.run_frame();
+      pictures.end_write();
+      blocks.end_write();
+    }
+    // Keep the last frame, for the state hash.
+    machine.get_ppu().set_frame_target(nullptr);
+    machine.get_apu().set_sample_target(nullptr);
+    pictures.close();
+    blocks.close();
+  });
+
+  std::vector<u8> rgba(ppu::width * ppu::height * 4);
+  u64 shown = 0;
+  while (frame_slot *picture = pictures.wait_read()) {
+    to_rgba(picture->pixels, sizeof(picture->pixels), rgba.data());
+    pictures.end_read();
+    shown++;
+    while (std::vector<i16> *block = blocks.try_read()) {
+      sound.insert(sound.end(), block->begin(), block->end());
+      blocks.end_read();
+    }
+  }
+  while (std::vector<i16> *block = blocks.wait_read()) {
+    sound.insert(sound.end(), block->begin(), block->end());
+    blocks.end_read();
+  }
+  emulation.join();
+
+  std::printf("Pipeline: %llu frames shown. Frames %llu overruns, %llu underruns. Sound %llu "
+              "overruns, %llu underruns.\n",
+              (unsigned long long)shown, (unsigned long long)pictures.get_overruns(),
+              (unsigned long long)pictures.get_underruns(),
+              (unsigned long long)blocks.get_overruns(),
+              (unsigned long long)blocks.get_underruns());
+}
+
+// Check that every pixel path the CPU supports gives exactly the pixels of the
+// scalar one, on random lines. Layers are mostly transparent or opaque in runs,
+// like real ones, and the sprite 0 hit is placed on every x, 255 included.
+static bool check_simd() {
+  std::mt19937 random(12345);
+  const int lines = 20000;
+  u8 background[256], sprites[256], flags[256], palette[32];
+  u8 expected[256], got[256];
+  u8 expected_rgba[256 * 4], got_rgba[256 * 4];
+  bool same = true;
+
+  for (int line = 0; line < lines; line++) {
+    for (auto &entry : palette) entry = random() & 0x3F;
+    for (int x = 0; x < 256; x++) {
+      background[x] = (random() % 3) ? random() & 0x0F : 0;
+      sprites[x] = (random() % 4) ? 0 : 0x10 | (random() & 0x0F);
+      flags[x] = random() & (sprite_behind | sprite_zero);
+    }
+    // A lone sprite 0 pixel over the background, at an x that moves each line.
+    int x = line & 0xFF;
+    for (int ii = 0; ii < 256; ii++) flags[ii] &= ~sprite_zero;
+    background[x] = 1;
+    sprites[x] = 0x11;
+    flags[x] |= sprite_zero;
+    u8 colour_mask = (line & 1) ? 0x3F : 0x30;
+
+    bool expected_hit = compose_line(simd_path::scalar, background, sprites, flags, palette,
+                                     colour_mask, expected);
+    to_rgba(simd_path::scalar, expected, 256, expected_rgba);
+    for (simd_path path : {simd_path::ssse3, simd_path::avx2}) {
+      if (!simd_path_supported(path)) continue;
+      bool hit = compose_line(path, background, sprites, flags, palette, colour_mask, got);
+      to_rgba(path, got, 256, got_rgba);
+      if (hit != expected_hit || std::memcmp(got, expected, sizeof(got)) != 0 ||
+          std::memcmp(got_rgba, expected_rgba, sizeof(got_rgba)) != 0) {
+        if (same) std::printf("Pixel path %s differs on line %d.\n", simd_path_name(path), line);
+        same = false;
+      }
+    }
+  }
+
+  std::printf("Pixel paths over %d lines: %s.\n", lines, same ? "identical" : "MISMATCH");
+
+  // Time each path on the last line, composed then converted.
+  const int rounds = 100000;
+  for (simd_path path : {simd_path::scalar, simd_path::ssse3, simd_path::avx2}) {
+    if (!simd_path_supported(path)) continue;
+    auto start = std::chrono::steady_clock::now();
+    for (int ii = 0; ii < rounds; ii++) {
+      compose_line(path, background, sprites, flags, palette, 0x3F, got);
+      to_rgba(path, got, 256, got_rgba);
+    }
+    auto stop = std::chrono::steady_clock::now();
+    std::printf("%s: %.1f ns per line.\n", simd_path_name(path),
+                std::chrono::duration<double, std::nano>(stop - start).count() / rounds);
+  }
+  return same;
+}
+
+// The buttons held on the given frame.
+static u8 buttons_at(const std::vector<std::pair<u64, u8>> &input, u64 frame) {
+  u8 buttons = 0;
+  for (std::size_t ii = 0; ii < input.size() && input[ii].first <= frame; ii++)
+    buttons = input[ii].second;
+  return buttons;
+}
+
+// Go back through the whole history, then run the same frames again: they
+// must end where the run did.
+static bool check_rewind(console &machine, rewind_buffer &history,
+                         const std::vector<std::pair<u64, u8>> &input) {
+  rewind_stats stats = history.get_stats();
+  std::printf("Rewind: %llu frames held in %.1f KB, %.1f times smaller than whole states. "
+              "%.1f us a frame.\n",
+              (unsigned long long)stats.frames, stats.stored_bytes / 1024.0,
+              stats.stored_bytes ? double(stats.raw_bytes) / stats.stored_bytes : 0.0,
+              stats.pushed ? stats.push_ns / stats.pushed / 1e3 : 0.0);
+
+  u64 expected = machine.state_hash();
+  u64 frames = stats.frames - 1;
+  if (!history.rewind(machine, frames)) {
+    std::printf("Rewind failed: %s.\n", history.get_error().c_str());
+    return false;
+  }
+  stats = history.get_stats();
+  for (u64 ii = 0; ii < frames; ii++) {
+    machine.set_buttons(0, buttons_at(input, machine.get_frames()));
+    machine.run_frame();
+  }
+  u64 replayed = machine.state_hash();
+  bool same = replayed == expected;
+  std::printf("Went back %llu frames in %.2f ms and ran them again: %s (%016llx, %016llx).\n",
+              (unsigned long long)frames, stats.rewind_ns / 1e6, same ? "identical" : "MISMATCH",
+              (unsigned long long)expected, (unsigned long long)replayed);
+  return same;
+}
+
+// Check that drawing on a thread of its own gives exactly the pictures the
+// PPU draws itself, frame after frame.
+static bool check_render_thread(const std::string &file_name, u64 frames, cpu_engine engine,
+                                const std::vector<std::pair<u64, u8>> &input) {
+  cartridge plain_cart(file_name), threaded_cart(file_name);
+  plain_cart.check_rom();
+  threaded_cart.check_rom();
+  console plain(plain_cart), threaded(threaded_cart);
+  for (console *machine : {&plain, &threaded}) {
+    machine->get_cpu().set_engine(engine);
+    machine->reset();
+  }
+
+  render_thread renderer(threaded, 2);
+  bool same = true;
+  u64 frame = 0;
+  for (; frame < frames && same; frame++) {
+    plain.set_buttons(0, buttons_at(input, frame));
+    threaded.set_buttons(0, buttons_at(input, frame));
+    plain.run_frame();
+    renderer.run_frame();
+    const u8 *picture = renderer.sync();
+    same = std::memcmp(picture, plain.get_ppu().get_frame(), ppu::width * ppu::height) == 0 &&
+           plain.state_hash() == threaded.state_hash();
+  }
+  if (same)
+    std::printf("Drawing on the PPU thread over %llu frames: identical (%016llx).\n",
+                (unsigned long long)frames, (unsigned long long)plain.state_hash());
+  else
+    std::printf("Drawing on the PPU thread differs after frame %llu.\n", (unsigned long long)frame);
+  return same;
+}
+
+// Read the buttons to press on controller 1, a line per change: the frame it
+// starts on, and the buttons held from then on, such as "120 start" or
+// "300 a+right". Lines starting with # are comments.
+static bool load_input(const std::string &file_name, std::vector<std::pair<u64, u8>> &input) {
+  static const char *const names[8] = {"a", "b", "select", "start", "up", "down", "left", "right"};
+  std::ifstream in(file_name);
+  std::string line;
+  while (std::getline(in, line)) {
+    if (line.empty() || line[0] == '#') continue;
+    char *end;
+    u64 frame = std::strtoull(line.c_str(), &end, 10);
+    std::string buttons = end;
+    buttons.erase(0, buttons.find_first_not_of(" \t"));
+    buttons.erase(buttons.find_last_not_of(" \t\r") + 1);
+    if (end == line.c_str()) return false;
+
+    u8 mask = 0;
+    for (std::size_t start = 0; buttons != "none" && start <= buttons.size();) {
+      std::size_t plus = std::min(buttons.find('+', start), buttons.size());
+      std::string name = buttons.substr(start, plus - start);
+      int bit = 0;
+      while (bit < 8 && name != names[bit]) bit++;
+      if (bit == 8) return false;
+      mask |= 1 << bit;
+      start = plus + 1;
+    }
+    input.push_back({frame, mask});
+  }
+  std::stable_sort(input.begin(), input.end(),
+                   [](const std::pair<u64, u8> &a, const std::pair<u64, u8> &b) {
+                     return a.first < b.first;
+                   });
+  return !in.bad();
+}
+
+// Parse "first-last", in the given base. Either can be left out, keeping the
+// value it had.
+static bool parse_range(const char *text, int base, u64 &first, u64 &last) {
+  const char *dash = std::strchr(text, '-');
+  if (!dash) return false;
+  char *end;
+  if (dash != text) {
+    first = std::strtoull(text, &end, base);
+    if (end != dash) return false;
+  }
+  if (dash[1]) {
+    last = std::strtoull(dash + 1, &end, base);
+    if (*end) return false;
+  }
+  return first <= last;
+}
 
 int main(int argc, char **argv) {
-  if (argc != 2) {
-    std::printf("Need a file name. %s <filename>\n", argv[0]);
+  // Options come first, then the positional arguments.
+  cpu_engine engine = cpu_engine::table;
+  batch_options batch;
+  bool savestate_check = false;
+  bool scheduler_check = false;
+  console_timing timing = console_timing::scheduled;
+  bool pipeline = false;
+  ring_policy policy = ring_policy::block;
+  std::string audio_file;
+  std::string dump_file;
+  dump_format format = dump_format::indices;
+  u64 dump_every = 1;
+  bool dump_changed = false;
+  std::string trace_file;
+  trace_trigger trigger;
+  long entry = -1;
+  std::vector<std::pair<u64, u8>> input;  // Frame, and the buttons from then on.
+  unsigned ahead_frames = 0;
+  std::size_t rewind_budget = 0;
+  bool idle_skip = true;
+  u64 render_every = 1;
+  unsigned ppu_thread = 0;  // Frames the drawing may fall behind, if on.
+  bool ppu_thread_check = false;
+  int arg = 1;
+  for (; arg < argc && std::strncmp(argv[arg], "--", 2) == 0; arg++) {
+    if (std::strcmp(argv[arg], "--engine") == 0 && arg + 1 < argc) {
+      std::string name = argv[++arg];
+      if (name == "switch")
+        engine = cpu_engine::switch_case;
+      else if (name == "decoded")
+        engine = cpu_engine::decoded;
+      else if (name != "table") {
+        usage(argv[0]);
+        return 1;
+      }
+    } else if (std::strcmp(argv[arg], "--savestate-check") == 0) {
+      savestate_check = true;
+    } else if (std::strcmp(argv[arg], "--lockstep") == 0) {
+      timing = console_timing::lockstep;
+    } else if (std::strcmp(argv[arg], "--scheduler-check") == 0) {
+      scheduler_check = true;
+    } else if (std::strcmp(argv[arg], "--simd") == 0 && arg + 1 < argc) {
+      std::string name = argv[++arg];
+      simd_path path = simd_path::scalar;
+      for (simd_path candidate : {simd_path::ssse3, simd_path::avx2})
+        if (name == simd_path_name(candidate)) path = candidate;
+      if (name != simd_path_name(path) || !set_simd_path(path)) {
+        std::printf("Pixel path %s is not supported here.\n", name.c_str());
+        return 1;
+      }
+    } else if (std::strcmp(argv[arg], "--audio") == 0 && arg + 1 < argc) {
+      audio_file = argv[++arg];
+    } else if (std::strcmp(argv[arg], "--pipeline") == 0 && arg + 1 < argc) {
+      std::string name = argv[++arg];
+      pipeline = true;
+      if (name == "drop")
+        policy = ring_policy::drop_oldest;
+      else if (name != "block") {
+        usage(argv[0]);
+        return 1;
+      }
+    } else if (std::strcmp(argv[arg], "--dump-frames") == 0 && arg + 1 < argc) {
+      dump_file = argv[++arg];
+    } else if (std::strcmp(argv[arg], "--dump-format") == 0 && arg + 1 < argc) {
+      std::string name = argv[++arg];
+      format = dump_format::indices;
+      for (dump_format candidate : {dump_format::rgba, dump_format::y4m})
+        if (name == dump_format_name(candidate)) format = candidate;
+      if (name != dump_format_name(format)) {
+        usage(argv[0]);
+        return 1;
+      }
+    } else if (std::strcmp(argv[arg], "--dump-every") == 0 && arg + 1 < argc) {
+      dump_every = std::strtoull(argv[++arg], nullptr, 10);
+    } else if (std::strcmp(argv[arg], "--dump-changed") == 0) {
+      dump_changed = true;
+    } else if (std::strcmp(argv[arg], "--trace") == 0 && arg + 1 < argc) {
+      trace_file = argv[++arg];
+    } else if (std::strcmp(argv[arg], "--trace-pc") == 0 && arg + 1 < argc) {
+      u64 first = trigger.first_pc, last = trigger.last_pc;
+      if (!parse_range(argv[++arg], 16, first, last) || last > 0xFFFF) {
+        usage(argv[0]);
+        return 1;
+      }
+      trigger.first_pc = first;
+      trigger.last_pc = last;
+    } else if (std::strcmp(argv[arg], "--trace-cycles") == 0 && arg + 1 < argc) {
+      if (!parse_range(argv[++arg], 10, trigger.first_cycle, trigger.last_cycle)) {
+        usage(argv[0]);
+        return 1;
+      }
+    } else if (std::strcmp(argv[arg], "--entry") == 0 && arg + 1 < argc) {
+      entry = std::strtol(argv[++arg], nullptr, 16) & 0xFFFF;
+    } else if (std::strcmp(argv[arg], "--input") == 0 && arg + 1 < argc) {
+      if (!load_input(argv[++arg], input)) {
+        std::printf("Cannot read the input in %s.\n", argv[arg]);
+        return 1;
+      }
+    } else if (std::strcmp(argv[arg], "--run-ahead") == 0 && arg + 1 < argc) {
+      ahead_frames = std::strtoul(argv[++arg], nullptr, 10);
+    } else if (std::strcmp(argv[arg], "--no-idle-skip") == 0) {
+      idle_skip = false;
+    } else if (std::strcmp(argv[arg], "--render-every") == 0 && arg + 1 < argc) {
+      render_every = std::max(std::strtoull(argv[++arg], nullptr, 10), 1ull);
+    } else if (std::strcmp(argv[arg], "--ppu-thread") == 0 && arg + 1 < argc) {
+      ppu_thread = std::max(std::atoi(argv[++arg]), 1);
+    } else if (std::strcmp(argv[arg], "--ppu-thread-check") == 0) {
+      ppu_thread_check = true;
+    } else if (std::strcmp(argv[arg], "--rewind") == 0 && arg + 1 < argc) {
+      rewind_budget = std::strtoull(argv[++arg], nullptr, 10) * 1024;
+    } else if (std::strcmp(argv[arg], "--trace-text") == 0 && arg + 1 < argc) {
+      std::string error;
+      std::FILE *out = arg + 2 < argc ? std::fopen(argv[arg + 2], "w") : stdout;
+      bool converted = out && trace_to_text(argv[arg + 1], out, error);
+      if (out && out != stdout) converted = std::fclose(out) == 0 && converted;
+      if (!out) error = std::strerror(errno);
+      if (!converted)
+        std::fprintf(stderr, "Cannot convert %s: %s.\n", argv[arg + 1], error.c_str());
+      return converted ? 0 : 1;
+    } else if (std::strcmp(argv[arg], "--simd-check") == 0) {
+      return check_simd() ? 0 : 1;
+    } else if (std::strcmp(argv[arg], "--batch") == 0 && arg + 1 < argc) {
+      batch.manifest = argv[++arg];
+    } else if (std::strcmp(argv[arg], "--threads") == 0 && arg + 1 < argc) {
+      batch.threads = std::strtoul(argv[++arg], nullptr, 10);
+    } else if (std::strcmp(argv[arg], "--output") == 0 && arg + 1 < argc) {
+      batch.output = argv[++arg];
+    } else {
+      usage(argv[0]);
+      return 1;
+    }
+  }
+
+  if (!batch.manifest.empty()) {
+    batch.engine = engine;
+    return run_batch(batch) == 0 ? 0 : 1;
+  }
+
+  if (argc - arg != 1 && argc - arg != 2) {
+    usage(argv[0]);
     return 0;
   }
 
-  std::string fileName = argv[1];
+  std::string fileName = argv[arg];
+  u64 frames = (argc - arg == 2) ? std::strtoull(argv[arg + 1], nullptr, 10) : 600;
+  if (pipeline && (!input.empty() || ahead_frames || rewind_budget)) {
+    std::printf("The pipeline takes no input, and doesn't run ahead or rewind.\n");
+    return 1;
+  }
+
+  if (render_every > 1 && (pipeline || !dump_file.empty())) {
+    std::printf("Frames that aren't drawn can't be dumped or pipelined.\n");
+    return 1;
+  }
+
+  if (ppu_thread && (pipeline || !dump_file.empty() || ahead_frames || rewind_budget ||
+                     render_every > 1)) {
+    std::printf("The PPU thread draws every frame, and the console can't be dumped from, "
+                "pipelined, restored or run ahead meanwhile.\n");
+    return 1;
+  }
+
+  // Opened first, as dumping to standard output moves the text to standard error.
+  frame_dump dump(format, dump_every, dump_changed);
+  if (!dump_file.empty()) {
+    if (pipeline) {
+      std::printf("Frames can't be dumped from the pipeline.\n");
+      return 1;
+    }
+    if (!dump.open(dump_file)) {
+      std::printf("Cannot write %s: %s.\n", dump_file.c_str(), dump.get_error().c_str());
+      return 1;
+    }
+  }
+
   cartridge car(fileName);
   car.print_debug_info();
+  if (!car.check_rom()) {
+    std::printf("%s is not a valid NES ROM: %s.\n", fileName.c_str(), car.get_error().c_str());
+    return 1;
+  }
+
+  console machine(car);
+  cpu &nes_cpu = machine.get_cpu();
+  nes_cpu.set_engine(engine);
+  nes_cpu.set_idle_skip(idle_skip);
+  machine.set_timing(timing);
+  machine.reset();
+  if (entry >= 0) nes_cpu.jump(entry);
+
+  trace_recorder tracer(trigger);
+  if (!trace_file.empty()) {
+    if (!tracer.open(trace_file)) {
+      std::printf("Cannot write %s: %s.\n", trace_file.c_str(), tracer.get_error().c_str());
+      return 1;
+    }
+    nes_cpu.set_tracer(&tracer);
+  }
+
+  // Time the emulation, and report the throughput.
+  const u32 sample_rate = 44100;
+  std::vector<i16> sound;
+  if (!audio_file.empty()) machine.get_apu().set_sample_rate(sample_rate);
+#if defined(NESCPP_PROFILE) && defined(SIGUSR1)
+  std::signal(SIGUSR1, request_profile);
+#endif
+  run_ahead ahead(machine, ahead_frames);
+  rewind_buffer history(rewind_budget);
+  std::size_t next_input = 0;
+  u64 drawn = 0;
+  std::unique_ptr<render_thread> renderer;
+  if (ppu_thread) renderer.reset(new render_thread(machine, ppu_thread));
+  auto start = std::chrono::steady_clock::now();
+  if (pipeline) {
+    run_pipelined(machine, frames, policy, sound);
+  } else {
+    for (u64 ii = 0; ii < frames; ii++) {
+      for (; next_input < input.size() && input[next_input].first <= ii; next_input++)
+        machine.set_buttons(0, input[next_input].second);
+      // Counted back from the last frame, which is always drawn.
+      bool draw = (frames - 1 - ii) % render_every == 0;
+      machine.get_ppu().set_drawing(draw);
+      drawn += draw;
+      if (renderer)
+        renderer->run_frame();
+      else
+        ahead.run_frame(dump.begin_frame());
+      dump.end_frame();
+      if (rewind_budget) history.push(machine);
+      if (profile_requested) {
+        profile_requested = 0;
+        nes_cpu.print_profile(stderr, profile_top);
+      }
+      if (!audio_file.empty()) {
+        const std::vector<i16> &samples = machine.get_apu().get_samples();
+        sound.insert(sound.end(), samples.begin(), samples.end());
+      }
+    }
+  }
+  if (renderer) renderer->sync();
+  auto stop = std::chrono::steady_clock::now();
+  machine.get_ppu().set_frame_target(nullptr);
+  if (!trace_file.empty()) {
+    nes_cpu.set_tracer(nullptr);
+    if (!tracer.close()) {
+      std::printf("Cannot write %s: %s.\n", trace_file.c_str(), tracer.get_error().c_str());
+      return 1;
+    }
+    std::printf("Traced %llu instructions. The emulation waited for the writer %llu times.\n",
+                (unsigned long long)tracer.get_recorded(), (unsigned long long)tracer.get_waits());
+  }
+  if (!dump_file.empty()) {
+    if (!dump.close()) {
+      std::printf("Cannot write %s: %s.\n", dump_file.c_str(), dump.get_error().c_str());
+      return 1;
+    }
+    frame_dump_stats stats = dump.get_stats();
+    std::printf("Dumped %llu frames as %s, %llu unchanged ones skipped, %.1f MB. The emulation "
+                "waited for the writer %llu times.\n",
+                (unsigned long long)stats.written, dump_format_name(format),
+                (unsigned long long)stats.unchanged, stats.bytes / 1e6,
+                (unsigned long long)stats.waits);
+  }
+  if (render_every > 1)
+    std::printf("Drew %llu of the frames.\n", (unsigned long long)drawn);
+  if (renderer) {
+    render_thread_stats stats = renderer->get_stats();
+    std::printf("PPU thread: drew %llu frames from %llu events, %.1f us a frame. The emulation "
+                "waited for it %llu times, and it for the emulation %llu times.\n",
+                (unsigned long long)stats.frames, (unsigned long long)stats.events,
+                stats.frames ? stats.draw_ns / stats.frames / 1e3 : 0.0,
+                (unsigned long long)stats.overruns, (unsigned long long)stats.underruns);
+  }
+  if (ahead_frames) {
+    const run_ahead_stats &stats = ahead.get_stats();
+    std::printf("Ran %llu frames ahead. A snapshot of %llu bytes takes %.1f us, and a restore "
+                "%.1f us.\n",
+                (unsigned long long)stats.frames, (unsigned long long)stats.state_bytes,
+                stats.save_ns / stats.snapshots / 1e3, stats.load_ns / stats.snapshots / 1e3);
+  }
+  if (!audio_file.empty() && !write_wav(audio_file, sound, sample_rate)) {
+    std::printf("Cannot write %s.\n", audio_file.c_str());
+    return 1;
+  }
+
+  double seconds = std::chrono::duration<double>(stop - start).count();
+  u64 instructions = nes_cpu.get_instructions();
+  u64 cycles = nes_cpu.get_cycles();
+  std::printf("Ran %llu frames: %llu instructions, %llu cycles in %.3f s.\n",
+              (unsigned long long)frames, (unsigned long long)instructions,
+              (unsigned long long)cycles, seconds);
+  std::printf("%.2f M instructions/s, %.2f M cycles/s, %.1f frames/s.\n",
+              instructions / seconds / 1e6, cycles / seconds / 1e6, frames / seconds);
+
+  if (engine == cpu_engine::decoded) {
+    decode_cache_stats stats = nes_cpu.get_decode_stats();
+    std::printf("Decode cache: %llu hits, %llu misses, %llu invalidations.\n",
+                (unsigned long long)stats.hits, (unsigned long long)stats.misses,
+                (unsigned long long)stats.invalidations);
+  }
+  idle_loop_stats idle = nes_cpu.get_idle_stats();
+  std::printf("Idle loops: %llu skips, %llu cycles (%.1f%%) and %llu instructions skipped.\n",
+              (unsigned long long)idle.skips, (unsigned long long)idle.cycles,
+              cycles ? 100.0 * idle.cycles / cycles : 0.0, (unsigned long long)idle.instructions);
+  std::printf("Pixel path: %s.\n", simd_path_name(get_simd_path()));
+  tile_cache_stats tiles = car.get_mapper().get_tile_stats();
+  std::printf("Tile cache: %llu row hits, %llu tile rebuilds.\n", (unsigned long long)tiles.hits,
+              (unsigned long long)tiles.rebuilds);
+
+  // The final state, so that runs with different engines can be diffed.
+  const cpu_registers &r = nes_cpu.get_registers();
+  std::printf("A:%02X X:%02X Y:%02X P:%02X SP:%02X PC:%04X\n", r.A, r.X, r.Y, r.P.byte, r.SP, r.PC);
+  u8 next[3] = {nes_cpu.peek(r.PC), nes_cpu.peek(r.PC + 1), nes_cpu.peek(r.PC + 2)};
+  std::printf("Next instruction: %s\n", disassemble(r.PC, next).c_str());
+
+  std::printf("State hash: %016llx\n", (unsigned long long)machine.state_hash());
+  nes_cpu.print_profile(stdout, profile_top);
 
+  if (rewind_budget && !check_rewind(machine, history, input)) return 1;
+  if (savestate_check && !check_savestate(machine)) return 1;
+  if (scheduler_check && !check_scheduler(fileName, frames, engine)) return 1;
+  if (ppu_thread_check && !check_render_thread(fileName, frames, engine, input)) return 1;
   return 0;
 }
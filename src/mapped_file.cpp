@@ -0,0 +1,40 @@
+#include "mapped_file.hpp"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <fstream>
+#include <iterator>
+
+mapped_file::mapped_file(const std::string &file) {
+  int fd = open(file.c_str(), O_RDONLY);
+  if (fd < 0) return;
+
+  // Only the pages which are touched are read in, and the page cache is shared
+  // between every process that maps the same file.
+  struct stat info;
+  if (fstat(fd, &info) == 0 && S_ISREG(info.st_mode) && info.st_size > 0) {
+    void *addr = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (addr != MAP_FAILED) {
+      data = static_cast<const u8 *>(addr);
+      length = info.st_size;
+      mapped = true;
+    }
+  }
+  close(fd);
+  if (mapped) return;
+
+  // Not a regular file (e.g. a pipe), so read it all in.
+  std::ifstream fh(file, std::ifstream::binary);
+  buffer.assign(std::istreambuf_iterator<char>(fh), std::istreambuf_iterator<char>());
+  if (!buffer.empty()) {
+    data = buffer.data();
+    length = buffer.size();
+  }
+}
+
+mapped_file::~mapped_file() {
+  if (mapped) munmap(const_cast<u8 *>(data), length);
+}
@@ -0,0 +1,366 @@
+#include "mapper.hpp"
+
+#include "cartridge.hpp"
+
+//------------------ Mapper base ---------------------//
+mapper::mapper(cartridge &_cart)
+    : cart(_cart),
+      prg(_cart.prg_data(), _cart.prg_size() / decltype(prg)::bank_size),
+      chr(_cart.chr_data(), _cart.chr_size() / decltype(chr)::bank_size),
+      chr_writable(_cart.has_chr_ram()) {
+  tiles.attach(chr);
+  if (cart.has_four_screen_vram())
+    mirroring = nt_mirroring::four_screen;
+  else
+    mirroring = cart.has_vertical_mirroring() ? nt_mirroring::vertical : nt_mirroring::horizontal;
+}
+
+void mapper::attach(cpu_memory &_mem, interrupt_lines &_lines) {
+  mem = &_mem;
+  lines = &_lines;
+
+  mem->map_read(0x60, 0x20, cart.prg_ram_data());
+  mem->map_write(0x60, 0x20, cart.prg_ram_data());
+
+  // Writes to the ROM go to the registers. The reads are mapped by power_on.
+  mem->map_handler(0x80, 0x80, this);
+  for (auto &window : prg_map) window = nullptr;
+  power_on();
+}
+
+u8 mapper::read(u16) { return 0; }
+
+void mapper::map_prg_8k(u8 slot, std::size_t bank) {
+  // Pages that don't change are left alone, so a register write that rewrites
+  // the same banks costs nothing downstream.
+  const u8 *data = prg.bank(bank);
+  if (prg_map[slot] == data) return;
+  prg_map[slot] = data;
+  mem->map_read(0x80 + slot * 0x20, 0x20, data);
+}
+
+void mapper::map_prg_16k(u8 slot, std::size_t bank) {
+  map_prg_8k(slot * 2, bank * 2);
+  map_prg_8k(slot * 2 + 1, bank * 2 + 1);
+}
+
+void mapper::map_prg_32k(std::size_t bank) {
+  map_prg_16k(0, bank * 2);
+  map_prg_16k(1, bank * 2 + 1);
+}
+
+void mapper::map_chr_1k(u8 slot, std::size_t bank) {
+  chr_map[slot] = chr.bank(bank);
+  chr_banks[slot] = bank;
+  tiles.map(slot, bank);
+}
+
+void mapper::map_chr_2k(u8 slot, std::size_t bank) {
+  map_chr_1k(slot * 2, bank * 2);
+  map_chr_1k(slot * 2 + 1, bank * 2 + 1);
+}
+
+void mapper::map_chr_4k(u8 slot, std::size_t bank) {
+  map_chr_2k(slot * 2, bank * 2);
+  map_chr_2k(slot * 2 + 1, bank * 2 + 1);
+}
+
+void mapper::map_chr_8k(std::size_t bank) {
+  map_chr_4k(0, bank * 2);
+  map_chr_4k(1, bank * 2 + 1);
+}
+
+//------------------ Mapper 0: NROM ---------------------//
+// No registers. 16 or 32 KB of PRG ROM, a 16 KB one being mirrored.
+class nrom : public mapper {
+  void power_on() override {
+    map_prg_32k(0);
+    map_chr_8k(0);
+  }
+
+ public:
+  using mapper::mapper;
+  void write(u16, u8) override {}
+};
+
+//------------------ Mapper 1: MMC1 ---------------------//
+// http://wiki.nesdev.com/w/index.php/MMC1
+// Registers are loaded one bit at a time through a serial port. Writes on
+// consecutive cycles are not ignored, which only matters for games relying on
+// read-modify-write instructions to reset the port.
+class mmc1 : public mapper {
+  u8 shift;    // The serial port. The marker bit reaching bit 0 means it's full.
+  u8 control;  // Mirroring, PRG and CHR banking modes.
+  u8 chr_bank[2];
+  u8 prg_bank;
+
+  void update() {
+    static const nt_mirroring modes[4] = {nt_mirroring::single_low, nt_mirroring::single_high,
+                                          nt_mirroring::vertical, nt_mirroring::horizontal};
+    mirroring = modes[control & 3];
+
+    switch ((control >> 2) & 3) {
+      case 0:
+      case 1:  // Switch 32 KB at 0x8000, ignoring the low bit.
+        map_prg_32k((prg_bank & 0xF) >> 1);
+        break;
+      case 2:  // First bank fixed at 0x8000, switch 16 KB at 0xC000.
+        map_prg_16k(0, 0);
+        map_prg_16k(1, prg_bank & 0xF);
+        break;
+      case 3:  // Switch 16 KB at 0x8000, last bank fixed at 0xC000.
+        map_prg_16k(0, prg_bank & 0xF);
+        map_prg_16k(1, num_prg_8k() / 2 - 1);
+        break;
+    }
+
+    if (control & 0x10) {  // Two 4 KB banks.
+      map_chr_4k(0, chr_bank[0]);
+      map_chr_4k(1, chr_bank[1]);
+    } else {  // One 8 KB bank, ignoring the low bit.
+      map_chr_8k(chr_bank[0] >> 1);
+    }
+  }
+
+  void power_on() override {
+    shift = 0x10;
+    control = 0x0C;
+    chr_bank[0] = chr_bank[1] = 0;
+    prg_bank = 0;
+    update();
+  }
+
+  void save_registers(state_buffer &state) const override {
+    u8 registers[5] = {shift, control, chr_bank[0], chr_bank[1], prg_bank};
+    state.put_bytes(registers, sizeof(registers));
+  }
+
+  void load_registers(state_buffer &state) override {
+    u8 registers[5];
+    state.get_bytes(registers, sizeof(registers));
+    shift = registers[0];
+    control = registers[1];
+    chr_bank[0] = registers[2];
+    chr_bank[1] = registers[3];
+    prg_bank = registers[4];
+    update();
+  }
+
+ public:
+  using mapper::mapper;
+
+  void write(u16 address, u8 data) override {
+    if (data & 0x80) {  // Reset the port, and go back to a fixed last bank.
+      shift = 0x10;
+      control |= 0x0C;
+      update();
+      return;
+    }
+
+    bool full = shift & 1;
+    shift = (shift >> 1) | ((data & 1) << 4);
+    if (!full) return;
+
+    // The fifth write picks the register from the address.
+    switch ((address >> 13) & 3) {
+      case 0:
+        control = shift;
+        break;
+      case 1:
+        chr_bank[0] = shift;
+        break;
+      case 2:
+        chr_bank[1] = shift;
+        break;
+      case 3:
+        prg_bank = shift;
+        break;
+    }
+    shift = 0x10;
+    update();
+  }
+};
+
+//------------------ Mapper 2: UxROM ---------------------//
+// Switch 16 KB at 0x8000, the last bank is fixed at 0xC000. CHR is RAM.
+class uxrom : public mapper {
+  u8 bank;  // At 0x8000.
+
+  void power_on() override {
+    bank = 0;
+    map_prg_16k(0, bank);
+    map_prg_16k(1, num_prg_8k() / 2 - 1);
+    map_chr_8k(0);
+  }
+
+  void save_registers(state_buffer &state) const override { state.put(bank); }
+  void load_registers(state_buffer &state) override { write(0x8000, state.get<u8>()); }
+
+ public:
+  using mapper::mapper;
+  void write(u16, u8 data) override {
+    bank = data;
+    map_prg_16k(0, bank);
+  }
+};
+
+//------------------ Mapper 3: CNROM ---------------------//
+// Fixed PRG like NROM. Switch 8 KB of CHR ROM.
+class cnrom : public mapper {
+  u8 bank;  // Of CHR ROM.
+
+  void power_on() override {
+    bank = 0;
+    map_prg_32k(0);
+    map_chr_8k(bank);
+  }
+
+  void save_registers(state_buffer &state) const override { state.put(bank); }
+  void load_registers(state_buffer &state) override { write(0x8000, state.get<u8>()); }
+
+ public:
+  using mapper::mapper;
+  void write(u16, u8 data) override {
+    bank = data;
+    map_chr_8k(bank);
+  }
+};
+
+//------------------ Mapper 4: MMC3 ---------------------//
+// http://wiki.nesdev.com/w/index.php/MMC3
+// Four 8 KB PRG windows, two of which switch, and 2 KB plus 1 KB CHR windows.
+// The scanline counter raises an IRQ when it reaches zero. PRG RAM protection
+// is not emulated: the RAM is always enabled.
+class mmc3 : public mapper {
+  u8 bank_select;  // The register written by the next bank data write, and modes.
+  u8 banks[8];     // R0-R7.
+
+  u8 irq_latch;  // Reload value of the counter.
+  u8 irq_counter;
+  bool irq_reload;
+  bool irq_enabled;
+
+  void update_prg() {
+    std::size_t second_last = num_prg_8k() - 2;
+    bool swap = bank_select & 0x40;  // 0xC000 switches and 0x8000 is fixed instead.
+    map_prg_8k(0, swap ? second_last : banks[6]);
+    map_prg_8k(1, banks[7]);
+    map_prg_8k(2, swap ? banks[6] : second_last);
+    map_prg_8k(3, num_prg_8k() - 1);
+  }
+
+  void update_chr() {
+    u8 base = (bank_select & 0x80) ? 4 : 0;  // Which half gets the 2 KB banks.
+    map_chr_2k(base / 2, banks[0] >> 1);
+    map_chr_2k(base / 2 + 1, banks[1] >> 1);
+    for (u8 ii = 0; ii < 4; ii++) map_chr_1k((base ^ 4) + ii, banks[2 + ii]);
+  }
+
+  void power_on() override {
+    bank_select = 0;
+    for (u8 ii = 0; ii < 8; ii++) banks[ii] = 0;
+    banks[1] = 2;  // Distinct banks, so that the default layout is sensible.
+    banks[2] = 4;
+    banks[3] = 5;
+    banks[4] = 6;
+    banks[5] = 7;
+    banks[7] = 1;
+    irq_latch = irq_counter = 0;
+    irq_reload = irq_enabled = false;
+    update_prg();
+    update_chr();
+  }
+
+  void save_registers(state_buffer &state) const override {
+    state.put(bank_select);
+    state.put_bytes(banks, sizeof(banks));
+    state.put(irq_latch);
+    state.put(irq_counter);
+    state.put(u8(irq_reload));
+    state.put(u8(irq_enabled));
+  }
+
+  void load_registers(state_buffer &state) override {
+    bank_select = state.get<u8>();
+    state.get_bytes(banks, sizeof(banks));
+    irq_latch = state.get<u8>();
+    irq_counter = state.get<u8>();
+    irq_reload = state.get<u8>();
+    irq_enabled = state.get<u8>();
+    update_prg();
+    update_chr();
+  }
+
+ public:
+  using mapper::mapper;
+
+  void write(u16 address, u8 data) override {
+    bool odd = address & 1;
+    switch (address & 0xE000) {
+      case 0x8000:
+        if (!odd) {  // The modes may have changed.
+          bank_select = data;
+          update_prg();
+          update_chr();
+        } else {  // Only the windows the register feeds are remapped.
+          banks[bank_select & 7] = data;
+          if ((bank_select & 7) < 6)
+            update_chr();
+          else
+            update_prg();
+        }
+        break;
+      case 0xA000:
+        if (!odd && mirroring != nt_mirroring::four_screen)
+          mirroring = (data & 1) ? nt_mirroring::horizontal : nt_mirroring::vertical;
+        break;
+      case 0xC000:
+        if (odd) {  // Reload the counter at the next scanline.
+          irq_counter = 0;
+          irq_reload = true;
+        } else {
+          irq_latch = data;
+        }
+        break;
+      case 0xE000:
+        irq_enabled = odd;
+        if (!odd) set_irq(false);  // Disabling also acknowledges.
+        break;
+    }
+  }
+
+  void scanline() override {
+    if (irq_counter == 0 || irq_reload) {
+      irq_counter = irq_latch;
+      irq_reload = false;
+    } else {
+      irq_counter--;
+    }
+    if (irq_counter == 0 && irq_enabled) set_irq(true);
+  }
+
+  unsigned scanlines_to_irq() const override {
+    if (!irq_enabled) return 0;
+    // A counter at 0 is reloaded first. It raises the IRQ on every scanline
+    // if the latch is 0 too.
+    return (irq_counter == 0 || irq_reload) ? irq_latch + 1u : irq_counter;
+  }
+};
+
+//------------------ Factory ---------------------//
+std::unique_ptr<mapper> make_mapper(u8 number, cartridge &cart) {
+  switch (number) {
+    case 0:
+      return std::unique_ptr<mapper>(new nrom(cart));
+    case 1:
+      return std::unique_ptr<mapper>(new mmc1(cart));
+    case 2:
+      return std::unique_ptr<mapper>(new uxrom(cart));
+    case 3:
+      return std::unique_ptr<mapper>(new cnrom(cart));
+    case 4:
+      return std::unique_ptr<mapper>(new mmc3(cart));
+    default:
+      return nullptr;
+  }
+}
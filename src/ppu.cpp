@@ -0,0 +1,373 @@
+#include "ppu.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+//------------------ PPU ---------------------//
+ppu::ppu(mapper &_board, interrupt_lines &_lines)
+    : board(_board), lines(_lines), frame(own_frame), drawing(true), log(nullptr) {
+  std::memset(vram, 0, sizeof(vram));
+  std::memset(palette, 0, sizeof(palette));
+  std::memset(oam, 0, sizeof(oam));
+  std::memset(own_frame, 0, sizeof(own_frame));
+  reset();
+}
+
+void ppu::reset() {
+  // http://wiki.nesdev.com/w/index.php/PPU_power_up_state
+  ctrl = mask = status = oam_addr = 0;
+  v = t = 0;
+  fine_x = 0;
+  w = false;
+  read_data = io_latch = 0;
+}
+
+// ------------------- Memory ------------------------------ //
+u16 ppu::nametable_address(u16 address) const {
+  // Which of the physical tables each of the four logical ones uses.
+  static const u8 tables[5][4] = {
+      {0, 0, 1, 1},  // Horizontal.
+      {0, 1, 0, 1},  // Vertical.
+      {0, 0, 0, 0},  // Single screen, lower.
+      {1, 1, 1, 1},  // Single screen, upper.
+      {0, 1, 2, 3},  // Four screens.
+  };
+  u8 table = tables[u8(board.get_mirroring())][(address >> 10) & 3];
+  return table * 0x400 + (address & 0x3FF);
+}
+
+u8 ppu::ppu_read(u16 address) {
+  address &= 0x3FFF;
+  if (address < 0x2000) return board.chr_read(address);
+  if (address < 0x3F00) return vram[nametable_address(address)];
+  return palette[palette_index(address)];
+}
+
+void ppu::ppu_write(u16 address, u8 data) {
+  address &= 0x3FFF;
+  if (address < 0x2000)
+    board.chr_write(address, data);
+  else if (address < 0x3F00)
+    vram[nametable_address(address)] = data;
+  else
+    palette[palette_index(address)] = data & 0x3F;
+}
+
+// ------------------- Registers --------------------------- //
+u8 ppu::read(u16 address) {
+  if (log && ((address & 7) == 2 || (address & 7) == 7))
+    log->events.push_back({ppu_event::read, 0, address});
+  switch (address & 7) {
+    case 2:  // PPUSTATUS. Reading it clears VBL, and the write toggle.
+      io_latch = (status & 0xE0) | (io_latch & 0x1F);
+      status &= ~0x80;
+      w = false;
+      break;
+    case 4:  // OAMDATA
+      io_latch = oam[oam_addr];
+      break;
+    case 7: {  // PPUDATA. Reads come through a buffer, except for the palette.
+      u16 vram_address = v & 0x3FFF;
+      if (vram_address >= 0x3F00) {
+        io_latch = (io_latch & 0xC0) | ppu_read(vram_address);
+        read_data = ppu_read(vram_address - 0x1000);  // The nametable under it.
+      } else {
+        io_latch = read_data;
+        read_data = ppu_read(vram_address);
+      }
+      v += (ctrl & 0x04) ? 32 : 1;
+      break;
+    }
+    default:  // Write only registers read back the bus.
+      break;
+  }
+  return io_latch;
+}
+
+void ppu::write(u16 address, u8 data) {
+  if (log) log->events.push_back({ppu_event::write, data, address});
+  io_latch = data;
+  switch (address & 7) {
+    case 0: {  // PPUCTRL
+      // Enabling NMI during vblank raises one right away.
+      bool was_enabled = ctrl & 0x80;
+      ctrl = data;
+      t = (t & 0xF3FF) | ((data & 0x03) << 10);
+      if (!was_enabled && (ctrl & 0x80) && (status & 0x80)) lines.nmi = true;
+      break;
+    }
+    case 1:  // PPUMASK
+      mask = data;
+      break;
+    case 3:  // OAMADDR
+      oam_addr = data;
+      break;
+    case 4:  // OAMDATA
+      oam[oam_addr++] = data;
+      break;
+    case 5:  // PPUSCROLL. X, then Y.
+      if (!w) {
+        t = (t & ~0x001F) | (data >> 3);
+        fine_x = data & 7;
+      } else {
+        t = (t & 0x8C1F) | ((data & 0x07) << 12) | ((data & 0xF8) << 2);
+      }
+      w = !w;
+      break;
+    case 6:  // PPUADDR. High byte, then low byte.
+      if (!w) {
+        t = (t & 0x00FF) | ((data & 0x3F) << 8);
+      } else {
+        t = (t & 0xFF00) | data;
+        v = t;
+      }
+      w = !w;
+      break;
+    case 7:  // PPUDATA
+      ppu_write(v & 0x3FFF, data);
+      v += (ctrl & 0x04) ? 32 : 1;
+      break;
+    default:  // PPUSTATUS is read only.
+      break;
+  }
+}
+
+void ppu::oam_dma(const u8 *page) {
+  if (log) {
+    log->events.push_back({ppu_event::oam_dma, 0, u16(log->pages.size() / 256)});
+    log->pages.insert(log->pages.end(), page, page + 256);
+  }
+  // The copy starts at OAMADDR, and wraps around.
+  for (int ii = 0; ii < 256; ii++) oam[u8(oam_addr + ii)] = page[ii];
+}
+
+void ppu::set_frame_target(u8 *target) {
+  if (!target && frame != own_frame) std::memcpy(own_frame, frame, sizeof(own_frame));
+  frame = target ? target : own_frame;
+}
+
+void ppu::load_picture(const u8 *picture) { std::memcpy(frame, picture, sizeof(own_frame)); }
+
+void ppu::board_changed() {
+  if (!log) return;
+  log->events.push_back({ppu_event::mirroring, u8(board.get_mirroring()), 0});
+  for (u8 slot = 0; slot < 8; slot++)
+    log->events.push_back({ppu_event::chr_bank, slot, u16(board.get_chr_bank(slot))});
+}
+
+// ------------------- Timing ------------------------------ //
+void ppu::start_line(int line) {
+  if (log) log->events.push_back({ppu_event::start_line, 0, u16(line)});
+  if (line < height) render_line(line);
+
+  if (line == vblank_line) {
+    status |= 0x80;
+    if (ctrl & 0x80) lines.nmi = true;
+  } else if (line == prerender_line) {
+    status &= ~0xE0;  // VBL, sprite 0 hit and overflow.
+  }
+}
+
+void ppu::hblank(int line) {
+  if (log) log->events.push_back({ppu_event::hblank, 0, u16(line)});
+  if (!rendering() || (line >= height && line != prerender_line)) return;
+
+  // Dot 256 moves down a line, and dot 257 reloads the horizontal scroll. The
+  // prerender line then reloads the vertical scroll too.
+  increment_y();
+  v = (v & ~0x041F) | (t & 0x041F);
+  if (line == prerender_line) v = (v & 0x041F) | (t & ~0x041F);
+
+  board.scanline();
+}
+
+void ppu::increment_y() {
+  if ((v & 0x7000) != 0x7000) {  // Fine Y.
+    v += 0x1000;
+    return;
+  }
+  v &= ~0x7000;
+  u16 coarse_y = (v & 0x03E0) >> 5;
+  if (coarse_y == 29) {  // The last row of tiles. Go to the nametable below.
+    coarse_y = 0;
+    v ^= 0x0800;
+  } else if (coarse_y == 31) {  // In the attributes. Wrap without switching.
+    coarse_y = 0;
+  } else {
+    coarse_y++;
+  }
+  v = (v & ~0x03E0) | (coarse_y << 5);
+}
+
+// ------------------- Rendering --------------------------- //
+void ppu::render_line(int line) {
+  if (!drawing) {
+    check_line(line);
+    return;
+  }
+  u8 colour_mask = (mask & 0x01) ? 0x30 : 0x3F;  // Greyscale.
+  u8 *out = frame + line * width;
+  if (!rendering()) {
+    std::memset(out, palette[0] & colour_mask, width);
+    return;
+  }
+
+  u8 background[width], sprites[width], flags[width];
+  if (mask & 0x08)
+    render_background(background);
+  else
+    std::memset(background, 0, width);
+
+  std::memset(sprites, 0, width);
+  std::memset(flags, 0, width);
+  if (mask & 0x10) render_sprites(line, sprites, flags);
+
+  // The leftmost 8 pixels can be hidden for each layer.
+  if (!(mask & 0x02)) std::memset(background, 0, 8);
+  if (!(mask & 0x04)) std::memset(sprites, 0, 8);
+
+  if (compose_line(background, sprites, flags, palette, colour_mask, out)) status |= 0x40;
+}
+
+void ppu::render_background(u8 *pixels) {
+  // Tiles are drawn from v, which the last hblank left at the start of this
+  // line. With fine X scrolling, a 33rd tile shows on the right.
+  u8 buffer[width + 8];
+  u16 address = v;
+  u16 fine_y = (v >> 12) & 7;
+  u16 table = (ctrl & 0x10) ? 0x1000 : 0x0000;
+
+  for (int tile = 0; tile < 33; tile++) {
+    u8 name = vram[nametable_address(0x2000 | (address & 0x0FFF))];
+    u8 attribute = vram[nametable_address(0x23C0 | (address & 0x0C00) | ((address >> 4) & 0x38) |
+                                          ((address >> 2) & 0x07))];
+    u8 shift = ((address >> 4) & 4) | (address & 2);  // Quadrant of the attribute.
+    u8 colour = ((attribute >> shift) & 3) << 2;
+
+    // The palette bits go on the opaque pixels of the row, 8 at a time: a
+    // pixel value is at most 3, so each byte of opaque has just bit 0 set.
+    u64 row = board.chr_row(table + name * 16 + fine_y);
+    u64 opaque = (row | (row >> 1)) & 0x0101010101010101ull;
+    row |= opaque * colour;
+    std::memcpy(buffer + tile * 8, &row, sizeof(row));
+
+    // Coarse X, wrapping into the next nametable.
+    if ((address & 0x001F) == 31)
+      address = (address & ~0x001F) ^ 0x0400;
+    else
+      address++;
+  }
+
+  std::memcpy(pixels, buffer + fine_x, width);
+}
+
+void ppu::render_sprites(int line, u8 *pixels, u8 *flags) {
+  int sprite_height = (ctrl & 0x20) ? 16 : 8;
+  int found = 0;
+
+  // OAM order is priority order, so a pixel is only drawn if no earlier sprite
+  // has drawn it.
+  for (int sprite = 0; sprite < 64; sprite++) {
+    const u8 *entry = oam + sprite * 4;
+    int row = line - (entry[0] + 1);  // Sprites show a line below their Y.
+    if (row < 0 || row >= sprite_height) continue;
+    if (++found > 8) {  // Without the hardware's evaluation bug.
+      status |= 0x20;
+      break;
+    }
+
+    u8 tile = entry[1];
+    u8 attributes = entry[2];
+    if (attributes & 0x80) row = sprite_height - 1 - row;  // Vertical flip.
+
+    u16 pattern;
+    if (sprite_height == 16)  // Bit 0 of the tile picks the table.
+      pattern = ((tile & 1) << 12) + (tile & 0xFE) * 16 + (row >= 8) * 16 + (row & 7);
+    else
+      pattern = ((ctrl & 0x08) ? 0x1000 : 0x0000) + tile * 16 + row;
+    u64 decoded = board.chr_row(pattern);
+    u8 values[8];
+    std::memcpy(values, &decoded, sizeof(values));
+
+    u8 colour = 0x10 | ((attributes & 3) << 2);
+    u8 sprite_flag = ((attributes & 0x20) ? sprite_behind : 0) | (sprite == 0 ? sprite_zero : 0);
+    for (int px = 0; px < 8; px++) {
+      int x = entry[3] + px;
+      if (x >= width) break;
+      u8 value = values[(attributes & 0x40) ? 7 - px : px];  // Horizontal flip.
+      if (!value || pixels[x]) continue;
+      pixels[x] = colour | value;
+      flags[x] = sprite_flag;
+    }
+  }
+}
+
+void ppu::check_line(int line) {
+  if (!rendering() || !(mask & 0x10)) return;
+  int sprite_height = (ctrl & 0x20) ? 16 : 8;
+  int found = 0;
+  for (int sprite = 0; sprite < 64 && found <= 8; sprite++) {
+    int row = line - (oam[sprite * 4] + 1);
+    if (row >= 0 && row < sprite_height) found++;
+  }
+  if (found > 8) status |= 0x20;
+
+  // The hit needs both layers, and is set once a frame, so they are only drawn,
+  // and not composed, on the lines sprite 0 is on until it hits. Sprite 0 comes
+  // first in OAM, so its pixels are never hidden by another sprite's.
+  const u8 *entry = oam;
+  int row = line - (entry[0] + 1);
+  if ((status & 0x40) || !(mask & 0x08) || row < 0 || row >= sprite_height) return;
+  u8 background[width], sprites[width], flags[width];
+  render_background(background);
+  if (!(mask & 0x02)) std::memset(background, 0, 8);
+  std::memset(sprites, 0, width);
+  render_sprites(line, sprites, flags);
+  if (!(mask & 0x04)) std::memset(sprites, 0, 8);
+  for (int x = entry[3]; x < std::min(entry[3] + 8, width - 1); x++) {
+    if (background[x] && sprites[x] && (flags[x] & sprite_zero)) {
+      status |= 0x40;
+      return;
+    }
+  }
+}
+
+// ------------------- State ------------------------------- //
+u64 ppu::state_hash() const {
+  u64 hash = fnv1a(frame, sizeof(own_frame));
+  hash = fnv1a(vram, sizeof(vram), hash);
+  hash = fnv1a(palette, sizeof(palette), hash);
+  return fnv1a(oam, sizeof(oam), hash);
+}
+
+void ppu::save_state(state_buffer &state) const {
+  state.put(ctrl);
+  state.put(mask);
+  state.put(status);
+  state.put(oam_addr);
+  state.put(v);
+  state.put(t);
+  state.put(fine_x);
+  state.put(u8(w));
+  state.put(read_data);
+  state.put(io_latch);
+  state.put_bytes(vram, sizeof(vram));
+  state.put_bytes(palette, sizeof(palette));
+  state.put_bytes(oam, sizeof(oam));
+}
+
+void ppu::load_state(state_buffer &state) {
+  ctrl = state.get<u8>();
+  mask = state.get<u8>();
+  status = state.get<u8>();
+  oam_addr = state.get<u8>();
+  v = state.get<u16>();
+  t = state.get<u16>();
+  fine_x = state.get<u8>();
+  w = state.get<u8>();
+  read_data = state.get<u8>();
+  io_latch = state.get<u8>();
+  state.get_bytes(vram, sizeof(vram));
+  state.get_bytes(palette, sizeof(palette));
+  state.get_bytes(oam, sizeof(oam));
+}
@@ -0,0 +1,117 @@
+#include "profiler.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+#include "cpu_opcode_info.hpp"
+#include "disassembler.hpp"
+
+static const char *mode_names[] = {"IMM", "ZPG", "ZPX", "ZPY", "ABS", "ABX", "ABY",
+                                   "INX", "INY", "ACCUM", "IMPL", "REL", "IND"};
+
+cpu_profiler::cpu_profiler() : prg(nullptr), prg_size(0), other_hits(64 * 1024) { clear(); }
+
+void cpu_profiler::set_prg(const u8 *data, std::size_t size) {
+  prg = data;
+  prg_size = size;
+  rom_hits.assign(size, 0);
+  rom_address.assign(size, 0);
+}
+
+void cpu_profiler::clear() {
+  std::memset(opcode_count, 0, sizeof(opcode_count));
+  std::memset(opcode_cycles, 0, sizeof(opcode_cycles));
+  interrupt_count = interrupt_cycles = 0;
+  std::fill(rom_hits.begin(), rom_hits.end(), 0);
+  std::fill(other_hits.begin(), other_hits.end(), 0);
+}
+
+void cpu_profiler::report(std::FILE *out, std::size_t top, cpu_memory &mem) const {
+  u64 instructions = 0, cycles = 0;
+  for (int ii = 0; ii < 256; ii++) {
+    instructions += opcode_count[ii];
+    cycles += opcode_cycles[ii];
+  }
+  std::fprintf(out, "Profile: %llu instructions, %llu cycles, and %llu interrupts taking %llu.\n",
+               (unsigned long long)instructions, (unsigned long long)cycles,
+               (unsigned long long)interrupt_count, (unsigned long long)interrupt_cycles);
+  if (!instructions) return;
+  auto percent = [](u64 part, u64 whole) { return whole ? 100.0 * part / whole : 0.0; };
+
+  // Opcodes, by the cycles they took.
+  std::vector<int> opcodes;
+  for (int ii = 0; ii < 256; ii++)
+    if (opcode_count[ii]) opcodes.push_back(ii);
+  std::sort(opcodes.begin(), opcodes.end(),
+            [this](int a, int b) { return opcode_cycles[a] > opcode_cycles[b]; });
+  std::fprintf(out, "Top opcodes by cycles:\n");
+  for (std::size_t ii = 0; ii < opcodes.size() && ii < top; ii++) {
+    int code = opcodes[ii];
+    const opcode_info &info = opcode_infos[code];
+    std::fprintf(out, "  %02X %-4s %-5s %6.2f%% of cycles, %6.2f%% of instructions, %.2f cycles\n",
+                 code, mnemonic_names[info.op], mode_names[info.mode],
+                 percent(opcode_cycles[code], cycles), percent(opcode_count[code], instructions),
+                 double(opcode_cycles[code]) / opcode_count[code]);
+  }
+
+  u64 mode_cycles[m_IND + 1] = {}, mode_count[m_IND + 1] = {};
+  for (int ii = 0; ii < 256; ii++) {
+    mode_cycles[opcode_infos[ii].mode] += opcode_cycles[ii];
+    mode_count[opcode_infos[ii].mode] += opcode_count[ii];
+  }
+  std::fprintf(out, "Addressing modes:\n");
+  for (int mode = m_IMM; mode <= m_IND; mode++) {
+    if (!mode_count[mode]) continue;
+    std::fprintf(out, "  %-5s %6.2f%% of cycles, %6.2f%% of instructions\n", mode_names[mode],
+                 percent(mode_cycles[mode], cycles), percent(mode_count[mode], instructions));
+  }
+
+  // Where the instructions were fetched from, by bank and by address.
+  struct spot {
+    u64 hits;
+    u16 address;
+    int bank;  // -1 outside of the ROM.
+    const u8 *code;
+  };
+  std::vector<spot> spots;
+  std::vector<u64> banks((prg_size + bank_size - 1) / bank_size);
+  u64 other = 0;
+  for (std::size_t offset = 0; offset < prg_size; offset++) {
+    if (!rom_hits[offset]) continue;
+    banks[offset / bank_size] += rom_hits[offset];
+    spots.push_back({rom_hits[offset], rom_address[offset], int(offset / bank_size), prg + offset});
+  }
+  for (std::size_t address = 0; address < other_hits.size(); address++) {
+    if (!other_hits[address]) continue;
+    other += other_hits[address];
+    spots.push_back({other_hits[address], u16(address), -1, nullptr});
+  }
+
+  std::fprintf(out, "PRG banks of %zu KB:\n", bank_size / 1024);
+  for (std::size_t bank = 0; bank < banks.size(); bank++) {
+    if (banks[bank])
+      std::fprintf(out, "  bank %-3zu %6.2f%% of instructions\n", bank,
+                   percent(banks[bank], instructions));
+  }
+  if (other)
+    std::fprintf(out, "  elsewhere %6.2f%% of instructions\n", percent(other, instructions));
+
+  std::size_t shown = std::min(top, spots.size());
+  std::partial_sort(spots.begin(), spots.begin() + shown, spots.end(),
+                    [](const spot &a, const spot &b) { return a.hits > b.hits; });
+  std::fprintf(out, "Top addresses:\n");
+  for (std::size_t ii = 0; ii < shown; ii++) {
+    const spot &where = spots[ii];
+    u8 bytes[3] = {};
+    for (int jj = 0; jj < 3; jj++) {
+      if (where.code && where.code + jj < prg + prg_size)
+        bytes[jj] = where.code[jj];
+      else if (!where.code && mem.is_direct(u16(where.address + jj) >> 8))  // No side effects.
+        bytes[jj] = mem[where.address + jj];
+    }
+    char bank[16] = "   ";
+    if (where.bank >= 0) std::snprintf(bank, sizeof(bank), "%3d", where.bank);
+    std::fprintf(out, "  %s:%04X %6.2f%%  %s\n", bank, where.address,
+                 percent(where.hits, instructions), disassemble(where.address, bytes).c_str());
+  }
+}
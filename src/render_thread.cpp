@@ -0,0 +1,119 @@
+#include "render_thread.hpp"
+
+#include <chrono>
+#include <vector>
+
+#include "cartridge.hpp"
+
+// The board the copy of the PPU draws through. It has no registers, and only
+// switches its windows and mirroring when the log says. CHR ROM is shared
+// with the console's mapper, as neither writes it, but CHR RAM is written
+// through the PPU, so the copy gets a copy of its own.
+class render_thread::replay_mapper : public mapper {
+  std::vector<u8> chr_ram;
+
+  void power_on() override {}
+
+ public:
+  explicit replay_mapper(cartridge &_cart) : mapper(_cart) {
+    const mapper &original = _cart.get_mapper();
+    if (chr_writable) {
+      chr_ram.assign(cart.chr_data(), cart.chr_data() + cart.chr_size());
+      chr.view(chr_ram.data(), chr.get_num_banks());
+      tiles.attach(chr);
+    }
+    set_mirroring(original.get_mirroring());
+    for (u8 slot = 0; slot < 8; slot++) map_chr_1k(slot, original.get_chr_bank(slot));
+  }
+
+  void write(u16, u8) override {}
+  void set_mirroring(nt_mirroring _mirroring) { mirroring = _mirroring; }
+  void set_chr_bank(u8 slot, std::size_t bank) { map_chr_1k(slot, bank); }
+};
+
+render_thread::render_thread(console &_machine, std::size_t depth)
+    : machine(_machine),
+      board(new replay_mapper(_machine.get_cartridge())),
+      copy(*board, lines),
+      logs(depth, ring_policy::block) {
+  ppu &video = machine.get_ppu();
+  state_buffer state;
+  video.save_state(state);
+  state.rewind();
+  copy.load_state(state);
+  copy.load_picture(video.get_frame());
+
+  worker = std::thread([this] {
+    while (ppu_log *log = logs.wait_read()) {
+      auto start = std::chrono::steady_clock::now();
+      replay(*log);
+      events += log->events.size();
+      logs.end_read();
+      draw_ns += std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start)
+                     .count();
+      drawn.store(drawn.load(std::memory_order_relaxed) + 1);
+    }
+  });
+}
+
+render_thread::~render_thread() {
+  logs.close();
+  worker.join();
+}
+
+void render_thread::replay(const ppu_log &log) {
+  for (const ppu_event &event : log.events) {
+    switch (event.kind) {
+      case ppu_event::read:
+        copy.read(event.address);
+        break;
+      case ppu_event::write:
+        copy.write(event.address, event.data);
+        break;
+      case ppu_event::oam_dma:
+        copy.oam_dma(log.pages.data() + event.address * 256);
+        break;
+      case ppu_event::start_line:
+        copy.start_line(event.address);
+        break;
+      case ppu_event::hblank:
+        copy.hblank(event.address);
+        break;
+      case ppu_event::mirroring:
+        board->set_mirroring(nt_mirroring(event.data));
+        break;
+      case ppu_event::chr_bank:
+        board->set_chr_bank(event.data, event.address);
+        break;
+    }
+  }
+}
+
+void render_thread::run_frame() {
+  ppu &video = machine.get_ppu();
+  ppu_log *log = logs.begin_write();
+  log->clear();
+  video.set_log(log);
+  bool drawing = video.is_drawing();
+  video.set_drawing(false);
+  machine.run_frame();
+  video.set_drawing(drawing);
+  video.set_log(nullptr);
+  logs.end_write();
+  handed.store(handed.load(std::memory_order_relaxed) + 1);
+}
+
+const u8 *render_thread::sync() {
+  for (unsigned tries = 0; drawn.load() != handed.load(std::memory_order_relaxed); tries++) {
+    if (tries < 64)
+      std::this_thread::yield();
+    else
+      std::this_thread::sleep_for(std::chrono::microseconds(50));
+  }
+  machine.get_ppu().load_picture(copy.get_frame());
+  return copy.get_frame();
+}
+
+render_thread_stats render_thread::get_stats() const {
+  return {drawn.load(), events, logs.get_overruns(), logs.get_underruns(), draw_ns};
+}
@@ -0,0 +1,165 @@
+#include "rewind.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+
+// Runs of zeros shorter than this are left in the literals, as coding them
+// would take more than it saves.
+static const std::size_t min_zeros = 4;
+
+static void put_length(std::vector<u8> &out, std::size_t value) {
+  while (value >= 0x80) {
+    out.push_back(u8(value) | 0x80);
+    value >>= 7;
+  }
+  out.push_back(u8(value));
+}
+
+static std::size_t get_length(const u8 *&in) {
+  std::size_t value = 0;
+  for (int shift = 0;; shift += 7) {
+    u8 byte = *in++;
+    value |= std::size_t(byte & 0x7F) << shift;
+    if (!(byte & 0x80)) return value;
+  }
+}
+
+static u64 load64(const u8 *bytes) {
+  u64 value;
+  std::memcpy(&value, bytes, sizeof(value));
+  return value;
+}
+
+// Code before ^ after, both length bytes long, into out: pairs of a run of
+// zeros and a run of literal bytes, each run after its length. Zeros at the
+// end are left out.
+static void code_delta(const u8 *before, const u8 *after, std::size_t length,
+                       std::vector<u8> &out) {
+  std::size_t ii = 0;
+  while (ii < length) {
+    std::size_t first = ii;
+    while (ii + 8 <= length && load64(before + ii) == load64(after + ii)) ii += 8;
+    while (ii < length && before[ii] == after[ii]) ii++;
+    if (ii == length) break;
+    std::size_t zeros = ii - first;
+
+    first = ii;
+    std::size_t same = 0;
+    while (ii < length && same < min_zeros) {
+      same = before[ii] == after[ii] ? same + 1 : 0;
+      ii++;
+    }
+    ii -= same;  // Those start the next run of zeros.
+    put_length(out, zeros);
+    put_length(out, ii - first);
+    for (std::size_t jj = first; jj < ii; jj++) out.push_back(before[jj] ^ after[jj]);
+  }
+}
+
+rewind_buffer::rewind_buffer(std::size_t budget) : ring(budget), stored(0), stats() {}
+
+void rewind_buffer::clear() {
+  deltas.clear();
+  newest.clear();
+  stored = 0;
+}
+
+void rewind_buffer::drop_oldest() {
+  stored -= deltas.front().size;
+  deltas.pop_front();
+  stats.dropped++;
+}
+
+// The deltas lie in the ring from the oldest to the newest, wrapping around to
+// the start when the next doesn't fit before the end. Drop the oldest until
+// there is room for size bytes after the newest, or at the start.
+std::size_t rewind_buffer::place(std::size_t size) {
+  while (!deltas.empty()) {
+    const delta &oldest = deltas.front(), &newer = deltas.back();
+    std::size_t end = newer.offset + newer.size;
+    if (newer.offset >= oldest.offset) {  // Not wrapped.
+      if (end + size <= ring.size()) return end;
+      if (size <= oldest.offset) return 0;
+    } else if (end + size <= oldest.offset) {
+      return end;
+    }
+    drop_oldest();
+  }
+  return 0;
+}
+
+void rewind_buffer::push(console &machine) {
+  auto start = std::chrono::steady_clock::now();
+  save_state(machine, next);
+
+  if (!newest.bytes().empty()) {
+    // The states of a cartridge are all the same size, but pad them to the
+    // same length in case. The newest one is about to be dropped, and the next
+    // is trimmed back.
+    std::vector<u8> &before = newest.bytes(), &after = next.bytes();
+    std::size_t size = after.size(), length = std::max(before.size(), size);
+    coded.clear();
+    put_length(coded, before.size());
+    before.resize(length);
+    after.resize(length);
+    code_delta(before.data(), after.data(), length, coded);
+    after.resize(size);
+
+    if (coded.size() > ring.size()) {
+      // Too big to keep, so the history before it is lost.
+      while (!deltas.empty()) drop_oldest();
+    } else {
+      std::size_t offset = place(coded.size());
+      std::memcpy(ring.data() + offset, coded.data(), coded.size());
+      deltas.push_back({offset, coded.size()});
+      stored += coded.size();
+    }
+  }
+  std::swap(newest, next);
+  stats.pushed++;
+  stats.push_ns +=
+      std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+}
+
+bool rewind_buffer::rewind(console &machine, u64 frames) {
+  if (newest.bytes().empty()) {
+    error = "no state to go back to";
+    return false;
+  }
+  auto start = std::chrono::steady_clock::now();
+  std::vector<u8> &state = newest.bytes();
+  for (; frames && !deltas.empty(); frames--) {
+    const delta &last = deltas.back();
+    const u8 *in = ring.data() + last.offset, *end = in + last.size;
+    std::size_t before = get_length(in);
+    state.resize(std::max(before, state.size()));
+    for (std::size_t ii = 0; in < end;) {
+      ii += get_length(in);
+      std::size_t count = get_length(in);
+      for (std::size_t jj = 0; jj < count; jj++) state[ii + jj] ^= in[jj];
+      in += count;
+      ii += count;
+    }
+    state.resize(before);
+
+    stored -= last.size;
+    deltas.pop_back();
+    stats.rewound++;
+  }
+
+  newest.rewind();
+  if (!load_state(machine, newest, error)) return false;
+  stats.rewind_ns +=
+      std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+  return true;
+}
+
+rewind_stats rewind_buffer::get_stats() const {
+  rewind_stats result = stats;
+  result.frames = deltas.size() + !newest.bytes().empty();
+  result.state_bytes = newest.bytes().size();
+  result.stored_bytes = stored + result.state_bytes;
+  result.raw_bytes = result.frames * result.state_bytes;
+  return result;
+}
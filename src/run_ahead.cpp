@@ -0,0 +1,56 @@
+#include "run_ahead.hpp"
+
+#include <chrono>
+#include <cstring>
+
+run_ahead::run_ahead(console &_machine, unsigned _frames)
+    : machine(_machine), frames(_frames), picture(_machine.get_ppu().get_frame()), stats() {
+  std::memset(real, 0, sizeof(real));
+  std::memset(shown, 0, sizeof(shown));
+}
+
+void run_ahead::run_frame(u8 *target) {
+  ppu &video = machine.get_ppu();
+  if (!frames) {
+    video.set_frame_target(target);
+    machine.run_frame();
+    picture = video.get_frame();
+    return;
+  }
+
+  // The frame that counts draws to a buffer of its own, which stays the PPU's
+  // target in between, so that the picture in the state hash is the same as
+  // without run-ahead.
+  video.set_frame_target(real);
+  machine.run_frame();
+
+  // The snapshot buffer keeps its capacity, so this doesn't allocate after the
+  // first frame.
+  auto start = std::chrono::steady_clock::now();
+  state.clear();
+  machine.save_state(state);
+  auto saved = std::chrono::steady_clock::now();
+
+  // Only the last frame run ahead is seen, so the others aren't drawn.
+  machine.get_apu().set_silent(true);
+  video.set_frame_target(target ? target : shown);
+  bool drawing = video.is_drawing();
+  video.set_drawing(false);
+  for (unsigned ii = 1; ii < frames; ii++) machine.run_frame();
+  video.set_drawing(drawing);
+  machine.run_frame();
+
+  auto restore = std::chrono::steady_clock::now();
+  state.rewind();
+  machine.load_state(state);
+  auto stop = std::chrono::steady_clock::now();
+  machine.get_apu().set_silent(false);
+  video.set_frame_target(real);
+  picture = target ? target : shown;
+
+  stats.frames += frames;
+  stats.snapshots++;
+  stats.save_ns += std::chrono::duration<double, std::nano>(saved - start).count();
+  stats.load_ns += std::chrono::duration<double, std::nano>(stop - restore).count();
+  stats.state_bytes = state.bytes().size();
+}
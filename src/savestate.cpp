@@ -0,0 +1,49 @@
+#include "savestate.hpp"
+
+#include "console.hpp"
+
+static const u8 savestate_magic[4] = {'N', 'E', 'S', 'S'};
+static const std::size_t size_offset = 8;  // Of the total size in the header.
+
+void save_state(console &machine, state_buffer &state) {
+  cartridge &cart = machine.get_cartridge();
+  state.clear();
+  state.put_bytes(savestate_magic, sizeof(savestate_magic));
+  state.put(savestate_version);
+  state.put(cart.get_mapper_number());
+  state.put(u8(cart.has_chr_ram()));
+  state.put(u32(0));  // Filled in at the end.
+
+  machine.save_state(state);
+
+  u32 size = state.bytes().size();
+  for (std::size_t ii = 0; ii < 4; ii++) state.bytes()[size_offset + ii] = size >> (8 * ii);
+}
+
+bool load_state(console &machine, state_buffer &state, std::string &error) {
+  cartridge &cart = machine.get_cartridge();
+  // With the same mapper and CHR RAM, the layout is the same, so checking the
+  // header and size up front means every read below succeeds.
+  state.rewind();
+  u8 magic[4];
+  state.get_bytes(magic, sizeof(magic));
+  u16 version = state.get<u16>();
+  u8 mapper_number = state.get<u8>();
+  bool has_chr_ram = state.get<u8>();
+  u32 size = state.get<u32>();
+
+  if (!state.good() || std::memcmp(magic, savestate_magic, sizeof(magic)) != 0)
+    error = "not a save state";
+  else if (version != savestate_version)
+    error = "save state version " + std::to_string(version) + " is not supported";
+  else if (mapper_number != cart.get_mapper_number() || has_chr_ram != cart.has_chr_ram())
+    error = "the save state is for another cartridge";
+  else if (size != state.bytes().size())
+    error = "the save state is truncated";
+  else
+    error.clear();
+  if (!error.empty()) return false;
+
+  machine.load_state(state);
+  return true;
+}
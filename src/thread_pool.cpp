@@ -0,0 +1,48 @@
+#include "thread_pool.hpp"
+
+#include <thread>
+
+work_stealing_pool::work_stealing_pool(unsigned _num_threads) : num_threads(_num_threads) {
+  if (num_threads == 0) num_threads = std::thread::hardware_concurrency();
+  if (num_threads == 0) num_threads = 1;
+  queues = std::vector<task_queue>(num_threads);
+}
+
+bool work_stealing_pool::next_task(unsigned thread, std::size_t &task) {
+  {
+    task_queue &own = queues[thread];
+    std::lock_guard<std::mutex> guard(own.lock);
+    if (!own.tasks.empty()) {
+      task = own.tasks.front();
+      own.tasks.pop_front();
+      return true;
+    }
+  }
+
+  // Steal the task the victim would have run last.
+  for (unsigned ii = 1; ii < num_threads; ii++) {
+    task_queue &victim = queues[(thread + ii) % num_threads];
+    std::lock_guard<std::mutex> guard(victim.lock);
+    if (!victim.tasks.empty()) {
+      task = victim.tasks.back();
+      victim.tasks.pop_back();
+      return true;
+    }
+  }
+  return false;  // Tasks are never added while running, so all are taken.
+}
+
+void work_stealing_pool::run(std::size_t num_tasks,
+                             const std::function<void(std::size_t)> &task) {
+  // Deal round robin, so that each thread starts near the front of the list.
+  for (std::size_t ii = 0; ii < num_tasks; ii++) queues[ii % num_threads].tasks.push_back(ii);
+
+  std::vector<std::thread> threads;
+  for (unsigned thread = 0; thread < num_threads; thread++) {
+    threads.emplace_back([this, thread, &task] {
+      std::size_t next;
+      while (next_task(thread, next)) task(next);
+    });
+  }
+  for (auto &thread : threads) thread.join();
+}
@@ -0,0 +1,38 @@
+#include "tile_cache.hpp"
+
+void tile_cache::attach(const rom_bank<1> &_chr) {
+  chr = &_chr;
+  std::size_t num_banks = chr->get_num_banks();
+  rows.assign(num_banks * tiles_per_bank * 8, 0);
+  valid.assign(num_banks * tiles_per_bank, 0);
+  built.assign(num_banks, 0);
+}
+
+void tile_cache::map(u8 slot, std::size_t bank) {
+  // Same wrap around as rom_bank::bank.
+  bank %= chr->get_num_banks();
+  window_rows[slot] = rows.data() + bank * tiles_per_bank * 8;
+  window_valid[slot] = valid.data() + bank * tiles_per_bank;
+  window_data[slot] = chr->bank(bank);
+
+  if (built[bank]) return;
+  built[bank] = 1;
+  for (std::size_t tile = 0; tile < tiles_per_bank; tile++) decode(slot, tile);
+}
+
+void tile_cache::invalidate_all() { std::memset(valid.data(), 0, valid.size()); }
+
+void tile_cache::decode(u8 slot, std::size_t tile) {
+  const u8 *planes = window_data[slot] + tile * 16;
+  u64 *out = window_rows[slot] + tile * 8;
+  for (int y = 0; y < 8; y++) {
+    u8 low = planes[y];
+    u8 high = planes[y + 8];
+    u8 pixels[8];
+    for (int x = 0; x < 8; x++)
+      pixels[x] = ((low >> (7 - x)) & 1) | (((high >> (7 - x)) & 1) << 1);
+    std::memcpy(&out[y], pixels, sizeof(pixels));
+  }
+  window_valid[slot][tile] = 1;
+  rebuilds++;
+}
@@ -0,0 +1,136 @@
+#include "trace.hpp"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <vector>
+
+#include "disassembler.hpp"
+
+trace_recorder::trace_recorder(const trace_trigger &_trigger)
+    : trigger(_trigger),
+      fd(-1),
+      ring(slots, ring_policy::block),
+      current(nullptr),
+      recorded(0),
+      failed(false) {}
+
+trace_recorder::~trace_recorder() { close(); }
+
+bool trace_recorder::open(const std::string &file_name) {
+#ifdef SIGPIPE
+  // The trace may go to a FIFO. If its reader goes away, writes fail with
+  // EPIPE, which is reported, rather than the signal killing the process.
+  std::signal(SIGPIPE, SIG_IGN);
+#endif
+  fd = ::open(file_name.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    error = std::strerror(errno);
+    return false;
+  }
+  trace_header header = {{'N', 'E', 'S', 'T', 'R', 'A', 'C', 'E'}, version, sizeof(trace_record)};
+  if (!write_all(&header, sizeof(header))) {
+    ::close(fd);
+    fd = -1;
+    return false;
+  }
+  writer = std::thread([this] { run(); });
+  return true;
+}
+
+bool trace_recorder::close() {
+  if (fd < 0) return !failed;
+  if (current) ring.end_write();
+  current = nullptr;
+  ring.close();
+  if (writer.joinable()) writer.join();
+  if (::close(fd) != 0 && !failed) {
+    error = std::strerror(errno);
+    failed = true;
+  }
+  fd = -1;
+  return !failed;
+}
+
+// ------------------- Writer thread ----------------------- //
+void trace_recorder::run() {
+  // After a failure, blocks are still taken from the ring, so that the
+  // emulation never waits for a writer that has stopped.
+  while (trace_block *block = ring.wait_read()) {
+    if (!failed) write_all(block->records, block->count * sizeof(trace_record));
+    ring.end_read();
+  }
+}
+
+bool trace_recorder::write_all(const void *data, std::size_t size) {
+  const char *bytes = static_cast<const char *>(data);
+  while (size) {
+    ssize_t count = ::write(fd, bytes, size);
+    if (count < 0 && errno == EINTR) continue;
+    if (count <= 0) {
+      error = std::strerror(errno);
+      failed = true;
+      return false;
+    }
+    bytes += count;
+    size -= count;
+  }
+  return true;
+}
+
+// ------------------- Text ------------------------------- //
+bool trace_to_text(const std::string &file_name, std::FILE *out, std::string &error) {
+  std::FILE *in = std::fopen(file_name.c_str(), "rb");
+  if (!in) {
+    error = std::strerror(errno);
+    return false;
+  }
+
+  trace_header header;
+  bool valid = std::fread(&header, sizeof(header), 1, in) == 1 &&
+               std::memcmp(header.magic, "NESTRACE", 8) == 0 &&
+               header.version == trace_recorder::version &&
+               header.record_size == sizeof(trace_record);
+  if (!valid) {
+    error = "not a trace, or of another version";
+    std::fclose(in);
+    return false;
+  }
+
+  std::vector<trace_record> records(4096);
+  while (std::size_t count = std::fread(records.data(), sizeof(trace_record), records.size(), in)) {
+    for (std::size_t ii = 0; ii < count; ii++) {
+      const trace_record &entry = records[ii];
+      char bytes[9] = "";  // "4C F5 C5"
+      for (int jj = 0; jj < entry.length && jj < 3; jj++)
+        std::snprintf(bytes + jj * 3, sizeof(bytes) - jj * 3, "%02X ", entry.bytes[jj]);
+      if (entry.length) bytes[std::min(entry.length, u8(3)) * 3 - 1] = '\0';
+
+      // Unofficial opcodes get a * in the column before the mnemonic.
+      std::string text = disassemble(entry.pc, entry.bytes);
+      char mark = ' ';
+      if (!text.empty() && text[0] == '*') {
+        mark = '*';
+        text.erase(0, 1);
+      }
+
+      // nestest starts at dot 21 of line 0, 7 cycles after power on, and the
+      // frames are all 341 * 262 dots long with rendering off. B only exists
+      // in pushed copies of P.
+      u64 dot = entry.cycle * 3;
+      std::fprintf(out,
+                   "%04X  %-8s %c%-32sA:%02X X:%02X Y:%02X P:%02X SP:%02X PPU:%3u,%3u CYC:%llu\n",
+                   entry.pc, bytes, mark, text.c_str(), entry.a, entry.x, entry.y,
+                   (entry.p | 0x20) & ~0x10, entry.sp, unsigned(dot / 341 % 262),
+                   unsigned(dot % 341), (unsigned long long)entry.cycle);
+    }
+  }
+  bool read_error = std::ferror(in);
+  std::fclose(in);
+  if (read_error) error = "cannot read the trace";
+  return !read_error && !std::ferror(out);
+}
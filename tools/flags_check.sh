@@ -0,0 +1,90 @@
+#!/bin/sh
+# Check that the lazy flags of NESCPP_LAZY_FLAGS are exact: build nesemu with
+# and without them, run the same random ROMs on every engine with both, and
+# compare the traces, which hold P before every instruction, and the final
+# states.
+#
+#   tools/flags_check.sh [build directory]
+#
+# ROMS and FRAMES set the number of ROMs and the frames run of each (20 and 30
+# by default). The ROMs come from a seeded generator, so a failing one can be
+# made again, and they are kept in the build directory.
+set -e
+
+src=$(cd "$(dirname "$0")/.." && pwd)
+out=${1:-$src/build/flags_check}
+roms=${ROMS:-20}
+frames=${FRAMES:-30}
+jobs=$(getconf _NPROCESSORS_ONLN 2>/dev/null || echo 1)
+
+for flavour in eager lazy; do
+  if [ "$flavour" = lazy ]; then lazy=ON; else lazy=OFF; fi
+  cmake -Wno-deprecated -S "$src" -B "$out/$flavour" -DNESCPP_LAZY_FLAGS=$lazy >/dev/null
+  cmake --build "$out/$flavour" --target nesemu -j"$jobs" >/dev/null
+done
+
+# An NROM image of random instructions, 32 KB of PRG with every vector at
+# 0x8000, and 8 KB of random CHR. Raw random bytes soon fall into a short
+# loop, so jumps, calls, returns and the opcodes that halt are made NOPs, and
+# branches only go forward: the code runs through with all sorts of values,
+# and starts again at the BRK in the vectors.
+make_rom() {
+  printf 'NES\032\002\001\000\000\000\000\000\000\000\000\000\000' >"$2"
+  LC_ALL=C awk -v seed="$1" '
+    function length_of(op, low) {
+      low = op % 32
+      if (low == 0) return (op == 32) ? 3 : (op >= 128) ? 2 : 1
+      if (low == 16) return 2
+      if (low == 2) return (op >= 128) ? 2 : 1
+      if (low == 8 || low == 10 || low == 18 || low == 24 || low == 26) return 1
+      if (low == 25 || low == 27 || low >= 12) return 3
+      return 2
+    }
+    function halts(op) {
+      return op == 0 || op == 32 || op == 64 || op == 96 || op == 76 || op == 108 ||
+             (op % 32 == 18) || (op % 32 == 2 && op < 128)
+    }
+    BEGIN {
+      srand(seed)
+      size = 0
+      while (size < 32760) {
+        op = int(rand() * 256)
+        if (halts(op)) op = 234
+        count = length_of(op)
+        printf "%c", op
+        for (ii = 1; ii < count; ii++) {
+          byte = int(rand() * 256)
+          if (op % 32 == 16) byte %= 64  # A branch, forward.
+          printf "%c", byte
+        }
+        size += count
+      }
+      for (; size < 32762; size++) printf "%c", 234
+      for (ii = 0; ii < 3; ii++) printf "%c%c", 0, 128
+      for (ii = 0; ii < 8192; ii++) printf "%c", int(rand() * 256)
+    }' >>"$2"
+}
+
+failed=0
+seed=1
+while [ "$seed" -le "$roms" ]; do
+  rom="$out/fuzz$seed.nes"
+  make_rom "$seed" "$rom"
+  for engine in table switch decoded; do
+    for flavour in eager lazy; do
+      "$out/$flavour/nesemu" --engine $engine --trace "$out/$flavour.trace" "$rom" "$frames" |
+        grep -E '^(A:|State hash)' >"$out/$flavour.state"
+    done
+    if cmp -s "$out/eager.trace" "$out/lazy.trace" &&
+      cmp -s "$out/eager.state" "$out/lazy.state"; then
+      echo "$rom, $engine: identical."
+    else
+      echo "$rom, $engine: DIFFERENT."
+      failed=1
+    fi
+  done
+  seed=$((seed + 1))
+done
+
+rm -f "$out/eager.trace" "$out/lazy.trace" "$out/eager.state" "$out/lazy.state"
+exit $failed